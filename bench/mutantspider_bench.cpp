@@ -0,0 +1,709 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "mutantspider_host.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+    Microbenchmarks for mutantspider's hot paths, run against the host build.
+
+    Each benchmark is a named loop.  The harness picks an iteration count that makes one
+    run take at least min_run_ms, then reports the median of num_runs runs.  The output
+    is a single JSON object on stdout:
+
+        {
+          "schema": 1,
+          "suite": "mutantspider",
+          "results": [
+            { "name": "var_construct_int", "unit": "ns/op", "value": 1.234, "iterations": 1048576 },
+            ...
+          ]
+        }
+
+    For "ns/op" results, iterations is the number of calls per run.  For "MB/s" results
+    it is the number of bytes per run.  Names and units are stable from release to release.  A benchmark that is added later
+    is appended to the list; one that is removed is not reused.  Everything other than
+    JSON goes to stderr.
+*/
+
+namespace {
+
+const int   min_run_ms = 50;
+const int   num_runs = 5;
+
+// in case the compiler manages to optimize a loop away entirely
+const uint64_t max_iterations = 1ULL << 32;
+
+typedef std::chrono::steady_clock clock_type;
+
+// keep the compiler from optimizing away the result of the code being measured
+template<typename T>
+inline void do_not_optimize(const T& v)
+{
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+struct result
+{
+    std::string name_;
+    const char* unit_;
+    double      value_;
+    uint64_t    iterations_;
+};
+
+std::vector<result> results;
+
+double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// time 'iters' calls to 'f', in seconds
+template<typename F>
+double time_loop(F& f, uint64_t iters)
+{
+    auto start = clock_type::now();
+    for (uint64_t i = 0; i < iters; i++)
+        f();
+    return seconds_since(start);
+}
+
+// report the median ns per call of 'f'
+template<typename F>
+void bench_ns(const char* name, F f)
+{
+    uint64_t iters = 1;
+    while (time_loop(f, iters) * 1000 < min_run_ms && iters < max_iterations)
+        iters *= 2;
+
+    std::vector<double> times;
+    for (int i = 0; i < num_runs; i++)
+        times.push_back(time_loop(f, iters));
+    std::sort(times.begin(), times.end());
+
+    result r = { name, "ns/op", times[num_runs / 2] * 1e9 / iters, iters };
+    results.push_back(r);
+    fprintf(stderr, "%-32s %12.3f ns/op\n", name, r.value_);
+}
+
+// report the median MB/s of 'f', which processes 'bytes' each time it is called
+template<typename F>
+void bench_mbps(const char* name, size_t bytes, F f)
+{
+    std::vector<double> times;
+    for (int i = 0; i < num_runs; i++)
+    {
+        auto start = clock_type::now();
+        f();
+        times.push_back(seconds_since(start));
+    }
+    std::sort(times.begin(), times.end());
+
+    result r = { name, "MB/s", bytes / times[num_runs / 2] / (1024 * 1024), bytes };
+    results.push_back(r);
+    fprintf(stderr, "%-32s %12.3f MB/s\n", name, r.value_);
+}
+
+void print_json()
+{
+    printf("{\n  \"schema\": 1,\n  \"suite\": \"mutantspider\",\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto& r = results[i];
+        printf("    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"iterations\": %llu }%s\n",
+                r.name_.c_str(), r.unit_, r.value_, (unsigned long long)r.iterations_, i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+void die(const char* what)
+{
+    fprintf(stderr, "%s failed, errno: %d\n", what, errno);
+    exit(1);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void bench_var()
+{
+    std::string short_str("sixteen chars...");
+    std::string long_str(256, 'x');
+    std::map<std::string, std::string> map;
+    for (int i = 0; i < 8; i++)
+        map["key_" + std::to_string(i)] = "value_" + std::to_string(i);
+
+    bench_ns("var_construct_int", [&]{ mutantspider::Var v((int32_t)17); do_not_optimize(v); });
+    bench_ns("var_construct_string_short", [&]{ mutantspider::Var v(short_str); do_not_optimize(v); });
+    bench_ns("var_construct_string_long", [&]{ mutantspider::Var v(long_str); do_not_optimize(v); });
+
+    mutantspider::Var str_var(short_str);
+    mutantspider::Var dict_var(map);
+    bench_ns("var_copy_string", [&]{ mutantspider::Var v(str_var); do_not_optimize(v); });
+    bench_ns("var_copy_dictionary", [&]{ mutantspider::Var v(dict_var); do_not_optimize(v); });
+
+    mutantspider::VarDictionary dict(dict_var);
+    bench_ns("dict_get", [&]{ auto v = dict.Get("key_5"); do_not_optimize(v); });
+    bench_ns("dict_get_missing", [&]{ auto v = dict.Get("not_a_key"); do_not_optimize(v); });
+    bench_ns("dict_get_keys", [&]{ auto v = dict.GetKeys(); do_not_optimize(v); });
+}
+
+class callback_target
+{
+public:
+    callback_target() : count_(0), factory_(this) {}
+
+    void on_done(int32_t result)
+    {
+        count_ += result;
+    }
+
+    int64_t                                                 count_;
+    mutantspider::CompletionCallbackFactory<callback_target> factory_;
+};
+
+void bench_callbacks()
+{
+    callback_target target;
+    bench_ns("callback_new_run", [&]{ target.factory_.NewCallback(&callback_target::on_done).Run(1); });
+    do_not_optimize(target.count_);
+}
+
+// added after the first release of the suite, so these are reported last
+void bench_callback_variants()
+{
+    callback_target target;
+    bench_ns("callback_new_run_static", [&]{ target.factory_.NewCallback<&callback_target::on_done>().Run(1); do_not_optimize(target.count_); });
+
+    int64_t count = 0;
+    int64_t more[4] = {1, 2, 3, 4};
+    bench_ns("callback_lambda_run", [&]{ mutantspider::make_callback([&count, more](int32_t r){ count += r + more[3]; }).Run(1); do_not_optimize(count); });
+    do_not_optimize(target.count_);
+    do_not_optimize(count);
+}
+
+void bench_image_data()
+{
+    auto fmt = mutantspider::ImageData::GetNativeImageDataFormat();
+    bench_ns("image_data_alloc_64x64", [&]{ mutantspider::ImageData id(0, fmt, mutantspider::Size(64, 64), true); do_not_optimize(id); });
+
+    mutantspider::ImageData id(0, fmt, mutantspider::Size(64, 64), true);
+    bench_ns("image_data_copy", [&]{ mutantspider::ImageData c(id); do_not_optimize(c); });
+}
+
+void bench_rect()
+{
+    mutantspider::Rect a(10, 10, 100, 100);
+    mutantspider::Rect b(50, 60, 100, 100);
+    bench_ns("rect_intersect", [&]{ auto r = a.Intersect(b); do_not_optimize(r); });
+    bench_ns("rect_union", [&]{ auto r = a.Union(b); do_not_optimize(r); });
+}
+
+////////////////////////////////////////////////////////////////////
+
+/*
+    The resource tree.  Normally mutantspider.mk generates this from $(RESOURCES).
+    Here it is built at startup:
+
+        /resources/file_00 ... file_63          (4KB each)
+        /resources/a/b/file_00 ... file_63      (4KB each)
+        /resources/z_lz4                        (256KB, lz4 compressed in 64KB blocks)
+        /resources/z_pack                       (256KB, in the resource pack, see make_pack_file)
+*/
+const int               num_rez_files = 64;
+const size_t            rez_file_size = 4096;
+unsigned char           rez_data[rez_file_size];
+char                    rez_names[num_rez_files][8];
+mutantspider::rez_file_ent  rez_files[num_rez_files];
+mutantspider::rez_dir_ent   rez_b_ents[num_rez_files];
+mutantspider::rez_dir_ent   rez_a_ents[1];
+mutantspider::rez_dir_ent   rez_root_ents[num_rez_files + 3];
+const mutantspider::rez_dir rez_b = { num_rez_files, rez_b_ents, 1 };
+const mutantspider::rez_dir rez_a = { 1, rez_a_ents, 1 };
+
+const size_t            lz4_file_size = 256 * 1024;
+const uint32_t          lz4_block_size = 64 * 1024;
+std::vector<unsigned char>  lz4_data;
+std::vector<uint32_t>   lz4_blocks;
+mutantspider::rez_file_ent  lz4_file;
+
+// z_pack starts pack_file_offset bytes into the pack, which is where rez_data's pattern starts over
+const size_t            pack_file_offset = 4096;
+const size_t            pack_file_size = 256 * 1024;
+const mutantspider::rez_file_ent    pack_file = { 0, pack_file_size, 0, 64 * 1024, pack_file_offset };
+
+// lz4's encoding of a length that doesn't fit in its 4 bit field
+void put_lz4_length(size_t len)
+{
+    for (; len >= 255; len -= 255)
+        lz4_data.push_back(255);
+    lz4_data.push_back((unsigned char)len);
+}
+
+/*
+    the blocks of z_lz4, which repeats rez_data's 256 byte pattern.  Each block is
+    the pattern as literals, one match that repeats it up to 5 bytes from the end
+    of the block, and those 5 bytes as literals (the way mutantspider_rezpack's
+    compressor would write it)
+*/
+void build_lz4_file()
+{
+    for (size_t i = 0; i < lz4_file_size / lz4_block_size; i++)
+    {
+        lz4_blocks.push_back((uint32_t)lz4_data.size());
+        lz4_data.push_back(0xff);
+        put_lz4_length(256 - 15);
+        lz4_data.insert(lz4_data.end(), rez_data, rez_data + 256);
+        lz4_data.push_back(0);
+        lz4_data.push_back(1);      // offset 256
+        put_lz4_length(lz4_block_size - 256 - 5 - 4 - 15);
+        lz4_data.push_back(5 << 4);
+        lz4_data.insert(lz4_data.end(), rez_data + 256 - 5, rez_data + 256);
+    }
+    lz4_blocks.push_back((uint32_t)lz4_data.size());
+    lz4_file.file_data = &lz4_data[0];
+    lz4_file.file_data_sz = lz4_file_size;
+    lz4_file.blocks = &lz4_blocks[0];
+    lz4_file.block_size = lz4_block_size;
+}
+
+void build_rez_tree()
+{
+    for (size_t i = 0; i < rez_file_size; i++)
+        rez_data[i] = (unsigned char)i;
+    for (int i = 0; i < num_rez_files; i++)
+    {
+        snprintf(rez_names[i], sizeof(rez_names[i]), "file_%02d", i);
+        rez_files[i].file_data = rez_data;
+        rez_files[i].file_data_sz = rez_file_size;
+        rez_b_ents[i].d_name = rez_names[i];
+        rez_b_ents[i].ptr.file = &rez_files[i];
+        rez_b_ents[i].is_dir = 0;
+        rez_root_ents[i + 1] = rez_b_ents[i];
+    }
+    rez_a_ents[0].d_name = "b";
+    rez_a_ents[0].ptr.dir = &rez_b;
+    rez_a_ents[0].is_dir = 1;
+    
+    // sorted, the way mutantspider.mk writes it
+    rez_root_ents[0].d_name = "a";
+    rez_root_ents[0].ptr.dir = &rez_a;
+    rez_root_ents[0].is_dir = 1;
+    
+    build_lz4_file();
+    rez_root_ents[num_rez_files + 1].d_name = "z_lz4";
+    rez_root_ents[num_rez_files + 1].ptr.file = &lz4_file;
+    rez_root_ents[num_rez_files + 1].is_dir = 0;
+    
+    rez_root_ents[num_rez_files + 2].d_name = "z_pack";
+    rez_root_ents[num_rez_files + 2].ptr.file = &pack_file;
+    rez_root_ents[num_rez_files + 2].is_dir = 0;
+}
+
+// list 'path' the way a file browser would without scan_dir: readdir, then stat each entry
+size_t list_dir(const std::string& path)
+{
+    DIR* dir = opendir(path.c_str());
+    if (!dir)
+        die("opendir");
+    size_t count = 0;
+    std::string ent_path;
+    while (struct dirent* ent = readdir(dir))
+    {
+        ent_path = path + "/" + ent->d_name;
+        struct stat st;
+        if (stat(ent_path.c_str(), &st) == 0)
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+// the same with mutantspider::scan_dir
+size_t scan_dir(const std::string& path)
+{
+    mutantspider::dir_scan scan;
+    if (mutantspider::scan_dir(path, scan) != 0)
+        die("scan_dir");
+    return scan.entries.size();
+}
+
+void bench_rezfs()
+{
+    struct stat st;
+    bench_ns("rezfs_stat_first", [&]{ if (stat("/resources/file_00", &st) != 0) die("stat"); });
+    bench_ns("rezfs_stat_last", [&]{ if (stat("/resources/file_63", &st) != 0) die("stat"); });
+    bench_ns("rezfs_stat_depth3", [&]{ if (stat("/resources/a/b/file_63", &st) != 0) die("stat"); });
+    bench_ns("rezfs_stat_missing", [&]{ if (stat("/resources/a/b/nope", &st) == 0) die("stat"); });
+
+    char buf[rez_file_size];
+    bench_ns("rezfs_open_read_close_4k", [&]
+        {
+            int fd = open("/resources/a/b/file_31", O_RDONLY);
+            if (fd == -1 || read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+                die("open/read");
+            close(fd);
+        });
+    
+    bench_ns("rezfs_list_dir_64", [&]{ do_not_optimize(list_dir("/resources/a/b")); });
+    bench_ns("rezfs_scan_dir_64", [&]{ do_not_optimize(scan_dir("/resources/a/b")); });
+    
+    // all of z_lz4 in 4KB reads, with and without the decompressed block cache
+    auto read_lz4_file = [&]
+        {
+            int fd = open("/resources/z_lz4", O_RDONLY);
+            if (fd == -1)
+                die("open");
+            for (size_t i = 0; i < lz4_file_size / sizeof(buf); i++)
+            {
+                if (read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[0] != (char)(i * sizeof(buf)))
+                    die("read");
+            }
+            close(fd);
+        };
+    bench_ns("rezfs_read_lz4_256k_in_4k", read_lz4_file);
+    mutantspider::set_resource_cache_limit(0);
+    bench_ns("rezfs_read_lz4_256k_in_4k_no_cache", read_lz4_file);
+    mutantspider::set_resource_cache_limit(1024 * 1024);
+}
+
+////////////////////////////////////////////////////////////////////
+
+std::string bench_fs_root;
+
+int rm_entry(const char* path, const struct stat*, int, struct FTW*)
+{
+    return remove(path);
+}
+
+void remove_bench_fs_root()
+{
+    nftw(bench_fs_root.c_str(), rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// read through the block cache (see mutantspider::set_persistent_cache)
+const size_t cached_file_size = 16 * 1024 * 1024;
+
+// the resource pack, which the host URLLoader reads from bench_fs_root
+void make_pack_file()
+{
+    FILE* f = fopen((bench_fs_root + "/rez.pack").c_str(), "wb");
+    if (!f)
+        die("fopen");
+    for (size_t i = 0; i < (pack_file_offset + pack_file_size) / rez_file_size; i++)
+    {
+        if (fwrite(rez_data, 1, rez_file_size, f) != rez_file_size)
+            die("fwrite");
+    }
+    fclose(f);
+}
+
+void make_cached_file()
+{
+    auto dir = bench_fs_root + "/bench";
+    mkdir(dir.c_str(), 0777);
+    FILE* f = fopen((dir + "/cached_file").c_str(), "wb");
+    if (!f)
+        die("fopen");
+    std::vector<char> buf(cached_file_size, 'c');
+    if (fwrite(&buf[0], 1, buf.size(), f) != buf.size())
+        die("fwrite");
+    fclose(f);
+}
+
+// wait until the background thread has mirrored 'size' bytes of 'name' to the host fs root
+void wait_for_mirror(const std::string& name, off_t size)
+{
+    auto path = bench_fs_root + "/bench/" + name;
+    auto start = clock_type::now();
+    struct stat st;
+    while (stat(path.c_str(), &st) != 0 || st.st_size != size)
+    {
+        if (seconds_since(start) > 60)
+        {
+            fprintf(stderr, "timed out waiting for %s to be mirrored\n", path.c_str());
+            exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+// wait until everything written to /persistent so far has been mirrored and synced
+void wait_for_flush()
+{
+    int32_t flushed = 1;
+    mutantspider::flush_persistent(mutantspider::make_callback([&flushed](int32_t result) { flushed = result; }));
+    if (!mutantspider::host::run_until([&flushed] { return flushed != 1; }, 60000))
+    {
+        fprintf(stderr, "timed out waiting for flush_persistent\n");
+        exit(1);
+    }
+}
+
+void bench_pbmemfs()
+{
+    const size_t total = 16 * 1024 * 1024;
+    const size_t chunk = 64 * 1024;
+    std::vector<char> buf(chunk, 'm');
+
+    auto write_file = [&](const char* path)
+        {
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1)
+                die("open");
+            for (size_t pos = 0; pos < total; pos += chunk)
+            {
+                if (write(fd, &buf[0], chunk) != (ssize_t)chunk)
+                    die("write");
+            }
+            close(fd);
+        };
+
+    // how fast the caller's writes return.  Mirroring happens in the background
+    bench_mbps("pbmemfs_write_64k", total, [&]{ write_file("/persistent/bench/write_file"); });
+    wait_for_mirror("write_file", total);
+
+    bench_mbps("pbmemfs_read_64k", total, [&]
+        {
+            int fd = open("/persistent/bench/write_file", O_RDONLY);
+            if (fd == -1)
+                die("open");
+            for (size_t pos = 0; pos < total; pos += chunk)
+            {
+                if (read(fd, &buf[0], chunk) != (ssize_t)chunk)
+                    die("read");
+            }
+            close(fd);
+        });
+
+    // from the first write until the mirrored copy is complete.  flush_persistent doesn't
+    // wait out the flush delay, and (unlike watching the size) isn't fooled by the copy
+    // the previous run left behind
+    bench_mbps("pbmemfs_mirror_64k", total, [&]
+        {
+            write_file("/persistent/bench/mirror_file");
+            wait_for_flush();
+        });
+
+    // the same writes made from another thread with the backlog capped at 1MB
+    // (see mutantspider::set_persistent_backlog_limit), so they keep pace with the mirror
+    mutantspider::set_persistent_backlog_limit(1024 * 1024, 0);
+    bench_mbps("pbmemfs_capped_write_64k", total, [&]
+        {
+            std::thread t([&]{ write_file("/persistent/bench/capped_file"); });
+            t.join();
+        });
+    wait_for_mirror("capped_file", total);
+    mutantspider::set_persistent_backlog_limit(0, 0);
+
+    int fd = open("/persistent/bench/small_file", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        die("open");
+    off_t pos = 0;
+    bench_ns("pbmemfs_pwrite_4k", [&]
+        {
+            if (pwrite(fd, &buf[0], 4096, pos) != 4096)
+                die("pwrite");
+            pos = (pos + 4096) % (1024 * 1024);
+        });
+    bench_ns("pbmemfs_pread_4k", [&]
+        {
+            if (pread(fd, &buf[0], 4096, 0) != 4096)
+                die("pread");
+        });
+    close(fd);
+    wait_for_mirror("small_file", 1024 * 1024);
+
+    struct stat st;
+    bench_ns("pbmemfs_stat", [&]{ if (stat("/persistent/bench/small_file", &st) != 0) die("stat"); });
+
+    mkdir("/persistent/bench/dir", 0777);
+    for (int i = 0; i < 64; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/persistent/bench/dir/file_%02d", i);
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1)
+            die("open");
+        close(fd);
+    }
+    bench_ns("pbmemfs_list_dir_64", [&]{ do_not_optimize(list_dir("/persistent/bench/dir")); });
+    bench_ns("pbmemfs_scan_dir_64", [&]{ do_not_optimize(scan_dir("/persistent/bench/dir")); });
+
+    // cached_file was in the store before init_fs, and is bigger than the block cache
+    bench_mbps("pbmemfs_cached_read_64k", cached_file_size, [&]
+        {
+            int fd = open("/persistent/bench/cached_file", O_RDONLY);
+            if (fd == -1)
+                die("open");
+            for (size_t pos = 0; pos < cached_file_size; pos += chunk)
+            {
+                if (read(fd, &buf[0], chunk) != (ssize_t)chunk)
+                    die("read");
+            }
+            close(fd);
+        });
+}
+
+// reads of z_pack once fetch_resource has downloaded it
+void bench_rez_pack()
+{
+    char buf[rez_file_size];
+    int fd = open("/resources/z_pack", O_RDONLY);
+    if (fd == -1)
+        die("open");
+    // the main thread doesn't wait for downloads
+    if (read(fd, buf, sizeof(buf)) != -1 || errno != EAGAIN)
+        die("read before fetch_resource");
+    close(fd);
+    
+    int32_t fetched = 1;
+    mutantspider::fetch_resource("/resources/z_pack", mutantspider::make_callback([&fetched](int32_t result) { fetched = result; }));
+    if (!mutantspider::host::run_until([&fetched] { return fetched != 1; }, 30000) || fetched != MS_OK)
+        die("fetch_resource");
+    
+    bench_ns("rezfs_read_pack_256k_in_4k", [&]
+        {
+            int fd = open("/resources/z_pack", O_RDONLY);
+            if (fd == -1)
+                die("open");
+            for (size_t i = 0; i < pack_file_size / sizeof(buf); i++)
+            {
+                if (read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[1] != 1)
+                    die("read");
+            }
+            close(fd);
+        });
+}
+
+// the same 4KB as rezfs_open_read_close_4k, without the file system
+void bench_resource_view()
+{
+    uint64_t sum = 0;
+    bench_ns("rezfs_resource_view_4k", [&]
+        {
+            mutantspider::resource_view view;
+            if (mutantspider::get_resource_view("/resources/a/b/file_31", view) != 0 || view.size != rez_file_size)
+                die("get_resource_view");
+            sum += view.data[view.size - 1];
+        });
+    bench_ns("rezfs_mmap_4k", [&]
+        {
+            int fd = open("/resources/a/b/file_31", O_RDONLY);
+            auto mem = fd == -1 ? MAP_FAILED : mmap(0, rez_file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem == MAP_FAILED)
+                die("mmap");
+            sum += ((unsigned char*)mem)[rez_file_size - 1];
+            munmap(mem, rez_file_size);
+            close(fd);
+        });
+    do_not_optimize(sum);
+}
+
+////////////////////////////////////////////////////////////////////
+
+class BenchInstance : public MS_AppInstance
+{
+public:
+    explicit BenchInstance(MS_Instance instance)
+        : MS_AppInstance(instance)
+    {}
+
+    virtual bool Init(uint32_t argc, const char* argn[], const char* argv[])
+    {
+        mutantspider::set_persistent_cache(1024 * 1024, 4 * 1024 * 1024);
+        mutantspider::init_fs(this, std::vector<std::string>(1, "bench"), mutantspider::persistent_load_on_open);
+        return true;
+    }
+};
+
+class BenchModule : public MS_Module
+{
+public:
+    virtual MS_AppInstancePtr CreateInstance(MS_Instance instance)
+    {
+        return new BenchInstance(instance);
+    }
+};
+
+void quiet_handler(const char* msg, void*)
+{
+}
+
+}
+
+namespace mutantspider
+{
+    extern const rez_dir rez_root_dir = { num_rez_files + 3, rez_root_ents, 1 };
+    extern const rez_dir_ent rez_root_dir_ent = { "", { (const rez_file_ent*)&rez_root_dir }, 1 };
+    extern const char* const rez_pack_url = "rez.pack";
+}
+
+namespace pp
+{
+    MS_Module* CreateModule() { return new BenchModule(); }
+}
+
+int main(int argc, char* argv[])
+{
+    build_rez_tree();
+
+    char tmpl[] = "/tmp/ms_bench_XXXXXX";
+    if (!mkdtemp(tmpl))
+        die("mkdtemp");
+    bench_fs_root = tmpl;
+    atexit(remove_bench_fs_root);
+    mutantspider::host::set_fs_root(bench_fs_root);
+    make_cached_file();
+    make_pack_file();
+    mutantspider::host::set_url_root(bench_fs_root);
+    mutantspider::host::set_message_handler(quiet_handler, 0);
+
+    MS_Init(0);
+    if (!mutantspider::host::run_until(mutantspider::host::startup_complete, 30000))
+    {
+        fprintf(stderr, "timed out waiting for async_startup_complete\n");
+        return 1;
+    }
+
+    bench_var();
+    bench_callbacks();
+    bench_image_data();
+    bench_rect();
+    bench_rezfs();
+    bench_pbmemfs();
+    bench_callback_variants();
+    bench_rez_pack();
+    bench_resource_view();
+
+    print_json();
+    return 0;
+}
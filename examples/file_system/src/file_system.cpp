@@ -25,6 +25,7 @@
 #include "resource_tests.h"
 
 #include <sys/stat.h>
+#include <string.h>
 
 // defining this skips the fuse-based implementation of the
 // persistent storage file system, allowing you to see what
@@ -48,7 +49,16 @@ bool FileSystemInstance::Init(uint32_t argc, const char* argn[], const char* arg
     #if !defined(NO_FUSE)
     persistent_dirs.push_back("file_system_example");
     #endif
-    mutantspider::init_fs(this, persistent_dirs);
+    
+    // persistent_store="journal" runs the tests against persistent_journal instead of
+    // persistent_mirror (the host driver's -a option sets it there)
+    auto store = mutantspider::persistent_mirror;
+    for (uint32_t i = 0; i < argc; i++)
+    {
+        if (strcmp(argn[i], "persistent_store") == 0 && strcmp(argv[i], "journal") == 0)
+            store = mutantspider::persistent_journal;
+    }
+    mutantspider::init_fs(this, persistent_dirs, mutantspider::persistent_load_all, store);
 
     return true;
 }
@@ -24,6 +24,12 @@
 
 #include "mutantspider.h"
 #include "errno.h"
+#include <dirent.h>
+#include <vector>
+
+#if defined(MUTANTSPIDER_HOST)
+  #include "mutantspider_host.h"
+#endif
 
 class FileSystemInstance : public MS_AppInstance
 {
@@ -76,3 +82,40 @@ inline std::string to_octal_string(int i)
 }
 
 #define LINE_PFX std::string("[") + std::to_string(__LINE__) + "] "
+
+// the names opendir/readdir return for 'dir_name', in order
+inline std::vector<std::string> dir_names(const char* dir_name)
+{
+    std::vector<std::string> names;
+    if (DIR* dir = opendir(dir_name))
+    {
+        while (struct dirent* ent = readdir(dir))
+            names.push_back(ent->d_name);
+        closedir(dir);
+    }
+    return names;
+}
+
+#if defined(MUTANTSPIDER_HOST)
+/*
+    host build only: list 'dir_name' again with the file system returning one entry per
+    readdir call, so every entry after the first comes from resuming at the offset the
+    previous call handed back.  It must list the same names in the same order.
+*/
+inline void check_readdir_resumes(FileSystemInstance* inst, const char* dir_name, int& num_tests_run, int& num_tests_failed)
+{
+    auto names = dir_names(dir_name);
+    mutantspider::host::set_readdir_batch_size(1);
+    auto one_at_a_time = dir_names(dir_name);
+    mutantspider::host::set_readdir_batch_size(0);
+    
+    ++num_tests_run;
+    if (names.size() > 2 && one_at_a_time == names)
+        inst->PostMessage(LINE_PFX + "readdir(\"" + dir_name + "\") one entry per call listed the same " + std::to_string(names.size()) + " entries");
+    else
+    {
+        ++num_tests_failed;
+        inst->PostError(LINE_PFX + "readdir(\"" + dir_name + "\") one entry per call listed " + std::to_string(one_at_a_time.size()) + " entries instead of the same " + std::to_string(names.size()));
+    }
+}
+#endif
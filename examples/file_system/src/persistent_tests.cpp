@@ -70,6 +70,165 @@ void clear_all(const std::string& dir_name)
     int ret = rmdir(dir_name.c_str());
 }
 
+std::string read_string(const std::string& path)
+{
+    std::string s;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return s;
+    char buf[4096];
+    ssize_t bytes;
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+        s.append(buf, bytes);
+    close(fd);
+    return s;
+}
+
+bool write_string(int fd, const std::string& s)
+{
+    return write(fd, s.data(), s.size()) == (ssize_t)s.size();
+}
+
+bool write_file(const std::string& path, const std::string& s)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return false;
+    bool ok = write_string(fd, s);
+    return close(fd) == 0 && ok;
+}
+
+void check(FileSystemInstance* inst, int& num_tests_run, int& num_tests_failed, bool ok, const std::string& what)
+{
+    ++num_tests_run;
+    if (ok)
+        inst->PostMessage(what);
+    else
+    {
+        ++num_tests_failed;
+        inst->PostError(what + " failed" + (errno ? ", errno: " + errno_string() : std::string()));
+    }
+}
+
+#define kOpsDir "/persistent/file_system_example/ops"
+
+/*
+    In the browser, the ops below are mirrored (or journaled) in the background, where they
+    are merged with the ops queued after them, and dropped when a later op makes them pointless.
+    Each is made while the ones before it are still pending, and validate_pending_ops checks
+    on the next page load that what was stored matches what was done.
+*/
+void store_pending_ops(FileSystemInstance* inst, int& num_tests_run, int& num_tests_failed)
+{
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, mkdir(kOpsDir, 0777) == 0, LINE_PFX + "mkdir(\"" kOpsDir "\", 0777)");
+    
+    // save to a temp file, then rename it over the real one
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/settings", "old settings"), LINE_PFX + "write \"old settings\" to settings");
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/settings.tmp", "new settings"), LINE_PFX + "write \"new settings\" to settings.tmp");
+    check(inst, num_tests_run, num_tests_failed, rename(kOpsDir "/settings.tmp", kOpsDir "/settings") == 0, LINE_PFX + "rename(settings.tmp, settings)");
+    
+    // truncates, chmods and utimes that are merged with each other.  The second truncate
+    // extends the file again, with zeros
+    std::string a(1000, 'a');
+    struct timeval tv1[2] = {{0, 0}, {1000, 0}};
+    struct timeval tv2[2] = {{0, 0}, {2000, 0}};
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/attrs", a), LINE_PFX + "write 1000 bytes to attrs");
+    check(inst, num_tests_run, num_tests_failed, truncate(kOpsDir "/attrs", 600) == 0, LINE_PFX + "truncate(attrs, 600)");
+    check(inst, num_tests_run, num_tests_failed, chmod(kOpsDir "/attrs", 0640) == 0, LINE_PFX + "chmod(attrs, 0640)");
+    check(inst, num_tests_run, num_tests_failed, truncate(kOpsDir "/attrs", 800) == 0, LINE_PFX + "truncate(attrs, 800)");
+    check(inst, num_tests_run, num_tests_failed, utimes(kOpsDir "/attrs", tv1) == 0, LINE_PFX + "utimes(attrs, mtime 1000)");
+    check(inst, num_tests_run, num_tests_failed, chmod(kOpsDir "/attrs", 0604) == 0, LINE_PFX + "chmod(attrs, 0604)");
+    check(inst, num_tests_run, num_tests_failed, utimes(kOpsDir "/attrs", tv2) == 0, LINE_PFX + "utimes(attrs, mtime 2000)");
+    
+    // a file renamed while it is open with written data not yet flushed, and written to again after
+    std::string p(64 * 1024, 'p');
+    std::string q(64 * 1024, 'q');
+    int fd = open(kOpsDir "/pending", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    check(inst, num_tests_run, num_tests_failed, fd != -1 && write_string(fd, p), LINE_PFX + "write 64KB to pending");
+    check(inst, num_tests_run, num_tests_failed, rename(kOpsDir "/pending", kOpsDir "/renamed") == 0, LINE_PFX + "rename(pending, renamed) while it is open");
+    check(inst, num_tests_run, num_tests_failed, fd != -1 && write_string(fd, q), LINE_PFX + "write 64KB more to it");
+    if (fd != -1)
+        close(fd);
+    
+    // a file unlinked before its data has been flushed
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/doomed", p), LINE_PFX + "write 64KB to doomed");
+    check(inst, num_tests_run, num_tests_failed, unlink(kOpsDir "/doomed") == 0, LINE_PFX + "unlink(doomed)");
+    
+    // and one renamed over another before either has been flushed
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/victim", "victim"), LINE_PFX + "write \"victim\" to victim");
+    check(inst, num_tests_run, num_tests_failed, write_file(kOpsDir "/replacement", q), LINE_PFX + "write 64KB to replacement");
+    check(inst, num_tests_run, num_tests_failed, rename(kOpsDir "/replacement", kOpsDir "/victim") == 0, LINE_PFX + "rename(replacement, victim)");
+    
+    #if defined(MUTANTSPIDER_HOST)
+    check_readdir_resumes(inst, kOpsDir, num_tests_run, num_tests_failed);
+    #endif
+}
+
+/*
+    fsync on the main thread can't wait for the data to reach the browser's storage, so it
+    fails with EAGAIN until the sync it queued has been done.  Returns the file's descriptor,
+    which check_synced_file then fsyncs again once flush_persistent says that has happened.
+*/
+int store_synced_file(FileSystemInstance* inst, int& num_tests_run, int& num_tests_failed)
+{
+    std::string s(16 * 1024, 's');
+    int fd = open(kOpsDir "/synced", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    check(inst, num_tests_run, num_tests_failed, fd != -1 && write_string(fd, s), LINE_PFX + "write 16KB to synced");
+    if (fd == -1)
+        return -1;
+    #if !defined(EMSCRIPTEN)
+    errno = 0;
+    int ret = fsync(fd);
+    check(inst, num_tests_run, num_tests_failed, ret == -1 && errno == EAGAIN, LINE_PFX + "fsync(synced) on the main thread fails with EAGAIN");
+    errno = 0;
+    ret = fsync(fd);
+    check(inst, num_tests_run, num_tests_failed, ret == -1 && errno == EAGAIN, LINE_PFX + "fsync(synced) again, before the sync has been done, fails with EAGAIN");
+    #endif
+    return fd;
+}
+
+// called from flush_persistent's callback with store_synced_file's descriptor
+void check_synced_file(FileSystemInstance* inst, int fd)
+{
+    if (fd == -1)
+        return;
+    errno = 0;
+    if (fsync(fd) == 0)
+        inst->PostMessage(LINE_PFX + "fsync(synced) returns 0 once flush_persistent is done");
+    else
+        inst->PostError(LINE_PFX + "fsync(synced) after flush_persistent failed, errno: " + errno_string());
+    close(fd);
+}
+
+void validate_pending_ops(FileSystemInstance* inst, int& num_tests_run, int& num_tests_failed)
+{
+    struct stat st;
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, read_string(kOpsDir "/settings") == "new settings", LINE_PFX + "settings contains \"new settings\"");
+    check(inst, num_tests_run, num_tests_failed, stat(kOpsDir "/settings.tmp", &st) != 0 && errno == ENOENT, LINE_PFX + "settings.tmp is gone");
+    
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, stat(kOpsDir "/attrs", &st) == 0 && st.st_size == 800, LINE_PFX + "attrs is 800 bytes");
+    #if !defined(__native_client__) || PPAPI_RELEASE >= 39
+    check(inst, num_tests_run, num_tests_failed, (st.st_mode & 0777) == 0604, LINE_PFX + "attrs has mode 0604 (it is " + to_octal_string(st.st_mode & 0777) + ")");
+    check(inst, num_tests_run, num_tests_failed, st.st_mtime == 2000, LINE_PFX + "attrs has mtime 2000 (it is " + std::to_string(st.st_mtime) + ")");
+    #endif
+    check(inst, num_tests_run, num_tests_failed, read_string(kOpsDir "/attrs") == std::string(600, 'a') + std::string(200, 0), LINE_PFX + "attrs is 600 a's then 200 zeros");
+    
+    check(inst, num_tests_run, num_tests_failed, read_string(kOpsDir "/renamed") == std::string(64 * 1024, 'p') + std::string(64 * 1024, 'q'), LINE_PFX + "renamed has both writes");
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, stat(kOpsDir "/pending", &st) != 0 && errno == ENOENT, LINE_PFX + "pending is gone");
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, stat(kOpsDir "/doomed", &st) != 0 && errno == ENOENT, LINE_PFX + "doomed is gone");
+    errno = 0;
+    check(inst, num_tests_run, num_tests_failed, read_string(kOpsDir "/victim") == std::string(64 * 1024, 'q'), LINE_PFX + "victim has replacement's contents");
+    check(inst, num_tests_run, num_tests_failed, stat(kOpsDir "/replacement", &st) != 0 && errno == ENOENT, LINE_PFX + "replacement is gone");
+    check(inst, num_tests_run, num_tests_failed, read_string(kOpsDir "/synced") == std::string(16 * 1024, 's'), LINE_PFX + "synced has its 16KB");
+    
+    clear_all(kOpsDir);
+}
+
 }
 
 #define kReallyBigFileSize 1000000
@@ -299,6 +458,8 @@ std::pair<int,int> persistent_tests(FileSystemInstance* inst)
                 }
                 
                 clear_all("/persistent/file_system_example/root");
+                
+                validate_pending_ops(inst, num_tests_run, num_tests_failed);
             }
             else
             {
@@ -625,6 +786,16 @@ std::pair<int,int> persistent_tests(FileSystemInstance* inst)
                 close(fd);
             }
             
+            store_pending_ops(inst, num_tests_run, num_tests_failed);
+            int synced_fd = store_synced_file(inst, num_tests_run, num_tests_failed);
+            
+            // the next page load validates what was stored here, and nacl gives us no chance to
+            // finish up when the page is closed.  So this is the point after which it must all be there
+            mutantspider::flush_persistent(mutantspider::make_callback([inst, synced_fd](int32_t)
+                {
+                    check_synced_file(inst, synced_fd);
+                    inst->PostMessage("Persistent File Tests: stored data flushed");
+                }));
         }
     }
     else
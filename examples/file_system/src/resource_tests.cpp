@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <utime.h>
+#include <sys/mman.h>
 
 #if defined(__native_client__)
   #include <ppapi/c/pp_macros.h> // for PPAPI_RELEASE
@@ -98,6 +99,9 @@ std::pair<int,int> resource_tests(FileSystemInstance* inst)
     inst->PostHeading("Resource File Tests (see RESOURCES definition in Makefile for file layout):");
     
     list_dir(inst, "/resources", num_tests_run, num_tests_failed, 0);
+    #if defined(MUTANTSPIDER_HOST)
+    check_readdir_resumes(inst, "/resources", num_tests_run, num_tests_failed);
+    #endif
  
     inst->PostMessage("");
     
@@ -257,6 +261,83 @@ std::pair<int,int> resource_tests(FileSystemInstance* inst)
         
         close(fd);
     }
+    
+    // does get_resource_view give us file1.txt in place, the same bytes every time?
+    ++num_tests_run;
+    mutantspider::resource_view view, view2;
+    rslt = mutantspider::get_resource_view("/resources/subdir1/file1.txt", view);
+    if (rslt != 0)
+    {
+        ++num_tests_failed;
+        inst->PostError(LINE_PFX + "get_resource_view(\"/resources/subdir1/file1.txt\", view) failed with: " + std::to_string(rslt));
+    }
+    else
+    {
+        inst->PostMessage(LINE_PFX + "get_resource_view(\"/resources/subdir1/file1.txt\", view)");
+        
+        ++num_tests_run;
+        const char* reqrd = "This is the content of file1.  ";
+        mutantspider::get_resource_view("/resources/subdir1/file1.txt", view2);
+        if (view.size < strlen(reqrd) || memcmp(view.data, reqrd, strlen(reqrd)) != 0)
+        {
+            ++num_tests_failed;
+            inst->PostError(LINE_PFX + "/resources/subdir1/file1.txt's view does not seem to contain the right data");
+        }
+        else if (view2.data != view.data || view.storage)
+        {
+            ++num_tests_failed;
+            inst->PostError(LINE_PFX + "/resources/subdir1/file1.txt's view was a copy, not the file's bytes in place");
+        }
+        else
+            inst->PostMessage(LINE_PFX + "/resources/subdir1/file1.txt's view correctly starts with: \"" + reqrd + "\", in place");
+    }
+    
+    // file2.txt is compressed, so its view has to be decompressed, but once for all of its views
+    ++num_tests_run;
+    rslt = mutantspider::get_resource_view("/resources/file2.txt", view);
+    mutantspider::get_resource_view("/resources/file2.txt", view2);
+    const char* reqrd2 = "This is the content of file2.  ";
+    if (rslt != 0 || view.size < strlen(reqrd2) || memcmp(view.data, reqrd2, strlen(reqrd2)) != 0 || view2.data != view.data)
+    {
+        ++num_tests_failed;
+        inst->PostError(LINE_PFX + "get_resource_view(\"/resources/file2.txt\", view) returned " + std::to_string(rslt) + ", and not the expected, shared data");
+    }
+    else
+        inst->PostMessage(LINE_PFX + "get_resource_view(\"/resources/file2.txt\", view) correctly starts with: \"" + reqrd2 + "\"");
+    
+    // does get_resource_view correctly generate ENOENT?
+    ++num_tests_run;
+    rslt = mutantspider::get_resource_view("/resources/does_not_exist.txt", view);
+    if (rslt != ENOENT || view.data)
+    {
+        ++num_tests_failed;
+        inst->PostError(LINE_PFX + "get_resource_view(\"/resources/does_not_exist.txt\", view) should have returned ENOENT but did not, it returned: " + std::to_string(rslt));
+    }
+    else
+        inst->PostMessage(LINE_PFX + "get_resource_view(\"/resources/does_not_exist.txt\", view) correctly failed with ENOENT");
+    
+    // can we mmap file2.txt?
+    ++num_tests_run;
+    fd = open("/resources/file2.txt", O_RDONLY);
+    void* mem = fd == -1 ? MAP_FAILED : mmap(0, view2.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        ++num_tests_failed;
+        inst->PostError(LINE_PFX + "mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) of /resources/file2.txt failed with errno = " + errno_string());
+    }
+    else
+    {
+        if (memcmp(mem, view2.data, view2.size) != 0)
+        {
+            ++num_tests_failed;
+            inst->PostError(LINE_PFX + "mmap of /resources/file2.txt does not contain the same data as its view");
+        }
+        else
+            inst->PostMessage(LINE_PFX + "mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) of /resources/file2.txt matches its view");
+        munmap(mem, view2.size);
+    }
+    if (fd != -1)
+        close(fd);
    
     return std::make_pair(num_tests_run, num_tests_failed);
 }
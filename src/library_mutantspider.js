@@ -19,9 +19,9 @@ var LibraryMutantspider = {
   ms_delete_http_request: function(id) {
     mutantspider.asm_internal.delete_http_request(id);
   },
-  ms_open_http_request__sig: 'iiiiii',
-  ms_open_http_request: function(id, method, urlAddr, callback, cb_user_data) {
-    return mutantspider.asm_internal.open_http_request(id, method, urlAddr, callback, cb_user_data);
+  ms_open_http_request__sig: 'iiiiiii',
+  ms_open_http_request: function(id, method, urlAddr, headersAddr, callback, cb_user_data) {
+    return mutantspider.asm_internal.open_http_request(id, method, urlAddr, headersAddr, callback, cb_user_data);
   },
   ms_get_http_download_size__sig: 'ii',
   ms_get_http_download_size: function(id) {
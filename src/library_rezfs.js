@@ -1,5 +1,5 @@
 mergeInto(LibraryManager.library, {
-  $REZFS__deps: ['$ERRNO_CODES', '$FS', '$MEMFS'],
+  $REZFS__deps: ['$ERRNO_CODES', '$FS', '$MEMFS', 'malloc', 'free', 'memset'],
   $REZFS: {
   
     ops_table: null,
@@ -87,6 +87,19 @@ mergeInto(LibraryManager.library, {
         var size = length;
         if (position + size > len)
           size = len - position;
+        // rez_file_ent::blocks is set when the file is compressed, and file_data is 0 when it
+        // is in the resource pack.  Then the C code (MS_RezRead in mutantspider_fs.cpp)
+        // decompresses or downloads it into a temporary buffer
+        if (ptr == 0 || {{{ makeGetValue('contents', '8', 'i32') }}} != 0) {
+          var tmp = _malloc(size);
+          var ret = Module['_MS_RezRead'](contents, tmp, size, position);
+          if (ret > 0)
+            buffer.set(HEAP8.subarray(tmp, tmp+ret), offset);
+          _free(tmp);
+          if (ret < 0)
+            throw new FS.ErrnoError(-ret);  // EIO, or EAGAIN while the download is pending
+          return ret;
+        }
 #if USE_TYPED_ARRAYS == 2
         if (size > 8)
           buffer.set(HEAP8.subarray(ptr+position, ptr+position+size), offset);
@@ -98,9 +111,46 @@ mergeInto(LibraryManager.library, {
         }
         return size;
       },
+      
+      // a read-only mapping of an uncompressed, built in file is the file's own bytes.  Anything
+      // else (a writable private mapping, one that runs past the end of the file, or a file that
+      // is compressed or in the resource pack) gets a zero filled copy, the way nacl_io does it
+      mmap: function(stream, buffer, offset, length, position, prot, flags) {
+        if (FS.isDir(stream.node.mode))
+          throw new FS.ErrnoError(ERRNO_CODES.ENODEV);
+        var contents = stream.node.contents;
+        var ptr = {{{ makeGetValue('contents', '0', 'i32') }}};
+        var len = {{{ makeGetValue('contents', '4', 'i32') }}};
+        var blocks = {{{ makeGetValue('contents', '8', 'i32') }}};
+        if (ptr != 0 && blocks == 0 && !(prot & {{{ cDefine('PROT_WRITE') }}}) && position + length <= len)
+          return { ptr: ptr + position, allocated: false };
+        var mem = _malloc(length);
+        if (!mem)
+          throw new FS.ErrnoError(ERRNO_CODES.ENOMEM);
+        _memset(mem, 0, length);
+        if (position < len) {
+          var size = Math.min(length, len - position);
+          if (ptr != 0 && blocks == 0)
+            HEAPU8.set(HEAPU8.subarray(ptr + position, ptr + position + size), mem);
+          else {
+            // MS_RezRead returns what it has before an error, so carry on until it reports the error
+            for (var done = 0; done < size;) {
+              var ret = Module['_MS_RezRead'](contents, mem + done, size - done, position + done);
+              if (ret <= 0) {
+                _free(mem);
+                throw new FS.ErrnoError(ret < 0 ? -ret : ERRNO_CODES.EIO);
+              }
+              done += ret;
+            }
+          }
+        }
+        return { ptr: mem, allocated: true };
+      },
     
     },
     
+    // dir_addr is a rez_dir -- { num_ents, ents, sorted }.  'sorted' is only there for the nacl/host
+    // lookup (rezfs's get_dir_ent), here FS.lookupNode finds names through its own hash table
     recursive_mount_dir: function (dir_addr, parent)  {
       var num_ents = {{{ makeGetValue('dir_addr', '0', 'i32') }}};
       var ents_addr = {{{ makeGetValue('dir_addr', '4', 'i32') }}};
@@ -21,10 +21,16 @@ const char* locale()
 
 }
 
-#if defined(EMSCRIPTEN)
+#if defined(EMSCRIPTEN) || defined(MUTANTSPIDER_HOST)
 
+#if defined(EMSCRIPTEN)
 #include "emscripten.h"
+#endif
+#if defined(MUTANTSPIDER_HOST)
+#include "mutantspider_host.h"
+#endif
 #include <stdarg.h>
+#include <algorithm>
 
 static MS_Module* gModule;
 static MS_AppInstancePtr gAppInstance;
@@ -40,9 +46,16 @@ void MS_Init(int init_flags)
 {
 	gModule = pp::CreateModule();
 	gAppInstance = gModule->CreateInstance(0);
-    const char* argn = "has_webgl";
-    const char* argv = (init_flags & MS_FLAGS_WEBGL_SUPPORT) ? "true" : "false";
-	gAppInstance->Init(1, &argn, &argv);
+	std::vector<const char*> argn(1, "has_webgl");
+	std::vector<const char*> argv(1, (init_flags & MS_FLAGS_WEBGL_SUPPORT) ? "true" : "false");
+#if defined(MUTANTSPIDER_HOST)
+	for (auto& a : mutantspider::host::init_attributes())
+	{
+		argn.push_back(a.first.c_str());
+		argv.push_back(a.second.c_str());
+	}
+#endif
+	gAppInstance->Init((uint32_t)argn.size(), &argn[0], &argv[0]);
 }
 
 int MS_MouseProc( int eventType, int timeStamp, int modifiers, int button, int positionX, int positionY, int clickCount, int movementX, int movementY )
@@ -128,44 +141,201 @@ void MS_DidChangeView(int x, int y, int width, int height)
 }
 
 /*
-	vararg functions aren't easily callable from javascript because there would need to be significantly more
-	support built into ccall and cwrap to let it understand the types you were trying to pass.  So here we
-	just put a limit on the total number of string pairs we can accept vs. doing something like passing an
-	array of string pointers.  The ccall mechanism for passing a string ends up doing a better job of allocating
-	the string (it does it on the stack) than we could easily do ourselves if we tried to manually construct
-	all the strings.
+	Messages from the page (mutantspider.send_command) arrive as a single packed buffer.  The buffer starts
+	with a table of the separately malloc'd blocks that hold the data of any binary values, and then holds
+	one encoded value, normally a dictionary.  All numbers are little-endian and nothing is padded or aligned.
+
+		uint32_t count, then 'count' (uint32_t byte length, uint64_t address) block entries
+
+	Every value starts with a one byte type, which is its MS_VarType:
+
+		MS_VARTYPE_UNDEFINED, MS_VARTYPE_NULL	no data
+		MS_VARTYPE_BOOL							uint8_t 0 or 1
+		MS_VARTYPE_INT32						int32_t
+		MS_VARTYPE_DOUBLE						double
+		MS_VARTYPE_STRING						uint32_t byte length, then that many bytes of utf-8 (no terminator)
+		MS_VARTYPE_ARRAY						uint32_t count, then 'count' values
+		MS_VARTYPE_DICTIONARY					uint32_t count, then 'count' (uint32_t key length, key bytes, value)
+		MS_VARTYPE_ARRAY_BUFFER					uint32_t index of its entry in the block table
+
+	The component takes ownership of every block in the table, whether or not the message decodes.  A
+	block used by an array buffer becomes the VarArrayBuffer's memory, so the data is never copied on
+	this side, and MS_MessageProc frees any others (including all of them when the message is malformed).
+
+	The caller owns the message buffer itself and frees it after MS_MessageProc returns.  The encoders are
+	send_command in mutantspider.js and mutantspider::host::send_message in mutantspider_host.cpp.
 */
-#define DO_ONE_PAIR(x)									\
-if (count >= x)											\
-{														\
-	std::string val;									\
-	if (!vl##x)											\
-		val = std::string(v##x);						\
-	else												\
-	{													\
-		val = std::string(v##x, vl##x);					\
-		free((void*)v##x);								\
-	}													\
-	map.insert(std::make_pair(std::string(k##x), val));	\
-}
-
-void MS_MessageProc(int count, const char* k1, int vl1, const char* v1, const char* k2, int vl2, const char* v2,
-						const char* k3, int vl3, const char* v3, const char* k4, int vl4, const char* v4,
-						const char* k5, int vl5, const char* v5, const char* k6, int vl6, const char* v6,
-						const char* k7, int vl7, const char* v7, const char* k8, int vl8, const char* v8 )
+}	// extern "C"
+
+namespace {
+
+class message_reader
+{
+public:
+	message_reader(const void* msg, int msg_len)
+		: m_p((const uint8_t*)msg),
+		  m_end((const uint8_t*)msg + msg_len),
+		  m_bad(false)
+	{
+		read_blocks();
+	}
+
+	// frees every block that didn't end up owned by an array buffer
+	~message_reader()
+	{
+		for (auto& b : m_blocks)
+			free(b.data);
+	}
+
+	bool bad() const { return m_bad; }
+
+	mutantspider::Var read_value(int depth);
+
+private:
+	template<typename T>
+	T read()
+	{
+		T val = T();
+		if (m_end - m_p < (ptrdiff_t)sizeof(T))
+			fail();
+		else
+		{
+			memcpy(&val, m_p, sizeof(T));
+			m_p += sizeof(T);
+		}
+		return val;
+	}
+
+	const char* read_bytes(uint32_t len)
+	{
+		if ((uint32_t)(m_end - m_p) < len)
+		{
+			fail();
+			return 0;
+		}
+		const char* bytes = (const char*)m_p;
+		m_p += len;
+		return bytes;
+	}
+
+	void fail()
+	{
+		m_bad = true;
+		m_p = m_end;
+	}
+
+	void read_blocks();
+
+	struct block
+	{
+		void*		data;	// 0 once an array buffer has adopted it
+		uint32_t	len;
+	};
+
+	const uint8_t*		m_p;
+	const uint8_t*		m_end;
+	bool				m_bad;
+	std::vector<block>	m_blocks;
+};
+
+// deeper than this is assumed to be a corrupt message
+const int max_message_depth = 64;
+
+void message_reader::read_blocks()
+{
+	uint32_t count = read<uint32_t>();
+	m_blocks.reserve(std::min<size_t>(count, (m_end - m_p) / 12));
+	for (uint32_t i = 0; i < count && !m_bad; i++)
+	{
+		uint32_t len = read<uint32_t>();
+		uint64_t addr = read<uint64_t>();
+		if (!m_bad)
+			m_blocks.push_back(block{(void*)(uintptr_t)addr, len});
+	}
+}
+
+mutantspider::Var message_reader::read_value(int depth)
+{
+	if (depth > max_message_depth)
+	{
+		fail();
+		return mutantspider::Var();
+	}
+
+	switch (read<uint8_t>())
+	{
+		case MS_VARTYPE_UNDEFINED:
+			return mutantspider::Var();
+		case MS_VARTYPE_NULL:
+			return mutantspider::Var(mutantspider::Var::Null());
+		case MS_VARTYPE_BOOL:
+			return mutantspider::Var(read<uint8_t>() != 0);
+		case MS_VARTYPE_INT32:
+			return mutantspider::Var(read<int32_t>());
+		case MS_VARTYPE_DOUBLE:
+			return mutantspider::Var(read<double>());
+		case MS_VARTYPE_STRING:
+		{
+			uint32_t len = read<uint32_t>();
+			const char* text = read_bytes(len);
+			return text ? mutantspider::Var::from_utf8(text, len) : mutantspider::Var();
+		}
+		case MS_VARTYPE_ARRAY:
+		{
+			uint32_t count = read<uint32_t>();
+			std::vector<mutantspider::Var>	arr;
+			arr.reserve(std::min<size_t>(count, m_end - m_p));
+			for (uint32_t i = 0; i < count && !m_bad; i++)
+				arr.push_back(read_value(depth + 1));
+			return mutantspider::Var(std::move(arr));
+		}
+		case MS_VARTYPE_DICTIONARY:
+		{
+			uint32_t count = read<uint32_t>();
+			std::map<std::string, mutantspider::Var>	map;
+			for (uint32_t i = 0; i < count && !m_bad; i++)
+			{
+				uint32_t key_len = read<uint32_t>();
+				const char* key = read_bytes(key_len);
+				if (!key)
+					break;
+				std::string key_str(key, key_len);
+				map[std::move(key_str)] = read_value(depth + 1);
+			}
+			return mutantspider::Var(std::move(map));
+		}
+		case MS_VARTYPE_ARRAY_BUFFER:
+		{
+			uint32_t index = read<uint32_t>();
+			if (m_bad || index >= m_blocks.size() || !m_blocks[index].data)
+			{
+				fail();
+				return mutantspider::Var();
+			}
+			void* data = m_blocks[index].data;
+			m_blocks[index].data = 0;
+			return mutantspider::VarArrayBuffer::adopt(data, m_blocks[index].len);
+		}
+		default:
+			fail();
+			return mutantspider::Var();
+	}
+}
+
+}
+
+extern "C" {
+
+void MS_MessageProc(const void* msg, int msg_len)
 {
+	message_reader	reader(msg, msg_len);	// owns the message's blocks, even if there's no instance
 	if ( gAppInstance )
 	{
-		std::map<std::string, std::string>	map;
-		DO_ONE_PAIR(1)
-		DO_ONE_PAIR(2)
-		DO_ONE_PAIR(3)
-		DO_ONE_PAIR(4)
-		DO_ONE_PAIR(5)
-		DO_ONE_PAIR(6)
-		DO_ONE_PAIR(7)
-		DO_ONE_PAIR(8)
-		gAppInstance->HandleMessage(mutantspider::Var(map));
+		mutantspider::Var var = reader.read_value(0);
+		if (reader.bad())
+			fprintf(stderr, "MS_MessageProc - malformed message (%d bytes), ignored\n", msg_len);
+		else
+			gAppInstance->HandleMessage(var);
 	}
 }
 
@@ -370,6 +540,8 @@ bool URLRequestInfo::SetProperty(MS_URLRequestProperty property, const Var& valu
 
 ////////////////////////////////////////////
 
+#if defined(EMSCRIPTEN)
+
 Graphics3D::Graphics3D(MS_AppInstance* instance,
 						const int32_t attrib_list[])
 	: is_null_(false)
@@ -427,18 +599,93 @@ int32_t Graphics3D::SwapBuffers(const CompletionCallback& cc)
 	return 0;
 }
 
+// EMSCRIPTEN (the host versions of the Graphics3D methods are in mutantspider_host.cpp)
+#endif
+
+////////////////////////////////////////////
+
+/*
+	The callback block free lists.  Each thread keeps up to max_free_callback_blocks
+	blocks that were freed on it, so the common case (a callback made and run on the
+	main thread) never touches malloc or takes a lock.  Callbacks can be made on one
+	thread and run on another (CallOnMainThread), so a thread's list can run dry or
+	fill up, in which case blocks come from / go back to malloc.
+*/
+namespace {
+
+const int				max_free_callback_blocks = 64;
+
+union callback_block
+{
+	callback_block*		next;
+	char				bytes[callback_block_size];
+	long double			align;
+};
+
+struct callback_block_list
+{
+	callback_block_list() : head(0), count(0) {}
+	~callback_block_list()
+	{
+		while (head)
+		{
+			callback_block* next = head->next;
+			free(head);
+			head = next;
+		}
+	}
+
+	callback_block*		head;
+	int					count;
+};
+
+thread_local callback_block_list	free_callback_blocks;
+
+}
+
+void* alloc_callback_block()
+{
+	callback_block_list& list = free_callback_blocks;
+	callback_block* block = list.head;
+	if (!block)
+	{
+		block = (callback_block*)malloc(sizeof(callback_block));
+		if (!block)
+			throw std::bad_alloc();
+		return block;
+	}
+	list.head = block->next;
+	--list.count;
+	return block;
+}
+
+void free_callback_block(void* block)
+{
+	callback_block_list& list = free_callback_blocks;
+	if (list.count == max_free_callback_blocks)
+	{
+		free(block);
+		return;
+	}
+	((callback_block*)block)->next = list.head;
+	list.head = (callback_block*)block;
+	++list.count;
+}
+
 ////////////////////////////////////////////
 
 
 }  // namespace mutantspider
 
+#if defined(EMSCRIPTEN)
 extern "C" int main(int, char**)
 {
 	ms_initialize();
 	return 0;
 }
+#endif
 
-// EMSCRIPTEN
+// EMSCRIPTEN || MUTANTSPIDER_HOST
 #endif
 
 
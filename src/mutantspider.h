@@ -263,7 +263,6 @@
         using pp::Graphics2D;
         using pp::Graphics3D;
         using pp::CompletionCallback;
-        using pp::CompletionCallbackFactory;
         using pp::URLRequestInfo;
         using pp::URLResponseInfo;
         using pp::URLLoader;
@@ -272,6 +271,44 @@
         using pp::Rect;
     }
 
+    namespace mutantspider
+    {
+        /*
+            pp::CompletionCallbackFactory plus the NewCallback<&T::Method>() form that
+            the emscripten/host version has
+        */
+        template<typename T>
+        class CompletionCallbackFactory : public pp::CompletionCallbackFactory<T>
+        {
+        public:
+            explicit CompletionCallbackFactory(T* obj = 0) : pp::CompletionCallbackFactory<T>(obj) {}
+            
+            using pp::CompletionCallbackFactory<T>::NewCallback;
+            
+            template <void (T::*Method)(int32_t)>
+            CompletionCallback NewCallback()
+            {
+                return pp::CompletionCallbackFactory<T>::NewCallback(Method);
+            }
+        };
+        
+        // see the emscripten/host make_callback.  Here the callable is always heap allocated
+        template<typename F>
+        CompletionCallback make_callback(F f)
+        {
+            struct dispatcher
+            {
+                static void Thunk(void* user_data, int32_t result)
+                {
+                    F* f = (F*)user_data;
+                    (*f)(result);
+                    delete f;
+                }
+            };
+            return CompletionCallback(&dispatcher::Thunk, new F(std::move(f)));
+        }
+    }
+
     inline bool glInitializeMS() { return glInitializePPAPI(pp::Module::Get()->get_browser_interface()); }
     inline void glSetCurrentContextMS(PP_Resource context) { glSetCurrentContextPPAPI(context); }
     namespace mutantspider
@@ -286,15 +323,31 @@
         }
     }
 
-#elif defined(EMSCRIPTEN)
+#elif defined(EMSCRIPTEN) || defined(MUTANTSPIDER_HOST)
+
+    /*
+        MUTANTSPIDER_HOST is the native build (see the 'host' target in mutantspider.mk).
+        It shares all of the emscripten implementation of these classes.  The ms_* functions
+        declared below are implemented in library_mutantspider.js for emscripten builds, and
+        in mutantspider_host.cpp for host builds.
+    */
 
     #include <stdint.h>
+    #include <string.h>
+    #include <stdlib.h>
+    #include <stdio.h>
     #include <string>
     #include <sstream>
     #include <map>
     #include <vector>
+    #include <atomic>
+    #include <cstddef>
+    #include <new>
+    #include <utility>
+    #if defined(EMSCRIPTEN)
     #include "SDL/SDL.h"
     #include "SDL/SDL_opengl.h"
+    #endif
 
     // helper class used in resource file system code
     namespace mutantspider
@@ -310,7 +363,7 @@
     extern "C" void ms_paint_back_buffer(void);
     extern "C" int  ms_new_http_request(void);
     extern "C" void ms_delete_http_request(int id);
-    extern "C" int  ms_open_http_request(int id, const char* method, const char* urlAddr, void (*callback)(void*, int32_t), void* cb_user_data);
+    extern "C" int  ms_open_http_request(int id, const char* method, const char* urlAddr, const char* headers, void (*callback)(void*, int32_t), void* cb_user_data);
     extern "C" int  ms_get_http_download_size(int id);
     extern "C" int  ms_read_http_response(int id, void* buffer, int bytes_to_read);
     extern "C" void ms_timed_callback(int milli, void (*callbackAddr)(void*, int32_t), void* user_data, int result);
@@ -439,6 +492,7 @@
     } MS_ImageDataFormat;
 
     typedef enum {
+    #if defined(EMSCRIPTEN)
         MS_GRAPHICS3DATTRIB_ALPHA_SIZE                  = SDL_GL_ALPHA_SIZE,
         MS_GRAPHICS3DATTRIB_BLUE_SIZE                   = SDL_GL_BLUE_SIZE,
         MS_GRAPHICS3DATTRIB_GREEN_SIZE                  = SDL_GL_GREEN_SIZE,
@@ -447,6 +501,17 @@
         MS_GRAPHICS3DATTRIB_STENCIL_SIZE                = SDL_GL_STENCIL_SIZE,
         MS_GRAPHICS3DATTRIB_SAMPLES                     = SDL_GL_MULTISAMPLESAMPLES,
         MS_GRAPHICS3DATTRIB_SAMPLE_BUFFERS              = SDL_GL_MULTISAMPLEBUFFERS,
+    #else
+        // same values as the SDL 1.2 SDL_GLattr enum
+        MS_GRAPHICS3DATTRIB_ALPHA_SIZE                  = 3,
+        MS_GRAPHICS3DATTRIB_BLUE_SIZE                   = 2,
+        MS_GRAPHICS3DATTRIB_GREEN_SIZE                  = 1,
+        MS_GRAPHICS3DATTRIB_RED_SIZE                    = 0,
+        MS_GRAPHICS3DATTRIB_DEPTH_SIZE                  = 6,
+        MS_GRAPHICS3DATTRIB_STENCIL_SIZE                = 7,
+        MS_GRAPHICS3DATTRIB_SAMPLES                     = 14,
+        MS_GRAPHICS3DATTRIB_SAMPLE_BUFFERS              = 13,
+    #endif
         MS_GRAPHICS3DATTRIB_NONE                        = 0x3038,
         MS_GRAPHICS3DATTRIB_HEIGHT                      = 0x3056,
         MS_GRAPHICS3DATTRIB_WIDTH                       = 0x3057,
@@ -893,6 +958,16 @@
     namespace mutantspider {
         
         // see pp::Var
+        /*
+            A Var is a tagged union.  Ints, bools and strings up to sso_capacity chars
+            are stored inline, so constructing, copying and destroying them never touches
+            the heap.  Longer strings, dictionaries, arrays and array buffers live in a
+            separately allocated, reference counted payload that is shared between copies
+            (the contents of a Var are not changed once constructed, except through
+            VarArrayBuffer::Map, which behaves like sharing a pp::VarArrayBuffer).  An empty
+            dictionary, array or array buffer doesn't allocate a payload at all.
+            sizeof(Var) is 32 on both 32 and 64 bit targets.
+        */
         class Var
         {
         public:
@@ -901,46 +976,106 @@
             {}
             
             Var(const char* text)
-                : m_type(MS_VARTYPE_STRING),
-                  m_str(text)
-            {}
+                : m_type(MS_VARTYPE_STRING)
+            {
+                set_str(text, strlen(text));
+            }
             
             Var(const std::string& text)
-                : m_type(MS_VARTYPE_STRING),
-                  m_str(text)
+                : m_type(MS_VARTYPE_STRING)
+            {
+                set_str(text.data(), text.size());
+            }
+            
+            struct Null {};
+            
+            explicit Var(Null)
+                : m_type(MS_VARTYPE_NULL)
             {}
             
             Var(bool val)
-                : m_type(MS_VARTYPE_BOOL),
-                  m_str(val ? "true" : "false"),
-                  m_bool(val)
-            {}
+                : m_type(MS_VARTYPE_BOOL)
+            {
+                m_bool = val;
+            }
             
             Var(int32_t val)
-                : m_type(MS_VARTYPE_INT32),
-                  m_i32(val)
-            {}
+                : m_type(MS_VARTYPE_INT32)
+            {
+                m_i32 = val;
+            }
             
-            Var(const std::map<std::string, std::string>& map)
-                : m_type(MS_VARTYPE_DICTIONARY),
-                  m_map(map)
-            {}
+            Var(double val)
+                : m_type(MS_VARTYPE_DOUBLE)
+            {
+                m_double = val;
+            }
             
-            Var(const std::vector<std::string>& arr)
-            	: m_type(MS_VARTYPE_ARRAY),
-            	  m_array(arr)
-            {}
+            Var(const std::map<std::string, std::string>& map);
+            Var(const std::map<std::string, Var>& map);
+            Var(std::map<std::string, Var>&& map);
             
-            #if 0
-            Var(const void* array_buff_data, size_t len)
-                : m_type(MS_VARTYPE_ARRAY_BUFFER),
-                  m_ab_data(array_buff_data, len)
-            {}
-            #endif
+            Var(const std::vector<std::string>& arr);
+            Var(const std::vector<Var>& arr);
+            Var(std::vector<Var>&& arr);
+            
+            /*
+                not part of pp::Var.  A string Var holding the 'len' bytes of utf-8 at 'text',
+                which doesn't need to be nul terminated.
+            */
+            static Var from_utf8(const char* text, size_t len)
+            {
+                Var v;
+                v.m_type = MS_VARTYPE_STRING;
+                v.set_str(text, len);
+                return v;
+            }
+            
+            // an array buffer holding a copy of the 'len' bytes at 'array_buff_data'
+            Var(const void* array_buff_data, size_t len);
+            
+            Var(const Var& v)
+            {
+                copy_from(v);
+            }
+            
+            Var(Var&& v)
+            {
+                take_from(v);
+            }
             
+            ~Var()
+            {
+                release();
+            }
+            
+            Var& operator=(const Var& v)
+            {
+                if (this != &v)
+                {
+                    release();
+                    copy_from(v);
+                }
+                return *this;
+            }
+            
+            Var& operator=(Var&& v)
+            {
+                if (this != &v)
+                {
+                    release();
+                    take_from(v);
+                }
+                return *this;
+            }
+            
+            bool is_undefined() const { return m_type == MS_VARTYPE_UNDEFINED; }
+            bool is_null() const { return m_type == MS_VARTYPE_NULL; }
             bool is_string() const { return m_type == MS_VARTYPE_STRING; }
             bool is_bool() const { return m_type == MS_VARTYPE_BOOL; }
             bool is_int() const { return m_type == MS_VARTYPE_INT32; }
+            bool is_double() const { return m_type == MS_VARTYPE_DOUBLE; }
+            bool is_number() const { return is_int() || is_double(); }
             bool is_object() const { return m_type == MS_VARTYPE_OBJECT; }
             bool is_array() const { return m_type == MS_VARTYPE_ARRAY; }
             bool is_dictionary() const { return m_type == MS_VARTYPE_DICTIONARY; }
@@ -949,7 +1084,7 @@
             
             std::string AsString() const
             {
-                return is_string() ? m_str : std::string("");
+                return is_string() ? std::string(str_data(), m_str_len) : std::string("");
             }
             
             bool AsBool() const
@@ -959,37 +1094,269 @@
             
             int32_t AsInt() const
             {
-                return is_int() ? m_i32 : 0;
+                return is_int() ? m_i32 : is_double() ? (int32_t)m_double : 0;
             }
             
-            std::string DebugString() const
+            double AsDouble() const
             {
-                std::ostringstream stream;
-                stream << "Var<\'" << m_str << "\'>";
-                return stream.str();
+                return is_double() ? m_double : is_int() ? m_i32 : 0.0;
             }
+            
+            std::string DebugString() const;
+            
         protected:
-            MS_VarType	m_type;
-            std::string m_str;
-            bool		m_bool;
-            int32_t		m_i32;
-            std::map<std::string, std::string>	m_map;
-			std::vector<std::string>			m_array;
+            enum { sso_capacity = 23 };
+            
+            struct payload
+            {
+                payload() : refs(1) {}
+                std::atomic<int32_t>    refs;
+            };
+            
+            // payloads are defined below, once Var is a complete type
+            struct str_payload;
+            struct map_payload;
+            struct array_payload;
+            struct buffer_payload;
+            
+            void set_str(const char* text, size_t len);
+            const char* str_data() const;
+            payload* shared() const;
+            void release();
+            const std::map<std::string, Var>* dict_map() const;
+            const std::vector<Var>* array_vec() const;
+            
+            // the union is copied as raw bytes, whichever member is active.  Only strings
+            // use all of it, and m_str_len, which is left unset for every other type
+            void copy_value(const Var& v)
+            {
+                if (v.m_type == MS_VARTYPE_STRING)
+                {
+                    memcpy(m_sso, v.m_sso, sizeof(m_sso));
+                    m_str_len = v.m_str_len;
+                }
+                else
+                    memcpy(m_sso, v.m_sso, sizeof(double));
+                m_type = v.m_type;
+            }
+            
+            void take_from(Var& v)
+            {
+                copy_value(v);
+                v.m_type = MS_VARTYPE_UNDEFINED;
+            }
+            
+            void copy_from(const Var& v)
+            {
+                copy_value(v);
+                if (payload* p = shared())
+                    p->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            
+            union
+            {
+                bool            m_bool;
+                int32_t         m_i32;
+                double          m_double;
+                char            m_sso[sso_capacity + 1];
+                str_payload*    m_heap_str;
+                map_payload*    m_map;
+                array_payload*  m_array;
+                buffer_payload* m_buffer;
+            };
+            uint32_t    m_str_len;
+            MS_VarType  m_type;
         };
         
+        static_assert(sizeof(Var) == 32, "mutantspider::Var is expected to be 32 bytes");
+        
+        struct Var::str_payload : public Var::payload
+        {
+            str_payload(const char* text, size_t len) : str(text, len) {}
+            std::string str;
+        };
+        
+        struct Var::map_payload : public Var::payload
+        {
+            map_payload() {}
+            template<typename M>
+            explicit map_payload(M&& m) : map(std::forward<M>(m)) {}
+            std::map<std::string, Var>  map;
+        };
+        
+        struct Var::array_payload : public Var::payload
+        {
+            array_payload() {}
+            template<typename A>
+            explicit array_payload(A&& a) : array(std::forward<A>(a)) {}
+            std::vector<Var>    array;
+        };
+        
+        // 'data' is malloc'd and owned by the payload
+        struct Var::buffer_payload : public Var::payload
+        {
+            buffer_payload(void* data, uint32_t len) : data(data), len(len) {}
+            ~buffer_payload() { free(data); }
+            void*       data;
+            uint32_t    len;
+        };
+        
+        inline Var::Var(const std::map<std::string, std::string>& map)
+            : m_type(MS_VARTYPE_DICTIONARY)
+        {
+            m_map = 0;
+            if (!map.empty())
+            {
+                m_map = new map_payload;
+                for (auto it = map.begin(); it != map.end(); it++)
+                    m_map->map.insert(m_map->map.end(), std::make_pair(it->first, Var(it->second)));
+            }
+        }
+        
+        inline Var::Var(const std::map<std::string, Var>& map)
+            : m_type(MS_VARTYPE_DICTIONARY)
+        {
+            m_map = map.empty() ? 0 : new map_payload(map);
+        }
+        
+        inline Var::Var(std::map<std::string, Var>&& map)
+            : m_type(MS_VARTYPE_DICTIONARY)
+        {
+            m_map = map.empty() ? 0 : new map_payload(std::move(map));
+        }
+        
+        inline Var::Var(const std::vector<std::string>& arr)
+            : m_type(MS_VARTYPE_ARRAY)
+        {
+            m_array = arr.empty() ? 0 : new array_payload(std::vector<Var>(arr.begin(), arr.end()));
+        }
+        
+        inline Var::Var(const std::vector<Var>& arr)
+            : m_type(MS_VARTYPE_ARRAY)
+        {
+            m_array = arr.empty() ? 0 : new array_payload(arr);
+        }
+        
+        inline Var::Var(std::vector<Var>&& arr)
+            : m_type(MS_VARTYPE_ARRAY)
+        {
+            m_array = arr.empty() ? 0 : new array_payload(std::move(arr));
+        }
+        
+        inline Var::Var(const void* array_buff_data, size_t len)
+            : m_type(MS_VARTYPE_ARRAY_BUFFER)
+        {
+            m_buffer = 0;
+            if (len)
+            {
+                void* data = malloc(len);
+                memcpy(data, array_buff_data, len);
+                m_buffer = new buffer_payload(data, (uint32_t)len);
+            }
+        }
+        
+        inline void Var::set_str(const char* text, size_t len)
+        {
+            m_str_len = (uint32_t)len;
+            if (len <= sso_capacity)
+            {
+                memcpy(m_sso, text, len);
+                m_sso[len] = 0;
+            }
+            else
+                m_heap_str = new str_payload(text, len);
+        }
+        
+        inline const char* Var::str_data() const
+        {
+            return m_str_len <= sso_capacity ? m_sso : m_heap_str->str.data();
+        }
+        
+        // the payload, if this Var has one, otherwise 0
+        inline Var::payload* Var::shared() const
+        {
+            switch (m_type)
+            {
+                case MS_VARTYPE_STRING:
+                    return m_str_len <= sso_capacity ? 0 : m_heap_str;
+                case MS_VARTYPE_DICTIONARY:
+                    return m_map;
+                case MS_VARTYPE_ARRAY:
+                    return m_array;
+                case MS_VARTYPE_ARRAY_BUFFER:
+                    return m_buffer;
+                default:
+                    return 0;
+            }
+        }
+        
+        inline void Var::release()
+        {
+            payload* p = shared();
+            if (p && p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                switch (m_type)
+                {
+                    case MS_VARTYPE_STRING:
+                        delete m_heap_str;
+                        break;
+                    case MS_VARTYPE_DICTIONARY:
+                        delete m_map;
+                        break;
+                    case MS_VARTYPE_ARRAY:
+                        delete m_array;
+                        break;
+                    default:
+                        delete m_buffer;
+                        break;
+                }
+            }
+        }
+        
+        inline const std::map<std::string, Var>* Var::dict_map() const
+        {
+            return is_dictionary() && m_map ? &m_map->map : 0;
+        }
+        
+        inline const std::vector<Var>* Var::array_vec() const
+        {
+            return is_array() && m_array ? &m_array->array : 0;
+        }
+        
+        inline std::string Var::DebugString() const
+        {
+            std::ostringstream stream;
+            stream << "Var<\'";
+            if (is_string())
+                stream.write(str_data(), m_str_len);
+            else if (is_bool())
+                stream << (m_bool ? "true" : "false");
+            else if (is_int())
+                stream << m_i32;
+            else if (is_double())
+                stream << m_double;
+            else if (is_array_buffer())
+                stream << "ArrayBuffer(" << (m_buffer ? m_buffer->len : 0) << ")";
+            stream << "\'>";
+            return stream.str();
+        }
+        
+        // see pp::VarArray
         class VarArray : public Var
         {
         public:
-        	VarArray(const Var& v) : Var(v) {}
-        	Var Get(uint32_t index) const
-        	{
-        		return index < m_array.size() ? Var(m_array[index]) : Var();
-        	}
-        	
-        	uint32_t GetLength() const
-        	{
-        		return m_array.size();
-        	}
+            VarArray(const Var& v) : Var(v) {}
+            Var Get(uint32_t index) const
+            {
+                auto arr = array_vec();
+                return arr && index < arr->size() ? (*arr)[index] : Var();
+            }
+            
+            uint32_t GetLength() const
+            {
+                auto arr = array_vec();
+                return arr ? arr->size() : 0;
+            }
         };
         
         // see pp::VarDictionary
@@ -999,20 +1366,87 @@
             VarDictionary(const Var& v) : Var(v) {}
             Var Get(const char* msg) const
             {
-                auto it = m_map.find(msg);
-                return it == m_map.end() ? Var() : Var(it->second);
+                auto map = dict_map();
+                if (!map)
+                    return Var();
+                auto it = map->find(msg);
+                return it == map->end() ? Var() : it->second;
             }
             
             VarArray GetKeys() const
             {
-            	std::vector<std::string>	keys(m_map.size());
-            	int							i = 0;
-            	for (auto it = m_map.begin(); it != m_map.end(); it++, i++)
-            		keys[i] = it->first;
-            	return Var(keys);
+                std::vector<Var>    keys;
+                if (auto map = dict_map())
+                {
+                    keys.reserve(map->size());
+                    for (auto it = map->begin(); it != map->end(); it++)
+                        keys.push_back(Var(it->first));
+                }
+                return Var(std::move(keys));
             }
         };
         
+        /*
+            see pp::VarArrayBuffer.  Map returns a pointer directly to the buffer's memory,
+            which is shared by every copy of this Var, so no copying happens in either
+            direction.  Unmap does nothing.
+        */
+        class VarArrayBuffer : public Var
+        {
+        public:
+            VarArrayBuffer()
+            {
+                m_type = MS_VARTYPE_ARRAY_BUFFER;
+                m_buffer = 0;
+            }
+            
+            explicit VarArrayBuffer(const Var& v)
+                : Var(v)
+            {
+                if (!is_array_buffer())
+                {
+                    release();
+                    m_type = MS_VARTYPE_ARRAY_BUFFER;
+                    m_buffer = 0;
+                }
+            }
+            
+            explicit VarArrayBuffer(uint32_t size_in_bytes)
+            {
+                m_type = MS_VARTYPE_ARRAY_BUFFER;
+                m_buffer = size_in_bytes ? new buffer_payload(calloc(size_in_bytes, 1), size_in_bytes) : 0;
+            }
+            
+            /*
+                not part of pp::VarArrayBuffer.  Used by the asm.js/host glue to hand a
+                malloc'd block of memory to an array buffer without copying it.  The array
+                buffer owns 'data' after this and frees it when the last copy is destroyed.
+            */
+            static VarArrayBuffer adopt(void* data, uint32_t len)
+            {
+                VarArrayBuffer  ab;
+                if (len)
+                    ab.m_buffer = new buffer_payload(data, len);
+                else
+                    free(data);
+                return ab;
+            }
+            
+            uint32_t ByteLength() const
+            {
+                return m_buffer ? m_buffer->len : 0;
+            }
+            
+            void* Map()
+            {
+                return m_buffer ? m_buffer->data : 0;
+            }
+            
+            void Unmap()
+            {}
+        };
+        
+        
         // see pp::View
         class View
         {
@@ -1461,6 +1895,17 @@
             void*	user_data;
         };
         
+        /*
+            The state behind a CompletionCallback made by CompletionCallbackFactory::NewCallback
+            or make_callback lives in a fixed size block taken from a per-thread free list (see mutantspider.cpp)
+            rather than a new/delete per callback.  A block is returned to the free list when the
+            callback runs.  Like pp::CompletionCallback, a callback that is never run leaks its block.
+            Blocks come from malloc, so they are only aligned for std::max_align_t.
+        */
+        const size_t callback_block_size = 64;
+        void* alloc_callback_block();
+        void free_callback_block(void* block);
+        
         // see pp::CompletionCallbackFactory<>
         template<typename T>
         class CompletionCallbackFactory
@@ -1480,6 +1925,17 @@
                 return Dispatcher<Method>::NewCallback(object, method);
             }
             
+            /*
+                not part of pp::CompletionCallbackFactory.  The method is a template parameter,
+                NewCallback<&MyClass::MyMethod>(), so the callback needs no state beyond the object
+                pointer and nothing is allocated at all.
+            */
+            template <void (T::*Method)(int32_t)>
+            CompletionCallback NewCallback()
+            {
+                return CompletionCallback(&StaticThunk<Method>, object);
+            }
+            
         private:
             
             template<typename Method>
@@ -1488,7 +1944,9 @@
             public:
                 static CompletionCallback NewCallback(T* object, Method method)
                 {
-                    return CompletionCallback(&Dispatcher::Thunk, new Dispatcher(object, method));
+                    static_assert(sizeof(Dispatcher) <= callback_block_size && alignof(Dispatcher) <= alignof(std::max_align_t),
+                                  "Dispatcher doesn't fit in a callback block");
+                    return CompletionCallback(&Dispatcher::Thunk, new (alloc_callback_block()) Dispatcher(object, method));
                 }
                 
             private:
@@ -1497,20 +1955,75 @@
                       method(method)
                 {}
                 
+                // the block is freed before the call, so a callback that asks for another
+                // callback (the usual Flush/SwapBuffers loop) gets the same block back
                 static void Thunk(void* user_data, int32_t result)
                 {
                     Dispatcher *ths = (Dispatcher*)(user_data);
-                    (ths->object->*ths->method)(result);
-                    delete ths;
+                    T*      object = ths->object;
+                    Method  method = ths->method;
+                    free_callback_block(ths);
+                    (object->*method)(result);
                 }
                 
                 T*		object;
                 Method	method;
             };
             
+            template<void (T::*Method)(int32_t)>
+            static void StaticThunk(void* user_data, int32_t result)
+            {
+                (((T*)user_data)->*Method)(result);
+            }
+            
             T* object;
         };
         
+        template<typename F, bool fits_block = (sizeof(F) <= callback_block_size && alignof(F) <= alignof(std::max_align_t))>
+        struct lambda_dispatcher
+        {
+            static CompletionCallback NewCallback(F&& f)
+            {
+                return CompletionCallback(&Thunk, new (alloc_callback_block()) F(std::move(f)));
+            }
+            
+            static void Thunk(void* user_data, int32_t result)
+            {
+                F* f = (F*)user_data;
+                (*f)(result);
+                f->~F();
+                free_callback_block(f);
+            }
+        };
+        
+        // captures too big for a callback block go on the heap
+        template<typename F>
+        struct lambda_dispatcher<F, false>
+        {
+            static CompletionCallback NewCallback(F&& f)
+            {
+                return CompletionCallback(&Thunk, new F(std::move(f)));
+            }
+            
+            static void Thunk(void* user_data, int32_t result)
+            {
+                F* f = (F*)user_data;
+                (*f)(result);
+                delete f;
+            }
+        };
+        
+        /*
+            not part of pepper.  A CompletionCallback that runs 'f' (anything callable as f(int32_t),
+            typically a capturing lambda) once.  Captures of up to callback_block_size bytes are
+            stored in a callback block.
+        */
+        template<typename F>
+        CompletionCallback make_callback(F f)
+        {
+            return lambda_dispatcher<F>::NewCallback(std::move(f));
+        }
+        
         // see pp::Graphics2D
         class Graphics2D
         {
@@ -1644,6 +2157,15 @@
         virtual void DidChangeFocus(bool focus) {}
         virtual void DidChangeView(const mutantspider::View& view) {};
         virtual bool HandleInputEvent(const mutantspider::InputEvent& event) { return false; }
+
+        /*
+            'var_message' is whatever was passed to mutantspider.send_command (or host::send_message).
+            Values keep their JavaScript types, the same as with pp::Instance::HandleMessage: a number
+            arrives as an int32 or double Var (use AsInt/AsDouble, not AsString), and booleans, null,
+            arrays, nested dictionaries and ArrayBuffers arrive as such.  Earlier versions of the asm.js
+            build delivered every value as a string, so components written against them and reading
+            numbers with AsString need to change.  "__callback_index__" is still a string.
+        */
         virtual void HandleMessage(const mutantspider::Var& var_message) {}
         virtual void AsyncStartupComplete() {}
         
@@ -1682,14 +2204,20 @@
         virtual MS_AppInstancePtr CreateInstance(MS_Instance instance) = 0;
     };
 
+    #if defined(EMSCRIPTEN)
     inline bool glInitializeMS() { return SDL_Init(SDL_INIT_VIDEO) == 0; }
+    #else
+    // the host build has no GL implementation
+    inline bool glInitializeMS() { return false; }
+    #endif
     inline void glSetCurrentContextMS(void*) {}
     namespace mutantspider
     {
         // "main thread" is a bit misleading here.  In javascript there is only one thread,
         // so this function is certainly running on that one, main thread.  In nacl this same
-        // named function can be running on other threads.  In both nacl and javascript, the
-        // "delay" is respected.
+        // named function can be running on other threads.  In the host build it can be called
+        // from any thread and the callback runs on the thread running the host event loop.
+        // In all cases the "delay" is respected.
         inline void CallOnMainThread(int32_t delay_in_milliseconds, const CompletionCallback& callback, int32_t result = 0)
         {
             ms_timed_callback(delay_in_milliseconds,callback.get_proc(),callback.get_user_data(),result);
@@ -1708,6 +2236,8 @@
 
 #endif
 
+#include <sys/stat.h>
+
 extern "C" void MS_SetLocale(const char*);
 
 namespace mutantspider
@@ -1733,13 +2263,39 @@ namespace mutantspider
         persist beween page views for the particular URL you are on.  The persisting mechanism underlying this support is based on
         the browser's general support for "local storage".  This is not the same thing as true local files on the OS that the browser
         is running on.  In the current implementation this will use "html5fs" for nacl builds, and IndexedDB for asm.js builds.
+        Host builds (MUTANTSPIDER_HOST) use a directory in the host's file system (see mutantspider::host::fs_root).
         In both of these cases if the user clears the browser's cookies, or history (it depends on the browser) this data will
         be erased.  Different browsers also have different mechanisms to let the user grant or deny permission to store data
         this way.  You can read about these issues by searching for documentation for IndexedDB.
         
-        In the current implementation, the /persistent/... files are all read into memory at start up, and stay there.  These
+        By default (persistent_load_all), the /persistent/... files are all read into memory at start up, and stay there.  These
         files are essentially a memory-based file system.  So there can be performance issues if you store enormous amounts of
-        data this way.
+        data this way.  In nacl and host builds 'load' can instead be:
+        
+            persistent_load_on_open             only the directories and the names, sizes, modes and times of the files are
+                                                read at start up.  A file's contents are read the first time it is opened
+                                                (or truncated), so files that are never used never take memory, and start up
+                                                time depends on the number of files rather than on their size.
+            persistent_load_on_open_prefetch    the same, except that once start up is complete the background thread also
+                                                reads the files that haven't been opened yet, whenever it has nothing else to do.
+        
+        In nacl and host builds, a manifest describing the stored directories and files (including the contents of small ones)
+        is kept alongside them, so that start up can usually read it with a single read rather than walking the storage.
+        
+        'store' selects how nacl and host builds keep the data in the browser's storage:
+        
+            persistent_mirror                   the storage holds an ordinary copy of each directory and file, and every change is
+                                                repeated there.
+            persistent_journal                  changes are appended to a single journal file, which is periodically compacted into a
+                                                single checkpoint file.  This turns many small, scattered writes into a few sequential
+                                                ones.  Start up reads the checkpoint and replays the journal, and always loads every
+                                                file (so 'load' is ignored).  Data stored with persistent_mirror is read (once) when
+                                                first switching to persistent_journal, but not the other way around.
+        
+        asm.js builds ignore 'store'.
+        
+        With nacl, the storage can't be read from the main thread, so opening a file that hasn't been read yet from the main thread
+        fails with EWOULDBLOCK.  asm.js builds currently always use persistent_load_all.
         
         Loading the data in /persistent/..., and in fact the general preperation of the /persistent directory, is done asynchronously.
         The call to fs_init simply initiates this logic.  When the directories and data are avaiable your instance's AsyncStartupComplete
@@ -1771,11 +2327,116 @@ namespace mutantspider
         will succeed in opening the file, allowing you to read its contents.  See README.makefile for details on how to
         use this feature.
     */
-    void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs = std::vector<std::string>());
+    typedef enum {
+        persistent_load_all,
+        persistent_load_on_open,
+        persistent_load_on_open_prefetch
+    } persistent_load;
+    
+    typedef enum {
+        persistent_mirror,
+        persistent_journal
+    } persistent_store;
+    
+    void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs = std::vector<std::string>(),
+                    persistent_load load = persistent_load_all, persistent_store store = persistent_mirror);
+    
+    /*
+        In nacl and host builds, changes to /persistent/... are applied to an in-memory copy and returned to the caller
+        immediately.  A background thread then repeats each change ("op") against the browser's storage.  These numbers
+        describe that thread's queue, and so how far the persistent storage lags behind what the component has written.
+        All counts are since init_fs.  In asm.js builds everything is 0.
+    */
+    struct persistent_stats
+    {
+        uint64_t    ops_queued;         // ops handed to the background thread
+        uint64_t    ops_completed;      // ops it has finished
+        uint32_t    queue_depth;        // ops_queued - ops_completed
+        uint32_t    max_queue_depth;    // largest queue_depth seen
+        uint64_t    last_latency_us;    // time from queuing to completion of the most recently completed op
+        uint64_t    max_latency_us;     // largest last_latency_us seen
+        uint64_t    total_latency_us;   // sum over all completed ops, total_latency_us / ops_completed is the average
+        uint64_t    batches;            // times the background thread woke up and ran at least one op
+        uint64_t    ops_elided;         // ops merged into one already queued, or dropped because a later op made them pointless
+        uint32_t    files_not_loaded;   // persistent_load_on_open[_prefetch]: files whose contents haven't been read yet
+        uint64_t    cache_hits;         // set_persistent_cache: reads served from the block cache, counted per block
+        uint64_t    cache_misses;       // reads that had to read a block from the browser's storage
+        uint64_t    cache_bytes;        // memory currently held by the block cache
+        uint64_t    fds_reused;         // opens that reused the browser storage file kept from an earlier close of the same file
+    };
+    persistent_stats get_persistent_stats();
+    
+    /*
+        With persistent_load_on_open[_prefetch] in nacl and host builds, files in /persistent/... that are at least 'min_file_size'
+        bytes long are not loaded into memory when they are opened read-only.  Instead they are read from the browser's storage as
+        needed, in 64KB blocks, which are kept in a cache shared by all such files that uses at most 'budget_bytes' of memory
+        (sequential reads also have the next few blocks read ahead of time).  Opening one of these files for writing, or truncating
+        it, loads it as usual.  persistent_load_on_open_prefetch doesn't load these files either.  In nacl, a read on the main
+        thread that needs a block that isn't cached fails with EWOULDBLOCK, and the block is read in the background so that
+        trying again later succeeds.
+        
+        The default, 'min_file_size' 0, turns this off.  Call it before init_fs.  asm.js builds ignore it.
+    */
+    void set_persistent_cache(uint64_t min_file_size, uint64_t budget_bytes);
+    
+    /*
+        Caps how far the background thread described above persistent_stats can fall behind in nacl and host builds.
+        The backlog is the data written to /persistent/... that hasn't reached the browser's storage yet ('max_bytes'),
+        and the number of queued ops ('max_ops').  Once it is over either limit, calls that would add to it wait for the
+        backlog to shrink when made from other threads, and fail with errno EAGAIN when made from the main thread, which
+        must not block on the browser.  Reads, close and fsync are never held back.
+        
+        0 means no limit, which is the default for both.  It can be called at any time.  asm.js builds ignore it.
+    */
+    void set_persistent_backlog_limit(uint64_t max_bytes, uint64_t max_ops);
+    
+    /*
+        Runs 'callback' on the main thread once everything written to /persistent/... before the call has reached the
+        browser's storage and been synced there (the journal with persistent_journal, otherwise every file that is open
+        or whose descriptor is still kept).  With no persistent directories it runs right away.  Off the main thread,
+        fsync does the same for a single file and returns when it is done, but the main thread can't wait like that.
+        There fsync queues the sync and fails with errno EAGAIN until it has been done (calling it again from this
+        callback returns 0), so this is how the main thread gets a durable checkpoint.  The callback's result is always 0.  In asm.js builds the callback
+        runs as soon as the main thread is free, and IndexedDB may still be finishing the last changes.
+    */
+    void flush_persistent(const CompletionCallback& callback);
+    
+    struct persistent_backlog
+    {
+        uint64_t    bytes;              // written data not yet in the browser's storage
+        uint64_t    ops;                // ops queued but not yet completed
+        uint64_t    max_bytes;          // the limits set with set_persistent_backlog_limit
+        uint64_t    max_ops;
+        uint64_t    waits;              // calls from other threads that had to wait for the backlog to shrink
+        uint64_t    rejects;            // calls from the main thread that failed with EAGAIN
+    };
+    persistent_backlog get_persistent_backlog();
+    
+    /*
+        Lists the directory 'path' in one call: the name of every entry (other than "." and "..") together with what
+        stat would report for it.  For directories under /persistent/... and /resources/... in nacl and host builds this
+        reads those file systems' own tables directly, rather than going through readdir and then stat once per entry.
+        Returns 0, or an errno value if 'path' can't be listed.
+    */
+    struct dir_scan
+    {
+        struct entry
+        {
+            uint32_t        name_offset;    // into 'names'
+            struct stat     st;
+        };
+        std::vector<entry>  entries;
+        std::vector<char>   names;          // every entry's name, each followed by a '\0'
+        
+        const char* name(size_t index) const { return &names[entries[index].name_offset]; }
+    };
+    int scan_dir(const std::string& path, dir_scan& scan);
 }
 
 #if defined(MUTANTSPIDER_HAS_RESOURCES)
 
+#include <memory>
+
 // careful!
 // in the emscripten builds these data structures are directly read out of memory
 // by the javascript support code in library_rezfs.js.  If you change anything about
@@ -1786,8 +2447,11 @@ namespace mutantspider
 {
 struct rez_file_ent
 {
-    const unsigned char*    file_data;
-    size_t                  file_data_sz;
+    const unsigned char*    file_data;      // the file's contents, or when 'blocks' is set, its compressed blocks.  0 if it is in the resource pack
+    size_t                  file_data_sz;   // the size of the (uncompressed) file
+    const uint32_t*         blocks;         // 0, or the offset in file_data of each lz4 block, plus one for the end
+    uint32_t                block_size;     // the uncompressed size of every block but the last.  Also set for uncompressed files in the pack
+    size_t                  pack_offset;    // when file_data is 0, where the file_data would have started in the resource pack
 };
 
 struct rez_dir_ent
@@ -1803,10 +2467,60 @@ struct rez_dir_ent
 struct rez_dir {
     size_t  num_ents;
     const rez_dir_ent* ents;
+    int     sorted;     // non-zero if ents is sorted by d_name (strcmp order), as mutantspider.mk writes it
 };
 
 extern const rez_dir rez_root_dir;
 extern const rez_dir_ent rez_root_dir_ent;
+
+// the (relative) url of the resource pack, or 0 if there isn't one (see RESOURCE_PACK in README.makefile)
+extern const char* const rez_pack_url;
+
+/*
+    Resources listed with <file>_COMPRESS = lz4 are stored compressed and read a block at a
+    time.  The blocks that have been decompressed are kept in a cache shared by all such
+    files, so that small sequential reads only decompress each block once.  This sets the
+    most that cache will hold (1MB by default).  0 disables it, so that every read decompresses
+    what it needs.
+*/
+void set_resource_cache_limit(size_t max_bytes);
+
+/*
+    Files in the resource pack are downloaded as they are read, in ranges of up to 1MB.  A
+    thread other than the main one that reads data that hasn't arrived yet waits for it.  The
+    main thread can't, because that is where the download completes, and so there the read
+    starts the download and fails with EAGAIN.  fetch_resource downloads all of 'path' (a file
+    in /resources) and then calls 'callback' on the main thread, with MS_OK or an error.  After
+    that, reads of the file don't need the network.  Files that are built in to the
+    executable are always available, and fetch_resource calls the callback right away.
+*/
+void fetch_resource(const std::string& path, const CompletionCallback& callback);
+
+/*
+    The contents of a file in /resources, without reading it through the file system.  For
+    a file built in to the executable without _COMPRESS, 'data' points at the copy in the
+    executable itself, so nothing is copied.  Compressed files and files in the resource pack
+    are decompressed (or downloaded) into 'storage', which all the views of the file share
+    until the last of them goes away.  'data' is valid for as long as the view, or a copy of
+    it, exists.
+*/
+struct resource_view
+{
+    const unsigned char*                                data;
+    size_t                                              size;
+    std::shared_ptr<const std::vector<unsigned char>>   storage;
+    
+    resource_view() : data(0), size(0) {}
+};
+
+/*
+    set 'view' to the contents of 'path' (a file in /resources).  Returns 0, or an errno value:
+    ENOENT or EISDIR if 'path' isn't a file in /resources, EIO if it can't be read, and EAGAIN
+    on the main thread for a file in the resource pack that hasn't been downloaded yet (see
+    fetch_resource).  mmap of a /resources file gets the same bytes in place in asm.js builds,
+    but nacl_io (and the host build) fill private pages with a copy.
+*/
+int get_resource_view(const std::string& path, resource_view& view);
 }
 
 #endif
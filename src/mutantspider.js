@@ -66,6 +66,15 @@ var Module;
                     return;
                 }
  
+                tok = 'async_startup_progress:';
+                if (starts_with(msg, tok))
+                {
+                    // files:bytes:dir -- dir may itself contain ':'
+                    var parts = msg.substring(tok.length, msg.length).split(':');
+                    main_on_status({status: 'syncing', exe_type: exe_type, files: parseInt(parts[0]), bytes: parseInt(parts[1]), dir: parts.slice(2).join(':')});
+                    return;
+                }
+ 
                 tok = 'async_startup_failed:';
                 if (starts_with(msg, tok))
                 {
@@ -623,12 +632,13 @@ var Module;
             id              value previously returned from new_http_request
             method          address (offset) of 'GET', 'POST', etc... c-string in Module.HEAP
             urlAddr         address (offset) of the url c-string to be used in Module.HEAP
+            headersAddr     address (offset) of a c-string of "Name: value" request headers, separated by newlines
             callbackAddr    function address (index-like thing) of the callback function that will be passed as the first parameter to Module.MS_HttpCallbackProc
             user_data       address (offset) of user_data that will be passed as the second parameter to Module.MS_HttpCallbackProc
             
             TODO: Get error handling (for example, 404 returns, etc...) lined up with nacl's behavior
         */
-        function open_http_request(id, method, urlAddr, callbackAddr, user_data)
+        function open_http_request(id, method, urlAddr, headersAddr, callbackAddr, user_data)
         {
             var xhr = httpRequests[id];
             if (!xhr)
@@ -646,7 +656,7 @@ var Module;
                 {
                     var cb = this.c_callback;
                     delete this.c_callback;
-                    if (this.status === 200 || this.status === 0)	// status === 0 is a firefox bug (perhaps only with blob urls??)
+                    if (this.status === 200 || this.status === 206 || this.status === 0)	// status === 0 is a firefox bug (perhaps only with blob urls??), 206 answers a Range header
                     {
                         this.c_buffer = this.response;
                         this.c_read_pos = 0;
@@ -669,6 +679,13 @@ var Module;
                 // we would like the reply in (an arraybuffer), and get it processing.  That results in eventually
                 // calling 'onload' or 'onerror'.
                 xhr.open(Module.Pointer_stringify(method), Module.Pointer_stringify(urlAddr), true);
+                var headers = Module.Pointer_stringify(headersAddr).split('\n');
+                for (var i = 0; i < headers.length; i++)
+                {
+                    var colon = headers[i].indexOf(':');
+                    if (colon > 0)
+                        xhr.setRequestHeader(headers[i].substr(0, colon).trim(), headers[i].substr(colon + 1).trim());
+                }
                 xhr.responseType = 'arraybuffer';
                 xhr.send();
             }
@@ -795,16 +812,16 @@ var Module;
     var callback_completions = {};
 
     // send the given 'msg' to the component.  Supports both the case where the
-    // component is nacl/pnacl, as well as asm.js -- although the support is
-    // somewhat limited in the asm.js case.  The intended use is only to support
-    // syntax of the form:
+    // component is nacl/pnacl, as well as asm.js.  The intended use is syntax of the form:
     //
     //		send_command( {someKey: 'someValue', someOtherKey: 'someOtherValue'} );
     //
-    // where 'msg' is a dictionary (object), and the values are all strings.  It also
-    // supports the case where a value is another object, but in this case it simply
-    // copies that contents of that object as if it were a Uint8Array into raw memory
-    // in Module.HEAP.  This form can be used on values that are things like typed arrays.
+    // where 'msg' is a dictionary (object).  Values can be strings, numbers, booleans, null,
+    // arrays and nested objects, and there is no limit on how many there are.  A value that
+    // is an ArrayBuffer or typed array is received by the component as a VarArrayBuffer.
+    // In the asm.js case the whole message is packed into a single buffer in Module.HEAP
+    // (see encode_message), and the bytes of each binary value are copied once, into memory
+    // that the VarArrayBuffer then owns.
     //
     // if 'completion' is not null then it should be a function object that looks like:
     //
@@ -830,49 +847,189 @@ var Module;
         }
         else
         {
-            if (msg instanceof Object)
+            var encoded = encode_message(msg);
+            Module.ccall('MS_MessageProc', 'null', ['number', 'number'], [encoded.addr, encoded.size]);
+            Module._free(encoded.addr);
+        }
+    }
+
+    // MS_VarType values, used as the type tags in encoded messages
+    var MS_VARTYPE_UNDEFINED = 0;
+    var MS_VARTYPE_NULL = 1;
+    var MS_VARTYPE_BOOL = 2;
+    var MS_VARTYPE_INT32 = 3;
+    var MS_VARTYPE_DOUBLE = 4;
+    var MS_VARTYPE_STRING = 5;
+    var MS_VARTYPE_ARRAY = 7;
+    var MS_VARTYPE_DICTIONARY = 8;
+    var MS_VARTYPE_ARRAY_BUFFER = 9;
+
+    var utf8_encoder = (typeof TextEncoder !== 'undefined') ? new TextEncoder() : null;
+
+    function utf8_bytes(str)
+    {
+        if (utf8_encoder)
+            return utf8_encoder.encode(str);
+        var bin = unescape(encodeURIComponent(str));
+        var bytes = new Uint8Array(bin.length);
+        for (var i = 0; i < bin.length; i++)
+            bytes[i] = bin.charCodeAt(i);
+        return bytes;
+    }
+
+    function is_binary(val)
+    {
+        return (val instanceof ArrayBuffer) || ArrayBuffer.isView(val);
+    }
+
+    // first pass of encode_message.  Returns the number of bytes needed to encode 'val'.  Collects the
+    // utf-8 bytes of every string in 'ctx.strs' and copies every binary value into its own _malloc'd
+    // block (recorded in 'ctx.bufs'), both in the order write_value will need them.
+    function encoded_size(val, ctx)
+    {
+        if (val === undefined || val === null)
+            return 1;
+        if (typeof val === 'boolean')
+            return 2;
+        if (typeof val === 'number')
+            return (val|0) === val ? 5 : 9;
+        if (typeof val === 'string')
+        {
+            var bytes = utf8_bytes(val);
+            ctx.strs.push(bytes);
+            return 5 + bytes.length;
+        }
+        if (is_binary(val))
+        {
+            var ar = ArrayBuffer.isView(val) ? new Uint8Array(val.buffer, val.byteOffset, val.byteLength) : new Uint8Array(val);
+            var addr = Module._malloc(ar.length || 1);
+            Module.HEAPU8.set(ar, addr);
+            ctx.bufs.push({addr: addr, len: ar.length});
+            return 5;
+        }
+        var size = 5;
+        if (Array.isArray(val))
+        {
+            for (var i = 0; i < val.length; i++)
+                size += encoded_size(val[i], ctx);
+            return size;
+        }
+        if (val instanceof Object)
+        {
+            for (var prop in val)
+                size += encoded_size(prop, ctx) - 1 + encoded_size(val[prop], ctx);
+            return size;
+        }
+        throw "invalid type in send_command: " + typeof val;
+    }
+
+    // second pass of encode_message.  Writes 'val' at ctx.pos in ctx.view
+    function write_value(val, ctx)
+    {
+        var view = ctx.view;
+        if (val === undefined || val === null)
+            view.setUint8(ctx.pos++, val === null ? MS_VARTYPE_NULL : MS_VARTYPE_UNDEFINED);
+        else if (typeof val === 'boolean')
+        {
+            view.setUint8(ctx.pos++, MS_VARTYPE_BOOL);
+            view.setUint8(ctx.pos++, val ? 1 : 0);
+        }
+        else if (typeof val === 'number')
+        {
+            if ((val|0) === val)
             {
-                var args = [];
-                var argDesc = [];
-                args.push(0);
-                argDesc.push('number');
-                var len = 0;
-                for (var prop in msg)
-                {
-                    if (typeof msg[prop] === 'string' || typeof msg[prop] === 'number')
-                    {
-                        len += 1;
-                        args.push(prop);
-                        args.push(0);
-                        args.push(msg[prop].toString());
-                        argDesc.push('string');
-                        argDesc.push('number');
-                        argDesc.push('string');
-                    }
-                    else if (msg[prop] instanceof Object)
-                    {
-                        len += 1;
-                        args.push(prop);
-                        var obj_len = msg[prop].byteLength;
-                        args.push(obj_len);
-                        var addr = Module._malloc(obj_len);
-                        var ar = new Uint8Array(msg[prop]);
-                        for (var i = 0; i < obj_len; i++)
-                            Module.HEAPU8[addr+i] = ar[i];
-                        args.push(addr);
-                        argDesc.push('string');
-                        argDesc.push('number');
-                        argDesc.push('number');
-                    }
-                    else
-                        throw "invalid type in send_command: " + typeof msg[prop];
-                }
-                args[0] = len;
-                Module.ccall('MS_MessageProc', 'null', argDesc, args);
+                view.setUint8(ctx.pos++, MS_VARTYPE_INT32);
+                view.setInt32(ctx.pos, val, true);
+                ctx.pos += 4;
+            }
+            else
+            {
+                view.setUint8(ctx.pos++, MS_VARTYPE_DOUBLE);
+                view.setFloat64(ctx.pos, val, true);
+                ctx.pos += 8;
+            }
+        }
+        else if (typeof val === 'string')
+        {
+            view.setUint8(ctx.pos++, MS_VARTYPE_STRING);
+            write_string(ctx);
+        }
+        else if (is_binary(val))
+        {
+            view.setUint8(ctx.pos++, MS_VARTYPE_ARRAY_BUFFER);
+            view.setUint32(ctx.pos, ctx.buf_index++, true);
+            ctx.pos += 4;
+        }
+        else if (Array.isArray(val))
+        {
+            view.setUint8(ctx.pos++, MS_VARTYPE_ARRAY);
+            view.setUint32(ctx.pos, val.length, true);
+            ctx.pos += 4;
+            for (var i = 0; i < val.length; i++)
+                write_value(val[i], ctx);
+        }
+        else
+        {
+            view.setUint8(ctx.pos++, MS_VARTYPE_DICTIONARY);
+            var count_pos = ctx.pos;
+            var count = 0;
+            ctx.pos += 4;
+            for (var prop in val)
+            {
+                write_string(ctx);
+                write_value(val[prop], ctx);
+                ++count;
             }
+            view.setUint32(count_pos, count, true);
         }
     }
 
+    // write the next string from ctx.strs as a length followed by its utf-8 bytes
+    function write_string(ctx)
+    {
+        var bytes = ctx.strs[ctx.str_index++];
+        ctx.view.setUint32(ctx.pos, bytes.length, true);
+        Module.HEAPU8.set(bytes, ctx.view.byteOffset + ctx.pos + 4);
+        ctx.pos += 4 + bytes.length;
+    }
+
+    // encode 'msg' into a _malloc'd block in the format MS_MessageProc expects (described in
+    // mutantspider.cpp).  The caller frees the returned 'addr' once MS_MessageProc returns.
+    // Any binary values are copied into their own blocks, listed in a table at the start of
+    // the message, and the component takes ownership of all of them.
+    function encode_message(msg)
+    {
+        var ctx = {strs: [], str_index: 0, bufs: [], buf_index: 0, pos: 0};
+        var size;
+        try
+        {
+            size = 4 + encoded_size(msg, ctx);
+        }
+        catch (e)
+        {
+            // nothing has been handed to the component yet, so the blocks are still ours
+            for (var i = 0; i < ctx.bufs.length; i++)
+                Module._free(ctx.bufs[i].addr);
+            throw e;
+        }
+        size += ctx.bufs.length * 12;
+
+        // allocate this last -- the _malloc's in encoded_size may have replaced Module.HEAPU8.buffer
+        var addr = Module._malloc(size);
+        ctx.view = new DataView(Module.HEAPU8.buffer, addr, size);
+        ctx.view.setUint32(ctx.pos, ctx.bufs.length, true);
+        ctx.pos += 4;
+        for (var i = 0; i < ctx.bufs.length; i++)
+        {
+            ctx.view.setUint32(ctx.pos, ctx.bufs[i].len, true);
+            ctx.view.setUint32(ctx.pos + 4, ctx.bufs[i].addr, true);
+            ctx.view.setUint32(ctx.pos + 8, 0, true);
+            ctx.pos += 12;
+        }
+        write_value(msg, ctx);
+        return {addr: addr, size: size};
+    }
+
     /*
         main entry point to initialize an element so that it is supported by a mutantspider component.
         
@@ -907,6 +1064,14 @@ var Module;
                                                             'JavaScript'
                                                             'JavaScript Heap File'
                     
+                            'syncing'   - sent while the component is starting up, once for each of its persistent
+                                          directories that had to be read file by file (see mutantspider::init_fs).
+                                          For the 'syncing' status the following additional attributes will be defined:
+                                          
+                                          'files'       - the number of files read from the directory
+                                          'bytes'       - the number of bytes copied from those files
+                                          'dir'         - the name of the directory
+                    
                             'running'   - sent after 'loading' has completed successfully.  Indicates that the
                                           component is now running correctly.  For the 'running' status the following
                                           additional attributes will be defined:
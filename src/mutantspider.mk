@@ -22,6 +22,20 @@
 #
 ms.this_make_dir:=$(dir $(lastword $(MAKEFILE_LIST)))
 
+#
+# goals that only build the native "host" version of the component (see README.makefile).
+# When every goal on the command line is one of these, the nacl sdk and emcc are not
+# needed, so we don't check for them (or run any of their tools).
+#
+ms.HOST_GOALS+=host
+ifneq (,$(MAKECMDGOALS))
+ ifeq (,$(filter-out $(ms.HOST_GOALS),$(MAKECMDGOALS)))
+  ms.host_only:=1
+ endif
+endif
+
+ifeq (,$(ms.host_only))
+
 #
 # Make sure there is a nacl_sdk_root symlink directory
 #
@@ -80,6 +94,9 @@ ifeq (,$(shell which emcc))
  $(error )
 endif
 
+# end of "if not ms.host_only"
+endif
+
 #
 # Root directory into which temp .o files will be placed
 #
@@ -131,7 +148,11 @@ ms.EMCC_CLOSURE_COMPILER := $(shell which emcc | sed 's:\(^.*\)emcc$$:\1third_pa
 # using a few tools from the nacl sdk
 
 ms.getos := python $(ms.this_make_dir)nacl_sdk_root/tools/getos.py
-ms.osname := $(shell $(ms.getos))
+ifeq (,$(ms.host_only))
+ ms.osname := $(shell $(ms.getos))
+else
+ ms.osname := $(subst darwin,mac,$(shell uname -s | tr A-Z a-z))
+endif
 ms.tc_path := $(realpath $(ms.this_make_dir)nacl_sdk_root/toolchain)
 ms.lib_root := $(ms.this_make_dir)nacl_sdk_root/lib/pnacl
 
@@ -160,6 +181,13 @@ ms.em_cc := emcc
 ms.em_cxx := emcc
 ms.em_link := emcc
 
+#
+# the native (host) tools.  These can be set on the command line or prior to including mutantspider.mk
+#
+ms.host_cc ?= cc
+ms.host_cxx ?= c++
+ms.host_link ?= $(ms.host_cxx)
+
 #
 # Strategy for only calling mkdir on output directories once.
 # We put a file named "dir.stamp" in each of those directories
@@ -253,6 +281,13 @@ LDFLAGS_emcc_debug+=-s ASSERTIONS=1
 #
 ms.EM_EXPORTS+='_MS_Init', '_MS_MouseProc', '_MS_FocusProc', '_MS_KeyProc', '_MS_DidChangeView', '_MS_TouchProc', 'Pointer_stringify', '_MS_MessageProc', '_MS_DoCallbackProc', '_MS_SetLocale', '_MS_AsyncStartupComplete', '_main'
 
+#
+# library_rezfs.js reads compressed resources (see <file>_COMPRESS) through MS_RezRead
+#
+ifneq (,$(RESOURCES))
+ms.EM_EXPORTS+=, '_MS_RezRead'
+endif
+
 #
 # the projects we are interested in produce smaller files if memory-init-file is turned on.  We also add some standard asm.js library stuff
 #
@@ -265,6 +300,15 @@ LDFLAGS_emcc+=--memory-init-file 1 -s EXPORTED_FUNCTIONS="[$(ms.EM_EXPORTS)]" --
 #
 LDFLAGS_emcc+=--js-library $(ms.this_make_dir)library_pbmemfs.js
 
+#
+# host builds.  mutantspider_host_io.cpp replaces libc's file functions (open, read, etc...)
+# with versions that know about /persistent and /resources, and _FORTIFY_SOURCE would
+# route some of those calls around it, so it is turned off.
+#
+CFLAGS_host+=-DMUTANTSPIDER_HOST -pthread -U_FORTIFY_SOURCE
+LDFLAGS_host+=-pthread
+ms.host_libs+=-ldl
+
 #
 # a few files that implement some (mostly emscripten) support code
 #
@@ -272,6 +316,16 @@ ms.additional_sources:=\
 $(ms.this_make_dir)mutantspider.cpp\
 $(ms.this_make_dir)mutantspider_fs.cpp
 
+#
+# the code that implements the host platform, only linked into host builds.
+# mutantspider_host_main.cpp is the default driver.  If you want your own main
+# add mutantspider_host_main.cpp (full path) to host_EXCLUDE
+#
+ms.host_sources:=\
+$(ms.this_make_dir)mutantspider_host.cpp\
+$(ms.this_make_dir)mutantspider_host_io.cpp\
+$(ms.this_make_dir)mutantspider_host_main.cpp
+
 #
 # everyone will need to #include "mutantspider.h"
 #
@@ -326,6 +380,7 @@ fi
 # to rebuild the target - even if our ms.options_check logic didn't end up updating
 # the compiler.opts file.
 #
+ifeq (,$(ms.host_only))
 ms.m:=$(shell bash -c "$(call ms.options_check,compiler_pnacl,$(CFLAGS) $(CFLAGS_pnacl) $(CFLAGS_$(CONFIG)) $(CFLAGS_pnacl_$(CONFIG)))")
 ifneq (,$(ms.m))
 $(info $(ms.m))
@@ -342,6 +397,15 @@ ms.m:=$(shell bash -c "$(call ms.options_check,linker_emcc,$(LDFLAGS) $(LDFLAGS_
 ifneq (,$(ms.m))
 $(info $(ms.m))
 endif
+endif
+ms.m:=$(shell bash -c "$(call ms.options_check,compiler_host,$(ms.host_cxx) $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_host) $(CFLAGS_host_$(CONFIG)))")
+ifneq (,$(ms.m))
+$(info $(ms.m))
+endif
+ms.m:=$(shell bash -c "$(call ms.options_check,linker_host,$(ms.host_link) $(LDFLAGS) $(LDFLAGS_$(CONFIG)) $(LDFLAGS_host) $(LDFLAGS_host_$(CONFIG)) $(ms.host_libs))")
+ifneq (,$(ms.m))
+$(info $(ms.m))
+endif
 
 # end of "if MAKECMDGOALS != clean"
 endif
@@ -360,6 +424,9 @@ display_opts:
 	@echo $(shell which emcc)
 	@cat $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_emcc.opts
 	@echo
+	@echo "**** C/C++, host ****"
+	@cat $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_host.opts
+	@echo
 
 #
 # helper target to see some interesting targets you can pass to make
@@ -379,6 +446,7 @@ define ms.c_compile_rule
 
 -include $(call ms.src_to_dep,$(1),_pnacl)
 -include $(call ms.src_to_dep,$(1),_js)
+-include $(call ms.src_to_dep,$(1),_host)
 
 $(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_pnacl.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
 	$(call ms.CALL_TOOL,$(ms.pnacl_cc),-o $$@ -c $$< -MD -MF $(call ms.src_to_dep,$(1),_pnacl) -I$(ms.this_make_dir)nacl_sdk_root/include $(2) $(CFLAGS) $(CFLAGS_pnacl) $(CFLAGS_$(CONFIG)) $(CFLAGS_pnacl_$(CONFIG)) $(CFLAGS_pnacl_$(1)),$$@)
@@ -386,12 +454,16 @@ $(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compile
 $(call ms.src_to_obj,$(1),_js): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_emcc.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
 	$(call ms.CALL_TOOL,$(ms.em_cc),-o $$@ $$< -MD -MF $(call ms.src_to_dep,$(1),_js) $(2) $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_emcc) $(CFLAGS_emcc_$(CONFIG)) $(CFLAGS_emcc_$(1)),$$@)
 
+$(call ms.src_to_obj,$(1),_host): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_host.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
+	$(call ms.CALL_TOOL,$(ms.host_cc),-o $$@ -c $$< -MD -MF $(call ms.src_to_dep,$(1),_host) $(2) $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_host) $(CFLAGS_host_$(CONFIG)) $(CFLAGS_host_$(1)),$$@)
+
 endef
 
 define ms.cxx_compile_rule
 
 -include $(call ms.src_to_dep,$(1),_pnacl)
 -include $(call ms.src_to_dep,$(1),_js)
+-include $(call ms.src_to_dep,$(1),_host)
 
 $(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_pnacl.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
 	$(call ms.CALL_TOOL,$(ms.pnacl_cxx),-o $$@ -c $$< -MD -MF $(call ms.src_to_dep,$(1),_pnacl) -I$(ms.this_make_dir)nacl_sdk_root/include $(2) -std=gnu++11 $(CFLAGS) $(CFLAGS_pnacl) $(CFLAGS_$(CONFIG)) $(CFLAGS_pnacl_$(CONFIG)) $(CFLAGS_pnacl_$(1)),$$@)
@@ -399,6 +471,9 @@ $(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compile
 $(call ms.src_to_obj,$(1),_js): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_emcc.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
 	$(call ms.CALL_TOOL,$(ms.em_cxx),-o $$@ $$< -MD -MF $(call ms.src_to_dep,$(1),_js) $(2) -std=c++0x $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_emcc) $(CFLAGS_emcc_$(CONFIG)) $(CFLAGS_emcc_$(1)),$$@)
 
+$(call ms.src_to_obj,$(1),_host): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_host.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
+	$(call ms.CALL_TOOL,$(ms.host_cxx),-o $$@ -c $$< -MD -MF $(call ms.src_to_dep,$(1),_host) $(2) -std=gnu++11 $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_host) $(CFLAGS_host_$(CONFIG)) $(CFLAGS_host_$(1)),$$@)
+
 endef
 
 #
@@ -474,6 +549,24 @@ $(ms.OUT_DIR)/$(CONFIG)/$(1).js.mem: $(ms.OUT_DIR)/$(CONFIG)/$(1).js
 
 endef
 
+#
+#	$1	unprefixed and unpostfixed final executable name
+#	$2	list of source files to compile and link
+#
+#	Builds $(ms.OUT_DIR)/$(CONFIG)/$(1)_host, a native executable of the component, and adds
+#	the phony 'host' target to build it.  Note that this target will ignore any source file
+#	that is included in $(host_EXCLUDE)
+#
+define ms.host_linker_rule
+$(ms.OUT_DIR)/$(CONFIG)/$(1)_host: $(ms.INTERMEDIATE_DIR)/$(CONFIG)/linker_host.opts $(sort $(foreach src,$(filter-out $(host_EXCLUDE),$(2)),$(call ms.src_to_obj,$(src),_host)))
+	$(ms.mkdir) -p $$(@D)
+	$(call ms.CALL_TOOL,$(ms.host_link),$(LDFLAGS) $(LDFLAGS_$(CONFIG)) $(LDFLAGS_host) $(LDFLAGS_host_$(CONFIG)) -o $$@ $$(filter-out %.opts,$$^) $(ms.host_libs),$$@)
+
+.PHONY: host
+host: $(ms.OUT_DIR)/$(CONFIG)/$(1)_host
+
+endef
+
 #
 # $1 build name
 # $2 source files to compile
@@ -482,10 +575,11 @@ endef
 #
 define ms.BUILD_RULES
 
-$(foreach cpp_src,$(filter %.cc %.cpp,$(2) $(ms.additional_sources)),$(call ms.cxx_compile_rule,$(cpp_src),$(foreach inc,$(3) $(ms.additional_inc_dirs),-I$(inc))))
+$(foreach cpp_src,$(filter %.cc %.cpp,$(2) $(ms.additional_sources) $(ms.host_sources)),$(call ms.cxx_compile_rule,$(cpp_src),$(foreach inc,$(3) $(ms.additional_inc_dirs),-I$(inc))))
 $(foreach c_src,$(filter %.c,$(2) $(ms.additional_sources)),$(call ms.c_compile_rule,$(c_src),$(foreach inc,$(3) $(ms.additional_inc_dirs),-I$(inc))))
 $(call ms.nacl_linker_rule,$(1),$(2) $(ms.additional_sources),$(4))
 $(call ms.em_linker_rule,$(1),$(2) $(ms.additional_sources))
+$(call ms.host_linker_rule,$(1),$(2) $(ms.additional_sources) $(ms.host_sources))
 
 endef
 
@@ -510,51 +604,68 @@ ms.sanitize_rez_name=rezRec_$(subst /,XS,$(subst .,X_,$(subst X,XX,$(1))))
 
 
 #
-# Get the size of a given file.
-#
-# $1 = File Name
+# the tool that converts one resource file to C++ (see mutantspider_rezpack.cpp).
+# It runs on the machine doing the build, so it is compiled with the host compiler.
 #
-ifeq (linux,$(ms.osname))
- ms.file_size=`stat -c %s $(1)`
-endif
-ifeq (mac,$(ms.osname))
- ms.file_size=`stat -f %z $(1)`
- ms.nlescape=\'$$'
-endif
+ms.rezpack:=$(ms.INTERMEDIATE_DIR)/tools/mutantspider_rezpack
 
+$(ms.rezpack): $(ms.this_make_dir)mutantspider_rezpack.cpp | $(ms.INTERMEDIATE_DIR)/tools/dir.stamp
+	$(call ms.CALL_TOOL,$(ms.host_cxx),-O2 -o $@ $<,$@)
 
 #
 # $1 file name of path/file to be treated as a resource.  The recipe for this
-# runs the contents of the file, $(1), through od (and then sed) to generate
-# a text file that contains a C-like array of hex values -- as in "0x54, 0x2f, ..."
-# with the contents of the file.
+# runs mutantspider_rezpack on the file, which writes a C++ file defining its
+# rez_file_ent, plus a .inc file next to it holding the file's contents as a
+# string literal.  Host builds read the contents directly from $(1) with .incbin,
+# pnacl and emcc builds compile the .inc.
+# If $(1)_COMPRESS is set (the only value currently supported is lz4), the file is
+# stored compressed, in blocks that rezfs decompresses as they are read.
 #
 define ms.resource_rule
-$(call ms.resrc_to_auto_gen,$(1)): $(1) | $(dir $(call ms.resrc_to_auto_gen,$(1)))dir.stamp
-	@echo "// AUTO-GENERATED by mutantspider.mk, based on the contents of $(notdir $(1))" > $$@
-	@echo "// DO NOT EDIT" >> $$@
-	@echo "" >> $$@
-	@echo "#include <mutantspider.h>" >> $$@
-	@echo "" >> $$@
-	@echo "namespace mutantspider {" >> $$@
-	@printf "const unsigned char $(call ms.sanitize_rez_name,$(1))_[" >> $$@
-	@printf "$(call ms.file_size,$(1))" >> $$@
-	@echo "] = {" >> $$@
-	@cat $$< | od -vt x1 -An | sed 's/\(\ \)\([0-9a-f][0-9a-f]\)/0x\2,/g' >> $$@
-	@echo "};" >> $$@
-	@echo "extern const rez_file_ent $(call ms.sanitize_rez_name,$(1));" >> $$@
-	@echo "const rez_file_ent $(call ms.sanitize_rez_name,$(1)) = { &$(call ms.sanitize_rez_name,$(1))_[0], $(call ms.file_size,$(1)) };" >> $$@
-	@echo "}" >> $$@
+$(call ms.resrc_to_auto_gen,$(1)): $(1) $(ms.rezpack) | $(dir $(call ms.resrc_to_auto_gen,$(1)))dir.stamp
+	$(call ms.CALL_TOOL,$(ms.rezpack),$(if $($(1)_COMPRESS),-c $($(1)_COMPRESS)) $(call ms.sanitize_rez_name,$(1)) $$< $$@,$$@)
 
 endef
 
+$(foreach rez,$(RESOURCES),$(if $(filter-out lz4,$($(rez)_COMPRESS)),$(error $(rez)_COMPRESS is "$($(rez)_COMPRESS)", the only supported value is lz4)))
+
+#
+# When RESOURCE_PACK is set, the contents of the resources go in that file instead of
+# the executable, except for the ones with <file>_BUILT_IN set.  Only their index is
+# compiled in (resource_pack.cpp), and rezfs downloads the parts of the pack that are
+# read.  The pack is written to $(ms.OUT_DIR)/$(CONFIG), and is part of ms.TARGET_LIST
+#
+ms.packed_resources=$(if $(RESOURCE_PACK),$(foreach rez,$(RESOURCES),$(if $($(rez)_BUILT_IN),,$(rez))))
+ms.built_in_resources=$(filter-out $(ms.packed_resources),$(RESOURCES))
+
 #
-# establish build targets of all of the resource C++ files
+# establish build targets of all of the built in resource C++ files
 #
-$(foreach rez,$(RESOURCES),$(eval $(call ms.resource_rule,$(rez))))
+$(foreach rez,$(ms.built_in_resources),$(eval $(call ms.resource_rule,$(rez))))
 
 ms.rez_decl=$(foreach rez,$(RESOURCES),extern const rez_file_ent $(call ms.sanitize_rez_name,$(rez));)
-ms.rez_files=$(foreach rez,$(RESOURCES),$(call ms.resrc_to_auto_gen,$(rez)))
+ms.rez_files=$(foreach rez,$(ms.built_in_resources),$(call ms.resrc_to_auto_gen,$(rez)))
+
+ifneq (,$(ms.packed_resources))
+
+ms.pack_cpp:=$(ms.INTERMEDIATE_DIR)/auto_gen/resource_pack.cpp
+ms.pack_file:=$(ms.INTERMEDIATE_DIR)/auto_gen/$(notdir $(RESOURCE_PACK))
+ms.pack_target:=$(ms.OUT_DIR)/$(CONFIG)/$(notdir $(RESOURCE_PACK))
+ms.rez_files+=$(ms.pack_cpp)
+
+# mutantspider_rezpack writes the pack before resource_pack.cpp, so the pack is never the newer one
+$(ms.pack_cpp): $(ms.packed_resources) $(ms.rezpack) | $(ms.INTERMEDIATE_DIR)/auto_gen/dir.stamp
+	$(call ms.CALL_TOOL,$(ms.rezpack),-p $(ms.pack_file) $(notdir $(RESOURCE_PACK)) $@ $(foreach rez,$(ms.packed_resources),$(if $($(rez)_COMPRESS),-c $($(rez)_COMPRESS)) $(call ms.sanitize_rez_name,$(rez)) $(rez)),$@)
+
+$(ms.pack_target): $(ms.pack_cpp)
+	$(ms.mkdir) -p $(@D)
+	$(call ms.CALL_TOOL,ln,-f $(ms.pack_file) $@,$@)
+
+# host builds read the pack through host::set_url_root, e.g. MS_HOST_URL_ROOT=$(ms.OUT_DIR)/$(CONFIG)
+.PHONY: host
+host: $(ms.pack_target)
+
+endif
 
 #
 # this list of all directories listed as parent of any RESOURCE file
@@ -622,22 +733,33 @@ endef
 $(foreach rez,$(RESOURCES),$(eval $(call ms.add_file_initializer,$(rez))))
 
 #
-# finally, ms.dir_init_code will contain all of the C/C++ code that initializes
-# the directory structures -- other than, it will have a set of {{xx}} tokens in
-# it that will need to be swapped out for legal C characters.  These are used for
-# a variety of reasons.  But one is that some places that would otherwise need to
-# add a ',' character are in places where make itself would attempt to intperpret
-# that character as meaningful in the expression.  So ','  ','-followed by newline,
-# and newline are all written in as symbols for later substitution.
+# finally, ms.write_rez_dir writes the C/C++ code that initializes one directory
+# structure.  The initialization snippets have {{xx}} tokens in them that need
+# to be swapped out for legal C characters -- some places that would otherwise
+# need a ',' character are in places where make itself would attempt to
+# intperpret that character as meaningful in the expression.  The snippets are
+# written one per line and then sorted by the name between the first pair of
+# quotes, in strcmp order, so rezfs can binary search them (see rez_dir::sorted).
 #
-ms.construct_init_code=const rez_dir_ent $(2)_ents[] = {{{NL}}$(1)};{{NL}}rez_dir $(2) = {$(words $(1)){{COMMA}}&$(2)_ents[0]};
+#   $1 the initializer list (ms.initializer_...)
+#   $2 the name of the rez_dir
+#   $3 the name of its rez_dir_ent array
+#   $4 "const " or nothing
+#
+define ms.write_rez_dir
+	@echo "const rez_dir_ent $(3)[] = {" >> $@
+	@echo "$($(1))" | tr ' ' '\n' | sed '/^$$/d' | sed 's/{{COMMAN}}/,/g' | sed 's/{{COMMA}}/,/g' | LC_ALL=C sort -t'"' -k2,2 >> $@
+	@echo "};" >> $@
+	@echo "" >> $@
+	@echo "$(4)rez_dir $(2) = { $(words $($(1))), &$(3)[0], 1 };" >> $@
+	@echo "" >> $@
 
-ms.dir_init_code:=$(foreach init,$(ms.initializer_list),$(call ms.construct_init_code,$($(init)),$(subst ms.initializer_,,$(init))))
+endef
 
 
 ###############
 
-$(ms.INTERMEDIATE_DIR)/auto_gen/resource_list.cpp: $(RESOURCES)
+$(ms.INTERMEDIATE_DIR)/auto_gen/resource_list.cpp: $(RESOURCES) $(ms.this_make_dir)mutantspider.mk | $(ms.INTERMEDIATE_DIR)/auto_gen/dir.stamp
 	@echo "// AUTO-GENERATED by mutantspider.mk, based on the value of the make variable RESOURCES" > $@
 	@echo "// DO NOT EDIT" >> $@
 	@echo "" >> $@
@@ -647,14 +769,10 @@ $(ms.INTERMEDIATE_DIR)/auto_gen/resource_list.cpp: $(RESOURCES)
 	@echo "" >> $@
 	@echo "$(ms.rez_decl)" | sed 's/; /;/g' | sed G >> $@
 	@echo "" >> $@
-	@echo "$(ms.dir_init_code)" | sed 's/; /;/g' | sed 's/{{COMMA}}/,/g' | sed 's/{{COMMAN}}/,$(ms.nlescape)\n/g' | sed 's/{{NL}}/$(ms.nlescape)\n/g' | sed 's/;/;$(ms.nlescape)\n/g' | sed 's/^ *//g' >> $@
-	@echo "const rez_dir_ent rez_root_dir_ents[] = {" >> $@
-	@echo "$(ms.root_initializer)" | sed 's/; /;/g' | sed 's/{{COMMA}}/,/g' | sed 's/{{COMMAN}}/,$(ms.nlescape)\n/g' | sed 's/;/;$(ms.nlescape)\n/g' >> $@
-	@echo "};" >> $@
-	@echo "" >> $@
-	@echo "const rez_dir rez_root_dir = { $(words $(ms.root_initializer)), &rez_root_dir_ents[0] };" >> $@
-	@echo "" >> $@
+	$(foreach init,$(ms.initializer_list),$(call ms.write_rez_dir,$(init),$(subst ms.initializer_,,$(init)),$(subst ms.initializer_,,$(init))_ents))
+	$(call ms.write_rez_dir,ms.root_initializer,rez_root_dir,rez_root_dir_ents,const )
 	@echo "const rez_dir_ent rez_root_dir_ent = { \"\", (const rez_file_ent*)&rez_root_dir, true };" >> $@
+	$(if $(ms.packed_resources),,@echo "const char* const rez_pack_url = 0;" >> $@)
 	@echo "" >> $@
 	@echo "}" >> $@
 	
@@ -730,7 +848,8 @@ ms.TARGET_LIST=\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).$(ms.nacl_ext)\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).nmf\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).js\
-$(ms.OUT_DIR)/$(CONFIG)/$(1).js.mem
+$(ms.OUT_DIR)/$(CONFIG)/$(1).js.mem\
+$(ms.pack_target)
 
 %.nmf: $(basename $(notdir %)).$(ms.nacl_ext)
 	$(call ms.CALL_TOOL,python,$(ms.this_make_dir)nacl_sdk_root/tools/create_nmf.py -o $@ $^ -s $(@D),$@)
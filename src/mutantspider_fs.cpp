@@ -48,153 +48,3053 @@ static void mkdir_p(const std::string& path)
     }
 }
 
-#if defined(__native_client__)
+// add an entry to 'scan' (see mutantspider::scan_dir)
+static void add_scan_entry(mutantspider::dir_scan& scan, const char* name, const struct stat& st)
+{
+    mutantspider::dir_scan::entry ent;
+    ent.name_offset = (uint32_t)scan.names.size();
+    ent.st = st;
+    scan.entries.push_back(ent);
+    scan.names.insert(scan.names.end(), name, name + strlen(name) + 1);
+}
 
-#include <sys/mount.h>
-#include <nacl_io/nacl_io.h>
-#include <nacl_io/fuse.h>
-#include <future>
+/*
+ read the entries of the (real, not fuse) directory 'dir_path', and stat each
+ of them, into 'scan'.  Returns 0 or an errno value
+ */
+static int scan_real_dir(const std::string& dir_path, mutantspider::dir_scan& scan, bool dots)
+{
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir)
+        return errno;
+    std::string path = dir_path + "/";
+    auto base = path.size();
+    while (struct dirent* ent = readdir(dir))
+    {
+        if (!dots && (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0))
+            continue;
+        path.resize(base);
+        path += ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+            add_scan_entry(scan, ent->d_name, st);
+    }
+    closedir(dir);
+    return 0;
+}
+
+#if defined(MUTANTSPIDER_HOST)
+#include "mutantspider_host.h"
+#endif
+
+#if defined(__native_client__) || defined(MUTANTSPIDER_HOST) || defined(MUTANTSPIDER_HAS_RESOURCES)
+// true on the thread that CallOnMainThread and URLLoader callbacks run on.  asm.js only has the one thread
+static bool on_main_thread()
+{
+    #if defined(__native_client__)
+    return pp::Module::Get()->core()->IsMainThread();
+    #elif defined(MUTANTSPIDER_HOST)
+    return mutantspider::host::is_main_thread();
+    #else
+    return true;
+    #endif
+}
+#endif
+
+#if defined(MUTANTSPIDER_HAS_RESOURCES)
+
+/*
+    compressed resources (<file>_COMPRESS = lz4 in the makefile).  mutantspider_rezpack
+    splits these files into blocks of rez_file_ent::block_size bytes and compresses each
+    one on its own (lz4's block format), so reading from the middle of a file only
+    decompresses the block(s) that cover what is read.  A block that doesn't get any
+    smaller is stored as-is, and the offsets in rez_file_ent::blocks show it as being
+    exactly its uncompressed size.  This code is shared by all builds, library_rezfs.js
+    calls read_rez_file through MS_RezRead.
+*/
+
+#include <algorithm>
+#include <condition_variable>
 #include <list>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/time.h>
-#include <ppapi/c/pp_macros.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+/*
+ decompress the lz4 block of 'src_sz' bytes at 'src' into 'dst', which holds the
+ 'dst_sz' bytes it should decompress to.  Returns false if the block is malformed
+ */
+static bool lz4_decode(const unsigned char* src, size_t src_sz, unsigned char* dst, size_t dst_sz)
+{
+    auto src_end = src + src_sz;
+    auto op = dst;
+    auto dst_end = dst + dst_sz;
+    for (;;)
+    {
+        if (src == src_end)
+            return false;
+        unsigned token = *src++;
+
+        // literals
+        size_t len = token >> 4;
+        if (len == 15)
+        {
+            unsigned b;
+            do {
+                if (src == src_end)
+                    return false;
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(src_end - src) || len > (size_t)(dst_end - op))
+            return false;
+        memcpy(op, src, len);
+        op += len;
+        src += len;
+
+        // the last sequence is only literals
+        if (src == src_end)
+            return op == dst_end;
+
+        // match
+        if (src_end - src < 2)
+            return false;
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return false;
+        len = token & 15;
+        if (len == 15)
+        {
+            unsigned b;
+            do {
+                if (src == src_end)
+                    return false;
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;
+        if (len > (size_t)(dst_end - op))
+            return false;
+        auto match = op - offset;
+        if (offset >= len)
+        {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else
+        {
+            // overlapping copy, which repeats the last 'offset' bytes.  Copies of
+            // up to 'offset' bytes at a time don't overlap
+            while (len > 0)
+            {
+                size_t n = len < offset ? len : offset;
+                memcpy(op, match, n);
+                op += n;
+                match += n;
+                len -= n;
+            }
+        }
+    }
+}
+
+struct rez_block
+{
+    const mutantspider::rez_file_ent*                   file_;
+    size_t                                              index_;
+    std::shared_ptr<const std::vector<unsigned char>>   data_;
+};
+
+// decompressed blocks, most recently used first, and where each is in that list
+static std::list<rez_block> rez_blocks;
+static std::map<std::pair<const mutantspider::rez_file_ent*, size_t>, std::list<rez_block>::iterator> rez_block_index;
+static size_t rez_blocks_bytes = 0;
+static size_t rez_blocks_limit = 1024 * 1024;
+static std::mutex rez_blocks_mtx;
+
+// the storage of the resource_views of compressed and packed files, also guarded by rez_blocks_mtx.
+// The storage's deleter removes its entry (see get_resource_view)
+static std::map<const mutantspider::rez_file_ent*, std::weak_ptr<const std::vector<unsigned char>>> rez_views;
+
+// drop the least recently used blocks until the cache fits its limit.  The caller holds rez_blocks_mtx
+static void trim_rez_blocks()
+{
+    while (rez_blocks_bytes > rez_blocks_limit)
+    {
+        auto& block = rez_blocks.back();
+        rez_blocks_bytes -= block.data_->size();
+        rez_block_index.erase(std::make_pair(block.file_, block.index_));
+        rez_blocks.pop_back();
+    }
+}
+
+// the cached block 'index' of 'file' (moving it to the front), or null.  The caller holds rez_blocks_mtx
+static std::shared_ptr<const std::vector<unsigned char>> find_rez_block(const mutantspider::rez_file_ent* file, size_t index)
+{
+    auto it = rez_block_index.find(std::make_pair(file, index));
+    if (it == rez_block_index.end())
+        return nullptr;
+    rez_blocks.splice(rez_blocks.begin(), rez_blocks, it->second);
+    return it->second->data_;
+}
+
+/*
+ block 'index' of 'file' decompressed (from the 'src_sz' bytes at 'src'), from the cache
+ if it is there.  The data is shared, so it stays valid after the cache drops it.  Null
+ if the block is malformed.
+ */
+static std::shared_ptr<const std::vector<unsigned char>> get_rez_block(const mutantspider::rez_file_ent* file, size_t index,
+                                                                        const unsigned char* src, size_t src_sz, size_t raw_sz)
+{
+    {
+        std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+        if (auto data = find_rez_block(file, index))
+            return data;
+    }
+
+    // decompress without holding the lock, other threads may be reading other blocks
+    auto data = std::make_shared<std::vector<unsigned char>>(raw_sz);
+    if (!lz4_decode(src, src_sz, &(*data)[0], raw_sz))
+        return nullptr;
+
+    std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+    if (auto other = find_rez_block(file, index))
+        return other;
+    if (raw_sz <= rez_blocks_limit)
+    {
+        rez_blocks.push_front(rez_block{file, index, data});
+        rez_block_index[std::make_pair(file, index)] = rez_blocks.begin();
+        rez_blocks_bytes += raw_sz;
+        trim_rez_blocks();
+    }
+    return data;
+}
+
+// strcmp(d_name, the 'len' characters at 'name')
+static int compare_d_name(const char* d_name, const char* name, size_t len)
+{
+    int cmp = strncmp(d_name, name, len);
+    if (cmp != 0)
+        return cmp;
+    return d_name[len] == 0 ? 0 : 1;
+}
+
+// the entry in 'dir' whose name is the 'len' characters at 'name', or 0.  Directories
+// written by mutantspider.mk are sorted, ones built some other way might not be
+static const mutantspider::rez_dir_ent* find_dir_ent(const char* name, size_t len, const mutantspider::rez_dir* dir)
+{
+    if (dir->sorted)
+    {
+        size_t lo = 0;
+        size_t hi = dir->num_ents;
+        while (lo < hi)
+        {
+            auto mid = lo + (hi - lo) / 2;
+            int cmp = compare_d_name(dir->ents[mid].d_name, name, len);
+            if (cmp == 0)
+                return &dir->ents[mid];
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < dir->num_ents; i++)
+    {
+        if (compare_d_name(dir->ents[i].d_name, name, len) == 0)
+            return &dir->ents[i];
+    }
+    return 0;
+}
+
+// walks 'path' (relative to /resources) one component at a time, in place
+static const mutantspider::rez_dir_ent* get_dir_ent(const char* path)
+{
+    // path always starts with a '/'
+    if (strcmp(path, "/") == 0)
+        return &mutantspider::rez_root_dir_ent;
+    
+    auto dir = &mutantspider::rez_root_dir;
+    auto name = path + 1;
+    for (;;)
+    {
+        auto slash = strchr(name, '/');
+        auto ent = find_dir_ent(name, slash ? slash - name : strlen(name), dir);
+        if (!ent || !slash)
+            return ent;
+        if (ent->is_dir == 0)
+            return 0;
+        dir = ent->ptr.dir;
+        name = slash + 1;
+    }
+}
+
+// the entry for 'path', an absolute path that is /resources or inside it, or 0
+static const mutantspider::rez_dir_ent* resource_ent(const std::string& path)
+{
+    if (path.compare(0, 10, "/resources") != 0)
+        return 0;
+    if (path.size() == 10)
+        return &mutantspider::rez_root_dir_ent;
+    return path[10] == '/' ? get_dir_ent(path.c_str() + 10) : 0;
+}
+
+/*
+    the resource pack (RESOURCE_PACK in the makefile).  The rez_file_ents of the files in
+    it are compiled in like any others, but have no file_data.  Their bytes are downloaded
+    from rez_pack_url with Range requests, pack_fetch_blocks blocks at a time starting with
+    the one being read, and kept in pack_blocks from then on.  For a compressed file it is
+    the compressed blocks that are downloaded and kept, and get_rez_block decompresses them
+    the same as it does built-in ones.  URLLoader only runs on the main thread, so that is
+    where every download is started and finished.
+*/
+
+struct pack_block
+{
+    std::shared_ptr<const std::vector<unsigned char>>   data_;      // null while the download is pending
+    bool                                                failed_;
+};
+
+struct pack_waiter
+{
+    const mutantspider::rez_file_ent*   file_;
+    mutantspider::CompletionCallback    callback_;
+};
+
+typedef std::pair<const mutantspider::rez_file_ent*, size_t> pack_key;
+
+static const size_t pack_fetch_blocks = 16;
+static MS_AppInstance* rez_pack_inst = 0;
+static std::map<pack_key, pack_block> pack_blocks;
+static std::list<pack_waiter> pack_waiters;     // see fetch_resource
+static std::mutex pack_mtx;
+static std::condition_variable pack_cnd;
+
+static size_t pack_num_blocks(const mutantspider::rez_file_ent* file)
+{
+    return (file->file_data_sz + file->block_size - 1) / file->block_size;
+}
+
+// where the stored bytes of block 'index' of 'file' start in the pack, 'index' can be the number of blocks
+static size_t pack_block_offset(const mutantspider::rez_file_ent* file, size_t index)
+{
+    if (file->blocks)
+        return file->pack_offset + file->blocks[index];
+    size_t start = index * file->block_size;
+    return file->pack_offset + (start < file->file_data_sz ? start : file->file_data_sz);
+}
+
+// true if block 'index' of 'file' needs to be downloaded.  The caller holds pack_mtx
+static bool pack_block_missing(const mutantspider::rez_file_ent* file, size_t index)
+{
+    auto it = pack_blocks.find(pack_key(file, index));
+    return it == pack_blocks.end() || it->second.failed_;
+}
+
+/*
+ mark block 'first' of 'file', and up to pack_fetch_blocks - 1 missing blocks that follow it,
+ as pending.  Returns the index of the block after the last one.  The caller holds pack_mtx
+ */
+static size_t claim_pack_blocks(const mutantspider::rez_file_ent* file, size_t first)
+{
+    size_t end = first;
+    size_t limit = first + pack_fetch_blocks < pack_num_blocks(file) ? first + pack_fetch_blocks : pack_num_blocks(file);
+    while (end < limit && (end == first || pack_block_missing(file, end)))
+        pack_blocks[pack_key(file, end++)] = pack_block{nullptr, false};
+    return end;
+}
+
+/*
+ MS_OK_COMPLETIONPENDING while any of the blocks of 'file' are pending, otherwise MS_OK
+ if they are all there or MS_ERROR_FAILED if any failed.  The caller holds pack_mtx
+ */
+static int32_t pack_file_status(const mutantspider::rez_file_ent* file)
+{
+    int32_t status = MS_OK;
+    for (size_t i = 0; i < pack_num_blocks(file); i++)
+    {
+        auto it = pack_blocks.find(pack_key(file, i));
+        if (it == pack_blocks.end() || it->second.failed_)
+            status = MS_ERROR_FAILED;
+        else if (!it->second.data_)
+            return MS_OK_COMPLETIONPENDING;
+    }
+    return status;
+}
+
+// call the fetch_resource callbacks of the files that are no longer pending
+static void complete_pack_waiters()
+{
+    std::vector<std::pair<mutantspider::CompletionCallback, int32_t>> done;
+    {
+        std::unique_lock<std::mutex> lk(pack_mtx);
+        for (auto it = pack_waiters.begin(); it != pack_waiters.end();)
+        {
+            auto status = pack_file_status(it->file_);
+            if (status != MS_OK_COMPLETIONPENDING)
+            {
+                done.push_back(std::make_pair(it->callback_, status));
+                it = pack_waiters.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+    for (auto& d : done)
+        mutantspider::CallOnMainThread(0, d.first, d.second);
+}
+
+// the download of blocks [first, end) of a file.  Deletes itself when it is done
+class rez_fetch
+{
+public:
+    rez_fetch(const mutantspider::rez_file_ent* file, size_t first, size_t end)
+        : file_(file),
+          first_(first),
+          end_(end),
+          loader_(rez_pack_inst),
+          request_(rez_pack_inst),
+          factory_(this),
+          got_(0)
+    {}
+    
+    void Start()
+    {
+        unsigned long long begin = pack_block_offset(file_, first_);
+        unsigned long long last = pack_block_offset(file_, end_) - 1;
+        data_.resize(last + 1 - begin);
+        char range[64];
+        snprintf(range, sizeof(range), "Range: bytes=%llu-%llu", begin, last);
+        request_.SetURL(mutantspider::rez_pack_url);
+        request_.SetMethod("GET");
+        request_.SetHeaders(range);
+        loader_.Open(request_, factory_.NewCallback<&rez_fetch::OnOpen>());
+    }
+    
+private:
+    void OnOpen(int32_t result)
+    {
+        if (result != MS_OK)
+            Finish(false);
+        #if defined(__native_client__)
+        else if (loader_.GetResponseInfo().GetStatusCode() != 206)
+            Finish(false);
+        #else
+        // the asm.js and host loaders go quiet, rather than report the end, once the body has been read
+        else if (!VerifySize())
+            Finish(false);
+        #endif
+        else
+            Read();
+    }
+    
+    #if !defined(__native_client__)
+    bool VerifySize()
+    {
+        int64_t received, total;
+        return loader_.GetDownloadProgress(&received, &total) && total == (int64_t)data_.size();
+    }
+    #endif
+    
+    // the asm.js and host loaders return what they have right away, and never call OnRead
+    void Read()
+    {
+        for (;;)
+        {
+            auto result = loader_.ReadResponseBody(&data_[got_], (int32_t)(data_.size() - got_), factory_.NewCallback<&rez_fetch::OnRead>());
+            if (result == MS_OK_COMPLETIONPENDING || !Received(result))
+                return;
+        }
+    }
+    
+    void OnRead(int32_t result)
+    {
+        if (Received(result))
+            Read();
+    }
+    
+    // returns true if there is more to read
+    bool Received(int32_t result)
+    {
+        if (result <= 0)
+        {
+            Finish(false);
+            return false;
+        }
+        got_ += result;
+        if (got_ < data_.size())
+            return true;
+        Finish(true);
+        return false;
+    }
+    
+    void Finish(bool ok)
+    {
+        if (!ok)
+            fprintf(stderr, "downloading bytes %llu-%llu of %s failed\n", (unsigned long long)pack_block_offset(file_, first_),
+                    (unsigned long long)pack_block_offset(file_, end_) - 1, mutantspider::rez_pack_url);
+        {
+            std::unique_lock<std::mutex> lk(pack_mtx);
+            size_t pos = 0;
+            for (size_t i = first_; i < end_; i++)
+            {
+                auto& block = pack_blocks[pack_key(file_, i)];
+                size_t sz = pack_block_offset(file_, i + 1) - pack_block_offset(file_, i);
+                if (ok)
+                    block.data_ = std::make_shared<std::vector<unsigned char>>(&data_[pos], &data_[pos] + sz);
+                else
+                    block.failed_ = true;
+                pos += sz;
+            }
+        }
+        pack_cnd.notify_all();
+        complete_pack_waiters();
+        delete this;
+    }
+    
+    const mutantspider::rez_file_ent*                   file_;
+    size_t                                              first_;
+    size_t                                              end_;
+    mutantspider::URLLoader                             loader_;
+    mutantspider::URLRequestInfo                        request_;
+    mutantspider::CompletionCallbackFactory<rez_fetch>  factory_;
+    std::vector<unsigned char>                          data_;
+    size_t                                              got_;
+};
+
+// download blocks [first, end) of 'file', which the caller has claimed
+static void start_pack_fetch(const mutantspider::rez_file_ent* file, size_t first, size_t end)
+{
+    if (on_main_thread())
+        (new rez_fetch(file, first, end))->Start();
+    else
+        mutantspider::CallOnMainThread(0, mutantspider::make_callback([file, first, end](int32_t)
+            {
+                (new rez_fetch(file, first, end))->Start();
+            }));
+}
+
+/*
+ the stored bytes of block 'index' of 'file', downloading them if they aren't here yet.
+ On the main thread that returns null with *err set to -EAGAIN, other threads wait for
+ the download.  Null with *err set to -EIO if it fails
+ */
+static std::shared_ptr<const std::vector<unsigned char>> get_pack_block(const mutantspider::rez_file_ent* file, size_t index, int* err)
+{
+    std::unique_lock<std::mutex> lk(pack_mtx);
+    if (pack_block_missing(file, index))
+    {
+        auto end = claim_pack_blocks(file, index);
+        lk.unlock();
+        start_pack_fetch(file, index, end);
+        lk.lock();
+    }
+    
+    auto& block = pack_blocks[pack_key(file, index)];
+    if (!block.data_ && !block.failed_)
+    {
+        if (on_main_thread())
+        {
+            *err = -EAGAIN;
+            return nullptr;
+        }
+        pack_cnd.wait(lk, [&block] { return block.data_ || block.failed_; });
+    }
+    if (block.failed_)
+    {
+        *err = -EIO;
+        return nullptr;
+    }
+    return block.data_;
+}
+
+/*
+ copy up to 'count' bytes of 'file', starting at 'pos', into 'buf'.  Returns the number
+ of bytes copied, or -EIO if the file has a malformed block.  For a file in the resource
+ pack it can also be -EIO if the download fails, or -EAGAIN (see get_pack_block), unless
+ some bytes were copied before that
+ */
+static int read_rez_file(const mutantspider::rez_file_ent* file, char* buf, size_t count, size_t pos)
+{
+    if (pos > file->file_data_sz)
+        pos = file->file_data_sz;
+    if (count > file->file_data_sz - pos)
+        count = file->file_data_sz - pos;
+    if (file->file_data && !file->blocks)
+    {
+        memcpy(buf, &file->file_data[pos], count);
+        return (int)count;
+    }
+
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t index = (pos + done) / file->block_size;
+        size_t start = index * file->block_size;
+        size_t offset = pos + done - start;
+        size_t raw_sz = file->file_data_sz - start < file->block_size ? file->file_data_sz - start : file->block_size;
+        size_t n = raw_sz - offset < count - done ? raw_sz - offset : count - done;
+        const unsigned char* src;
+        size_t src_sz;
+        std::shared_ptr<const std::vector<unsigned char>> packed;
+        if (file->file_data)
+        {
+            src = file->file_data + file->blocks[index];
+            src_sz = file->blocks[index + 1] - file->blocks[index];
+        }
+        else
+        {
+            int err;
+            packed = get_pack_block(file, index, &err);
+            if (!packed)
+                return done > 0 ? (int)done : err;
+            src = &(*packed)[0];
+            src_sz = packed->size();
+        }
+
+        if (src_sz == raw_sz)
+            memcpy(buf + done, src + offset, n);
+        else if (n == raw_sz)
+        {
+            // the whole block, which no one needs to decompress again soon
+            if (!lz4_decode(src, src_sz, (unsigned char*)buf + done, raw_sz))
+                return -EIO;
+        }
+        else
+        {
+            auto data = get_rez_block(file, index, src, src_sz, raw_sz);
+            if (!data)
+                return -EIO;
+            memcpy(buf + done, &(*data)[offset], n);
+        }
+        done += n;
+    }
+    return (int)count;
+}
+
+namespace mutantspider
+{
+
+void set_resource_cache_limit(size_t max_bytes)
+{
+    std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+    rez_blocks_limit = max_bytes;
+    trim_rez_blocks();
+}
+
+void fetch_resource(const std::string& path, const CompletionCallback& callback)
+{
+    auto ent = resource_ent(path);
+    if (!ent || ent->is_dir)
+    {
+        CallOnMainThread(0, callback, MS_ERROR_FILENOTFOUND);
+        return;
+    }
+    auto file = ent->ptr.file;
+    if (file->file_data)
+    {
+        CallOnMainThread(0, callback, MS_OK);
+        return;
+    }
+    
+    std::vector<std::pair<size_t, size_t>> fetches;
+    {
+        std::unique_lock<std::mutex> lk(pack_mtx);
+        for (size_t i = 0; i < pack_num_blocks(file);)
+        {
+            if (pack_block_missing(file, i))
+            {
+                auto end = claim_pack_blocks(file, i);
+                fetches.push_back(std::make_pair(i, end));
+                i = end;
+            }
+            else
+                i++;
+        }
+        pack_waiters.push_back(pack_waiter{file, callback});
+    }
+    for (auto& f : fetches)
+        start_pack_fetch(file, f.first, f.second);
+    
+    // when all of it was already here
+    complete_pack_waiters();
+}
+
+int get_resource_view(const std::string& path, resource_view& view)
+{
+    view = resource_view();
+    auto ent = resource_ent(path);
+    if (!ent)
+        return ENOENT;
+    if (ent->is_dir)
+        return EISDIR;
+    auto file = ent->ptr.file;
+    if (file->file_data && !file->blocks)
+    {
+        view.data = file->file_data;
+        view.size = file->file_data_sz;
+        return 0;
+    }
+    
+    std::shared_ptr<const std::vector<unsigned char>> storage;
+    {
+        std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+        auto it = rez_views.find(file);
+        if (it != rez_views.end())
+            storage = it->second.lock();
+    }
+    if (!storage)
+    {
+        // read_rez_file returns an int, so this goes 1GB at a time
+        std::unique_ptr<std::vector<unsigned char>> data(new std::vector<unsigned char>(file->file_data_sz));
+        size_t done = 0;
+        while (done < data->size())
+        {
+            size_t count = std::min(data->size() - done, (size_t)1 << 30);
+            int ret = read_rez_file(file, (char*)&(*data)[done], count, done);
+            if (ret <= 0)
+                return ret < 0 ? -ret : EIO;
+            done += ret;
+        }
+        
+        std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+        auto it = rez_views.find(file);
+        if (it != rez_views.end())
+            storage = it->second.lock();
+        if (!storage)
+        {
+            // when the last view goes, so does its entry -- unless another thread has already
+            // replaced it.  Nothing drops a view while holding rez_blocks_mtx
+            storage.reset(data.release(), [file](const std::vector<unsigned char>* data)
+                {
+                    {
+                        std::unique_lock<std::mutex> lk(rez_blocks_mtx);
+                        auto it = rez_views.find(file);
+                        if (it != rez_views.end() && it->second.expired())
+                            rez_views.erase(it);
+                    }
+                    delete data;
+                });
+            rez_views[file] = storage;
+        }
+    }
+    view.data = storage->empty() ? 0 : &(*storage)[0];
+    view.size = storage->size();
+    view.storage = storage;
+    return 0;
+}
+
+}
+
+#endif
+
+#if defined(__native_client__) || defined(MUTANTSPIDER_HOST)
+
+// the host build runs the same fuse file systems as nacl, using
+// the small nacl_io stand-in in mutantspider_host_io.cpp
+#if defined(__native_client__)
+#include <sys/mount.h>
+#include <nacl_io/nacl_io.h>
+#include <nacl_io/fuse.h>
+#include <ppapi/c/pp_macros.h>
+#else
+#include "mutantspider_host.h"
+#include "mutantspider_host_io.h"
+#include <ftw.h>
+#include <pthread.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+namespace {
+
+// where we mount the html5fs file system
+std::string html5_shadow_name = "/.html5fs_shadow";
+
+// the file data itself for /persistent is actually mounted here.
+// our fuse-based code supporting the /persistent directory is a
+// redirect to this location, and then a background thread mirrors
+// everything to /.html5fs_shadow
+std::string mem_shadow_name = "/.memfs_shadow";
+
+// persistent_journal: the background thread appends ops to a journal in
+// /.html5fs_shadow rather than repeating them there (see "journal" below)
+bool pbmemfs_journal = false;
+
+// "root + path [+ "/" + name]" in a buffer on the stack, so that the fuse callbacks
+// can pass a shadow path to the real file system without allocating.  A name too
+// long for the buffer (which no real one is) falls back to a std::string
+class shadow_path
+{
+public:
+    shadow_path(const std::string& root, const char* path, const char* name = 0)
+    {
+        auto root_len = root.size();
+        auto path_len = strlen(path);
+        auto name_len = name ? strlen(name) + 1 : 0;
+        if (root_len + path_len + name_len < sizeof(buf_))
+        {
+            memcpy(buf_, root.data(), root_len);
+            memcpy(&buf_[root_len], path, path_len + 1);
+            if (name)
+            {
+                buf_[root_len + path_len] = '/';
+                memcpy(&buf_[root_len + path_len + 1], name, name_len);
+            }
+            c_str_ = buf_;
+        }
+        else
+        {
+            long_ = root + path;
+            if (name)
+                long_ = long_ + "/" + name;
+            c_str_ = long_.c_str();
+        }
+    }
+    shadow_path(const std::string& root, const std::string& path)
+        : shadow_path(root, path.c_str())
+    {}
+    
+    const char* c_str() const { return c_str_; }
+    
+private:
+    shadow_path(const shadow_path&) = delete;
+    shadow_path& operator=(const shadow_path&) = delete;
+    
+    char        buf_[1024];
+    std::string long_;
+    const char* c_str_;
+};
+
+/*
+    The tasks for the background threads are kept in bounded, lock-free rings that any
+    thread can add to (bkg_call_on) and only the owning pbmemfs_worker removes from.  This
+    is Dmitry Vyukov's bounded queue: each slot's seq_ says who owns it.  seq_ == pos means
+    the slot is free for whichever producer claims position 'pos', seq_ == pos + 1 means
+    it holds a task that is ready for the worker.  Tasks are constructed directly in
+    their slot when they fit, so queuing one normally doesn't allocate.
+    
+    Mirroring is split over pbmemfs_shard_count shards, each with its own worker thread,
+    so that a big flush to one file doesn't hold up ops on unrelated files.  An op on a
+    path goes to the shard the path hashes to (shard_for), and an op on an open file goes
+    to the shard it was opened on (file_ref::shard_), so whatever is done to one file is
+    done in order.  mkdir, rmdir and rename involve more than one name, so they are
+    barriers (bkg_call_all): every shard stops at the op, and the last to get there runs it.
+    
+    Each shard has two rings.  lane_meta is for namespace and attribute ops, which are
+    quick and often have a caller waiting on them.  lane_data is for flushing, closing and
+    reading ahead, which can take a while.  The worker runs everything ready in lane_meta
+    before each lane_data task.  A lane_data task can depend on lane_meta ops queued before
+    it (a flush needs the open that set html5fs_fd_, and has to land after an earlier
+    ftruncate), but a producer may have claimed one of those slots and not filled it yet.
+    So each lane_data task records lane_meta's tail_ when it is queued (after_meta_), and
+    the worker holds it back until lane_meta's head_ has got that far.  Nothing in lane_data
+    has to happen before a later lane_meta op: flushed data is read from /.memfs_shadow when
+    it is written (and dropped if the file has been unlinked, see "op elision"), and a
+    rename doesn't affect /.html5fs_shadow files that are already open.
+    
+    persistent_journal appends every op to one file, in order, so it has a single shard and
+    everything goes in lane_meta.
+    
+    A worker drains every ready task each time it wakes up, and only sleeps (on its shard's
+    cnd_) when both rings are empty.  Producers only touch the shard's mtx_ when the worker
+    is actually asleep.
+    
+    Other threads wait for room when a ring is full, but the main thread must not block.
+    It spills the task to the shard's overflow_ list instead, and until the worker has
+    emptied that list every task for the shard (from any thread, in either lane) goes
+    there after it, so nothing overtakes what was spilled.  The worker runs the list, in
+    order, once its rings are empty.
+*/
+const size_t    pbmemfs_ring_size = 1024;   // must be a power of 2
+const size_t    pbmemfs_task_storage = 104;
+const size_t    pbmemfs_mirror_shards = 4;
+
+enum pbmemfs_lane
+{
+    lane_meta,
+    lane_data,
+    lane_count
+};
+
+struct pbmemfs_task
+{
+    std::atomic<size_t>     seq_;
+    void                    (*run_)(pbmemfs_task*);     // runs, then destroys, the callable
+    int64_t                 queued_us_;
+    size_t                  after_meta_;                // lane_data: lane_meta's tail_ when queued
+    union
+    {
+        char                storage_[pbmemfs_task_storage];
+        void*               heap_;                      // when it doesn't fit in storage_
+        long double         align_;
+    };
+};
+
+struct pbmemfs_ring
+{
+    pbmemfs_ring()
+        : tail_(0),
+          head_(0)
+    {
+        for (size_t i = 0; i < pbmemfs_ring_size; i++)
+            tasks_[i].seq_.store(i, std::memory_order_relaxed);
+    }
+    
+    pbmemfs_task            tasks_[pbmemfs_ring_size];
+    std::atomic<size_t>     tail_;
+    size_t                  head_;      // only used by the worker
+};
+
+struct pbmemfs_spilled_task
+{
+    std::function<void()>   run_;
+    int64_t                 queued_us_;
+};
+
+struct pbmemfs_shard
+{
+    pbmemfs_shard()
+        : waiting_(false),
+          overflowing_(false)
+    {}
+    
+    pbmemfs_ring            rings_[lane_count];
+    std::mutex              mtx_;
+    std::condition_variable cnd_;
+    std::atomic<bool>       waiting_;
+    
+    // see "Other threads wait" above.  overflowing_ is only set while overflow_ isn't empty
+    std::mutex                          overflow_mtx_;
+    std::deque<pbmemfs_spilled_task>    overflow_;
+    std::atomic<bool>                   overflowing_;
+};
+
+// allocated by init_fs, one shard per worker thread
+pbmemfs_shard*              pbmemfs_shards = 0;
+size_t                      pbmemfs_shard_count = 1;
+
+void make_pbmemfs_shards()
+{
+    pbmemfs_shard_count = pbmemfs_journal ? 1 : pbmemfs_mirror_shards;
+    pbmemfs_shards = new pbmemfs_shard[pbmemfs_shard_count];
+}
+
+// see mutantspider::get_persistent_stats
+struct pbmemfs_counters
+{
+    std::atomic<uint64_t>   queued_;
+    std::atomic<uint64_t>   completed_;
+    std::atomic<uint32_t>   max_depth_;
+    std::atomic<uint64_t>   last_latency_us_;
+    std::atomic<uint64_t>   max_latency_us_;
+    std::atomic<uint64_t>   total_latency_us_;
+    std::atomic<uint64_t>   batches_;
+    std::atomic<uint64_t>   elided_;
+} pbmemfs_stats;
+
+int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the shard that ops on 'path' (relative to /persistent) go to
+size_t shard_for(const std::string& path)
+{
+    return std::hash<std::string>()(path) % pbmemfs_shard_count;
+}
+
+void wake_pbmemfs_worker(pbmemfs_shard* shard)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shard->waiting_.load(std::memory_order_relaxed))
+    {
+        std::unique_lock<std::mutex> lk(shard->mtx_);
+        shard->waiting_.store(false, std::memory_order_relaxed);
+        shard->cnd_.notify_one();
+    }
+}
+
+// claim the next free slot in 'ring', waiting for the worker to make room if it is full.
+// The main thread doesn't wait, it gets 0 and spills the task instead (spill_pbmemfs_task)
+pbmemfs_task* claim_pbmemfs_task(pbmemfs_shard* shard, pbmemfs_ring* ring, size_t* pos_out)
+{
+    int full_count = 0;
+    size_t pos = ring->tail_.load(std::memory_order_relaxed);
+    while (true)
+    {
+        pbmemfs_task* task = &ring->tasks_[pos & (pbmemfs_ring_size - 1)];
+        intptr_t diff = (intptr_t)task->seq_.load(std::memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (ring->tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                *pos_out = pos;
+                return task;
+            }
+        }
+        else
+        {
+            if (diff < 0)
+            {
+                // full.  The worker may still be running populate_memfs, so this can take a while
+                wake_pbmemfs_worker(shard);
+                if (on_main_thread())
+                    return 0;
+                if (++full_count < 64)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            pos = ring->tail_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// add 'task' to shard's overflow list.  Unless 'force', only while the list is in use,
+// returning false if it isn't
+bool spill_pbmemfs_task(pbmemfs_shard* shard, std::function<void()>& task, bool force)
+{
+    std::unique_lock<std::mutex> lk(shard->overflow_mtx_);
+    if (!force && !shard->overflowing_.load(std::memory_order_relaxed))
+        return false;
+    pbmemfs_spilled_task spilled;
+    spilled.run_.swap(task);
+    spilled.queued_us_ = now_us();
+    shard->overflow_.push_back(std::move(spilled));
+    shard->overflowing_.store(true, std::memory_order_release);
+    return true;
+}
+
+// worker: take the oldest spilled task, or return false (and stop spilling) if there are none
+bool take_spilled_task(pbmemfs_shard* shard, pbmemfs_spilled_task& spilled)
+{
+    std::unique_lock<std::mutex> lk(shard->overflow_mtx_);
+    if (shard->overflow_.empty())
+    {
+        shard->overflowing_.store(false, std::memory_order_release);
+        return false;
+    }
+    spilled = std::move(shard->overflow_.front());
+    shard->overflow_.pop_front();
+    return true;
+}
+
+pbmemfs_task* ready_pbmemfs_task(pbmemfs_ring* ring)
+{
+    pbmemfs_task* task = &ring->tasks_[ring->head_ & (pbmemfs_ring_size - 1)];
+    return task->seq_.load(std::memory_order_acquire) == ring->head_ + 1 ? task : 0;
+}
+
+// the next task 'shard' should run, lane_meta first, or 0 if there isn't one.  'held' is
+// set when the next lane_data task is waiting for a lane_meta op that hasn't been filled in
+// yet, in which case nothing queued after it (in overflow_) can run either
+pbmemfs_task* next_pbmemfs_task(pbmemfs_shard* shard, pbmemfs_ring** ring_out, bool* held)
+{
+    *held = false;
+    auto meta = &shard->rings_[lane_meta];
+    pbmemfs_task* task = ready_pbmemfs_task(meta);
+    if (task)
+    {
+        *ring_out = meta;
+        return task;
+    }
+    auto data = &shard->rings_[lane_data];
+    task = ready_pbmemfs_task(data);
+    if (!task)
+        return 0;
+    if ((intptr_t)(meta->head_ - task->after_meta_) < 0)
+    {
+        // the producer of that lane_meta op wakes us once it has filled it in
+        *held = true;
+        return 0;
+    }
+    *ring_out = data;
+    return task;
+}
+
+/*
+    html5 gate.  A worker holds a share of the gate while it changes /.html5fs_shadow, and
+    shard 0 only writes the manifest while it has closed the gate (see idle_write_manifest),
+    so the manifest is never written part way through another shard's changes.  Closing
+    the gate never waits, so a worker that is holding a share while it waits on a barrier
+    can't deadlock with it.
+*/
+std::mutex                  html5_gate_mtx;
+std::condition_variable     html5_gate_cnd;
+size_t                      html5_gate_users = 0;
+bool                        html5_gate_closed = false;
+
+void enter_html5_gate()
+{
+    std::unique_lock<std::mutex> lk(html5_gate_mtx);
+    html5_gate_cnd.wait(lk, []{ return !html5_gate_closed; });
+    ++html5_gate_users;
+}
+
+void leave_html5_gate()
+{
+    std::unique_lock<std::mutex> lk(html5_gate_mtx);
+    --html5_gate_users;
+}
+
+// returns false, leaving the gate open, if any worker is in it
+bool close_html5_gate()
+{
+    std::unique_lock<std::mutex> lk(html5_gate_mtx);
+    if (html5_gate_users != 0)
+        return false;
+    html5_gate_closed = true;
+    return true;
+}
+
+void open_html5_gate()
+{
+    std::unique_lock<std::mutex> lk(html5_gate_mtx);
+    html5_gate_closed = false;
+    html5_gate_cnd.notify_all();
+}
+
+// see "dirty extents" below
+void flush_aged_files(size_t shard, bool all);
+int64_t next_flush_in_us(size_t shard);
+bool prefetch_lazy_file();
+
+// see "journal" below
+struct file_ref;
+void journal_write_extent(file_ref* fr, off_t start, off_t end);
+void journal_commit();
+
+// see "block cache" below
+void close_deferred_fds();
+
+// see "backpressure" below
+bool over_backlog_bytes();
+void backlog_shrunk();
+
+// see "manifest" below
+void manifest_changing();
+int64_t next_manifest_in_us();
+void write_manifest(bool force);
+void idle_write_manifest();
+
+// how long until shard's worker has idle-time work to do, or -1 if it has none
+int64_t next_idle_work_in_us(size_t shard)
+{
+    auto flush_in_us = next_flush_in_us(shard);
+    auto manifest_in_us = shard == 0 ? next_manifest_in_us() : -1;
+    if (flush_in_us < 0)
+        return manifest_in_us;
+    if (manifest_in_us < 0)
+        return flush_in_us;
+    return std::min(flush_in_us, manifest_in_us);
+}
+
+// thread proc that runs forever, executing the tasks that bkg_call_on queues to
+// shard 'shard_index', and flushing written data once it has been dirty long enough.
+// Shard 0 also keeps the manifest up to date
+void pbmemfs_worker(size_t shard_index)
+{
+    pbmemfs_shard* shard = &pbmemfs_shards[shard_index];
+    while (true)
+    {
+        size_t ran = 0;
+        pbmemfs_ring* ring;
+        bool held;
+        pbmemfs_spilled_task spilled;
+        while (true)
+        {
+            // what is in the rings was queued before anything still in overflow_
+            pbmemfs_task* task = next_pbmemfs_task(shard, &ring, &held);
+            if (!task && (held || !shard->overflowing_.load(std::memory_order_acquire) || !take_spilled_task(shard, spilled)))
+                break;
+            auto queued_us = task ? task->queued_us_ : spilled.queued_us_;
+            if (ran == 0)
+            {
+                enter_html5_gate();
+                manifest_changing();
+            }
+            if (task)
+            {
+                task->run_(task);
+                task->seq_.store(ring->head_ + pbmemfs_ring_size, std::memory_order_release);
+                ++ring->head_;
+            }
+            else
+            {
+                spilled.run_();
+                spilled.run_ = nullptr;
+            }
+            ++ran;
+            
+            uint64_t latency = now_us() - queued_us;
+            pbmemfs_stats.last_latency_us_.store(latency, std::memory_order_relaxed);
+            auto max_latency = pbmemfs_stats.max_latency_us_.load(std::memory_order_relaxed);
+            while (latency > max_latency && !pbmemfs_stats.max_latency_us_.compare_exchange_weak(max_latency, latency, std::memory_order_relaxed))
+                ;
+            pbmemfs_stats.total_latency_us_.fetch_add(latency, std::memory_order_relaxed);
+            pbmemfs_stats.completed_.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        if (ran)
+        {
+            pbmemfs_stats.batches_.fetch_add(1, std::memory_order_relaxed);
+            flush_aged_files(shard_index, false);
+            journal_commit();
+            close_deferred_fds();
+            leave_html5_gate();
+            backlog_shrunk();
+            continue;
+        }
+        
+        // nothing ready.  Use the time to load a file that hasn't been opened yet
+        if (shard_index == 0 && prefetch_lazy_file())
+            continue;
+        
+        // Say that we are about to sleep, then check once more in case
+        // a producer added a task without seeing that
+        auto idle_in_us = next_idle_work_in_us(shard_index);
+        std::unique_lock<std::mutex> lk(shard->mtx_);
+        shard->waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (next_pbmemfs_task(shard, &ring, &held) || (!held && shard->overflowing_.load(std::memory_order_relaxed)))
+        {
+            shard->waiting_.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        auto woken = [shard]{ return !shard->waiting_.load(std::memory_order_relaxed); };
+        if (idle_in_us < 0)
+            shard->cnd_.wait(lk, woken);
+        else if (!shard->cnd_.wait_for(lk, std::chrono::microseconds(idle_in_us), woken))
+        {
+            shard->waiting_.store(false, std::memory_order_relaxed);
+            lk.unlock();
+            enter_html5_gate();
+            flush_aged_files(shard_index, false);
+            journal_commit();
+            leave_html5_gate();
+            backlog_shrunk();
+            if (shard_index == 0)
+                idle_write_manifest();
+        }
+    }
+}
+
+template<typename C, bool fits = (sizeof(C) <= pbmemfs_task_storage)>
+struct pbmemfs_task_ops
+{
+    static void put(pbmemfs_task* task, C&& c)
+    {
+        new (task->storage_) C(std::move(c));
+        task->run_ = &run;
+    }
+    
+    static void run(pbmemfs_task* task)
+    {
+        C* c = (C*)task->storage_;
+        (*c)();
+        c->~C();
+    }
+};
+
+template<typename C>
+struct pbmemfs_task_ops<C, false>
+{
+    static void put(pbmemfs_task* task, C&& c)
+    {
+        task->heap_ = new C(std::move(c));
+        task->run_ = &run;
+    }
+    
+    static void run(pbmemfs_task* task)
+    {
+        C* c = (C*)task->heap_;
+        (*c)();
+        delete c;
+    }
+};
+
+// given an arbitrary callable function 'f', along with an arbitrary
+// list of (copyable) arguments, add a task that will execute
+// "f(args...)" to the 'lane' ring of shard 'shard_index' and, if it
+// is waiting, wake that shard's pbmemfs_worker to pick up and execute
+// that task.
+//
+// for example:
+//
+//    bkg_call_on(shard_for(path),lane_meta,foo,100,j);
+//
+// causes "foo(100,j)" to execute in the background, in order with
+// the other ops on 'path'
+//
+template<typename F, typename ...Args>
+void bkg_call_on(size_t shard_index, pbmemfs_lane lane, F&& f, Args&&... args)
+{
+    auto b = std::bind(f, std::forward<Args>(args)...);
+    
+    pbmemfs_shard* shard = &pbmemfs_shards[shard_index];
+    if (pbmemfs_journal)
+        lane = lane_meta;
+    pbmemfs_ring* ring = &shard->rings_[lane];
+    
+    // a lane_data task waits for every lane_meta op claimed before it (see "Each shard has two rings")
+    size_t after_meta = lane == lane_data ? shard->rings_[lane_meta].tail_.load(std::memory_order_acquire) : 0;
+    
+    // counted before it is visible to the worker, so completed_ never passes queued_
+    auto depth = (uint32_t)(pbmemfs_stats.queued_.fetch_add(1, std::memory_order_relaxed) + 1 - pbmemfs_stats.completed_.load(std::memory_order_relaxed));
+    auto max_depth = pbmemfs_stats.max_depth_.load(std::memory_order_relaxed);
+    while (depth > max_depth && !pbmemfs_stats.max_depth_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed))
+        ;
+    
+    // once anything has spilled, everything after it does too (see "Other threads wait")
+    if (shard->overflowing_.load(std::memory_order_acquire))
+    {
+        std::function<void()> spilled(b);
+        if (spill_pbmemfs_task(shard, spilled, false))
+        {
+            wake_pbmemfs_worker(shard);
+            return;
+        }
+    }
+    
+    size_t pos;
+    pbmemfs_task* task = claim_pbmemfs_task(shard, ring, &pos);
+    if (!task)
+    {
+        std::function<void()> spilled(std::move(b));
+        spill_pbmemfs_task(shard, spilled, true);
+        wake_pbmemfs_worker(shard);
+        return;
+    }
+    pbmemfs_task_ops<decltype(b)>::put(task, std::move(b));
+    task->queued_us_ = now_us();
+    task->after_meta_ = after_meta;
+    task->seq_.store(pos + 1, std::memory_order_release);
+    wake_pbmemfs_worker(shard);
+}
+
+// a task queued to every shard.  Each shard's worker calls arrive when it gets to it,
+// and the last one to get there runs f_ while the others wait for it to finish
+struct pbmemfs_barrier
+{
+    pbmemfs_barrier(std::function<void()> f)
+        : waiting_(pbmemfs_shard_count),
+          done_(false),
+          f_(std::move(f))
+    {}
+    
+    void arrive()
+    {
+        std::unique_lock<std::mutex> lk(mtx_);
+        if (--waiting_ == 0)
+        {
+            lk.unlock();
+            f_();
+            lk.lock();
+            done_ = true;
+            cnd_.notify_all();
+        }
+        else
+            cnd_.wait(lk, [this]{ return done_; });
+    }
+    
+    std::mutex                  mtx_;
+    std::condition_variable     cnd_;
+    size_t                      waiting_;
+    bool                        done_;
+    std::function<void()>       f_;
+};
+
+// held while a barrier is queued, so every shard sees the barriers in the same order
+std::mutex  pbmemfs_barrier_mtx;
+
+// like bkg_call_on, but "f(args...)" executes after everything queued to any shard
+// before it, and before anything queued after it
+template<typename F, typename ...Args>
+void bkg_call_all(F&& f, Args&&... args)
+{
+    auto barrier = std::make_shared<pbmemfs_barrier>(std::bind(f, std::forward<Args>(args)...));
+    std::unique_lock<std::mutex> lk(pbmemfs_barrier_mtx);
+    for (size_t i = 0; i < pbmemfs_shard_count; i++)
+        bkg_call_on(i, lane_meta, [](const std::shared_ptr<pbmemfs_barrier>& barrier)
+            {
+                barrier->arrive();
+            },
+            barrier);
+}
+
+/*
+    backpressure (set_persistent_backlog_limit).  The backlog is the written data that
+    hasn't reached /.html5fs_shadow yet -- dirty extents, and the data carried by queued
+    write ops -- and the number of queued ops.  Once it is over a limit, ops that would
+    add to it wait for the workers to catch up.  nacl's main thread can't wait (the
+    workers reach html5fs through it), so there they fail with EAGAIN instead, and the
+    host build does the same so that it behaves like nacl.  While the backlog is over
+    its byte limit the workers flush dirty data right away rather than after
+    flush_delay_us.
+*/
+std::atomic<uint64_t>       backlog_limit_bytes(0);     // 0 means no limit
+std::atomic<uint64_t>       backlog_limit_ops(0);
+std::atomic<uint64_t>       backlog_bytes(0);
+std::atomic<uint64_t>       backlog_waits(0);
+std::atomic<uint64_t>       backlog_rejects(0);
+std::atomic<uint32_t>       backlog_waiters(0);
+std::mutex                  backlog_mtx;
+std::condition_variable     backlog_cnd;
+
+bool over_backlog_bytes()
+{
+    auto limit = backlog_limit_bytes.load();
+    return limit != 0 && backlog_bytes.load() >= limit;
+}
+
+bool over_backlog_ops()
+{
+    auto limit = backlog_limit_ops.load();
+    return limit != 0 && pbmemfs_stats.queued_.load() - pbmemfs_stats.completed_.load() >= limit;
+}
+
+// 'writing': the op adds written data, not just an op
+bool over_backlog_limit(bool writing)
+{
+    return over_backlog_ops() || (writing && over_backlog_bytes());
+}
+
+// called by the pbmemfs_ ops that add to the backlog, before they do anything.
+// Returns 0, or -EAGAIN on the main thread when the backlog is over its limit
+int wait_for_backlog(bool writing)
+{
+    if (!over_backlog_limit(writing))
+        return 0;
+    if (on_main_thread())
+    {
+        backlog_rejects.fetch_add(1, std::memory_order_relaxed);
+        return -EAGAIN;
+    }
+    
+    backlog_waits.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lk(backlog_mtx);
+    backlog_waiters++;
+    
+    // sleeping workers don't know the backlog is over the limit yet
+    for (size_t i = 0; i < pbmemfs_shard_count; i++)
+        wake_pbmemfs_worker(&pbmemfs_shards[i]);
+    backlog_cnd.wait(lk, [writing]{ return !over_backlog_limit(writing); });
+    backlog_waiters--;
+    return 0;
+}
+
+// workers: the backlog may have shrunk
+void backlog_shrunk()
+{
+    if (backlog_waiters.load() != 0)
+    {
+        std::unique_lock<std::mutex> lk(backlog_mtx);
+        backlog_cnd.notify_all();
+    }
+}
+
+// simple data structure for when we need to keep track
+// of both the file descriptor in /.memfs_shadow as well
+// as the one in /.html5fs_shadow
+//
+// Written data is not queued for the background threads write by write.
+// Instead, the range each write covers is recorded in the file_ref's
+// dirty_ extents, and the file's shard's worker later copies those ranges
+// from /.memfs_shadow to /.html5fs_shadow in a few large writes (see
+// flush_dirty).  memfs_rd_fd_ is the background threads' own read-only
+// descriptor for the /.memfs_shadow file.  If it can't be opened (the
+// file isn't readable), writes to that file are mirrored one by one.
+struct file_ref
+{
+    int	memfs_fd_;
+    int html5fs_fd_;
+    int html5fs_flags_; // what html5fs_fd_ was opened with
+    int memfs_rd_fd_;
+    bool append_;
+    size_t shard_;      // the shard that every task for this file is queued to
+    
+    // the file's current path under /persistent, or empty once it has been unlinked (or
+    // renamed over).  Protected by open_files_mtx
+    std::string             path_;
+    
+    // set when the file has been closed but still has dirty extents, which flush_aged_files
+    // then writes before deleting the file_ref (see "op elision").  Protected by dirty_mtx
+    bool                    released_;
+    
+    // start -> end, sorted, and neither overlapping nor touching.  Protected by dirty_mtx
+    std::map<off_t, off_t>  dirty_;
+    size_t                  dirty_bytes_;
+    int64_t                 dirty_since_us_;
+    
+    // the size an ftruncate that is still queued will truncate to, or -1.  Protected by dirty_mtx
+    off_t                   trunc_to_;
+    
+    // see pbmemfs_fsync.  changes_ counts the writes and ftruncates made through this file_ref,
+    // synced_ is the most changes_ a completed sync has covered, and sync_queued_ the most a
+    // sync queued by the main thread will cover
+    std::atomic<uint64_t>   changes_;
+    std::atomic<uint64_t>   synced_;
+    std::atomic<uint64_t>   sync_queued_;
+    
+    file_ref(int memfs_fd)
+        : memfs_fd_(memfs_fd),
+          html5fs_fd_(-1),
+          html5fs_flags_(0),
+          memfs_rd_fd_(-1),
+          append_(false),
+          shard_(0),
+          released_(false),
+          dirty_bytes_(0),
+          dirty_since_us_(0),
+          trunc_to_(-1),
+          changes_(0),
+          synced_(0),
+          sync_queued_(0)
+    {}
+};
+
+/*
+    dirty extents.  Data is flushed to /.html5fs_shadow when the file is closed or
+    fsync'd, when a file has flush_threshold_bytes dirty, and by the file's shard's
+    worker once data has been dirty for flush_delay_us.  A flush takes the extents it
+    is going to write under dirty_mtx, and a file that has been released is deleted by
+    whichever thread takes its last dirty extents (see take_dirty).
+*/
+const size_t    flush_threshold_bytes = 1024 * 1024;
+const int64_t   flush_delay_us = 100 * 1000;
+const size_t    flush_chunk_bytes = 256 * 1024;
+
+std::mutex          dirty_mtx;
+std::set<file_ref*> dirty_files;
+uint64_t            dirty_writes = 0;   // count of add_dirty calls
+
+// add [start, end) to fr's dirty extents.  Streaming writes extend the same extent,
+// so this normally doesn't allocate.  Returns the file's total dirty bytes.
+size_t add_dirty(file_ref* fr, off_t start, off_t end)
+{
+    std::unique_lock<std::mutex> lk(dirty_mtx);
+    dirty_writes++;
+    auto& extents = fr->dirty_;
+    if (extents.empty())
+    {
+        fr->dirty_since_us_ = now_us();
+        dirty_files.insert(fr);
+    }
+    
+    // find (or make) the extent that starts at or before 'start' and reaches it
+    auto it = extents.upper_bound(start);
+    if (it != extents.begin() && std::prev(it)->second >= start)
+        --it;
+    else
+        it = extents.insert(it, std::make_pair(start, start));
+    
+    // grow it to cover 'end', and absorb any extents that now touch it
+    auto before = fr->dirty_bytes_;
+    fr->dirty_bytes_ -= it->second - it->first;
+    off_t new_end = std::max(it->second, end);
+    auto next = std::next(it);
+    while (next != extents.end() && next->first <= new_end)
+    {
+        new_end = std::max(new_end, next->second);
+        fr->dirty_bytes_ -= next->second - next->first;
+        next = extents.erase(next);
+    }
+    it->second = new_end;
+    fr->dirty_bytes_ += it->second - it->first;
+    backlog_bytes.fetch_add(fr->dirty_bytes_ - before);
+    return fr->dirty_bytes_;
+}
+
+// drop whatever part of fr's dirty extents lies past 'pos', the file doesn't have that data
+// any more.  The caller holds dirty_mtx
+void truncate_dirty(file_ref* fr, off_t pos)
+{
+    auto& extents = fr->dirty_;
+    auto before = fr->dirty_bytes_;
+    auto it = extents.lower_bound(pos);
+    if (it != extents.begin() && std::prev(it)->second > pos)
+    {
+        fr->dirty_bytes_ -= std::prev(it)->second - pos;
+        std::prev(it)->second = pos;
+    }
+    while (it != extents.end())
+    {
+        fr->dirty_bytes_ -= it->second - it->first;
+        it = extents.erase(it);
+    }
+    backlog_bytes.fetch_sub(before - fr->dirty_bytes_);
+    if (extents.empty())
+        dirty_files.erase(fr);
+}
+
+// copy [start, end) of from_fd to the same offsets in to_fd, stopping early at from_fd's eof.
+// Only called on the background threads
+void copy_range(int from_fd, int to_fd, off_t start, off_t end)
+{
+    static thread_local std::vector<char> buf(flush_chunk_bytes);
+    off_t pos = start;
+    while (pos < end)
+    {
+        auto want = (size_t)std::min<off_t>(end - pos, buf.size());
+        auto got = pread(from_fd, &buf[0], want, pos);
+        if (got <= 0)
+        {
+            if (got < 0)
+                fprintf(stderr, "pread(%d, %p, %d, %d) failed with errno: %d\n", from_fd, &buf[0], (int)want, (int)pos, errno);
+            return;
+        }
+        auto put = pwrite(to_fd, &buf[0], got, pos);
+        if (put != got)
+        {
+            fprintf(stderr, "pwrite(%d, %p, %d, %d) returned unexpected value (%d instead of %d), errno: %d\n",
+                    to_fd, &buf[0], (int)got, (int)pos, (int)put, (int)got, errno);
+            return;
+        }
+        pos += got;
+    }
+}
+
+// after a truncate reaches /.html5fs_shadow, data written past 'pos' since the truncate
+// call may already have been flushed and then cut off again.  The /.memfs_shadow file has
+// the right contents, so copy anything it has past 'pos' back over
+void recopy_after_truncate(int memfs_fd, int html5fs_fd, off_t pos)
+{
+    struct stat st;
+    if (fstat(memfs_fd, &st) == 0 && st.st_size > pos)
+        copy_range(memfs_fd, html5fs_fd, pos, st.st_size);
+}
+
+// take fr's dirty extents, to be written by write_dirty (they stay in backlog_bytes until
+// they have been).  The caller holds dirty_mtx.
+// Returns true if the caller has taken the last of a released file's extents, and so
+// must close it once they are written
+bool take_dirty(file_ref* fr, std::map<off_t, off_t>& extents)
+{
+    if (fr->dirty_.empty())
+        return false;
+    extents.swap(fr->dirty_);
+    fr->dirty_bytes_ = 0;
+    dirty_files.erase(fr);
+    return fr->released_;
+}
+
+// copy the extents take_dirty took from /.memfs_shadow to /.html5fs_shadow.  It reads the
+// current contents of the memfs file, so ranges that have since been truncated away are
+// simply skipped.
+void write_dirty(file_ref* fr, const std::map<off_t, off_t>& extents)
+{
+    if (extents.empty())
+        return;
+    manifest_changing();
+    uint64_t bytes = 0;
+    for (auto& e : extents)
+    {
+        if (pbmemfs_journal)
+            journal_write_extent(fr, e.first, e.second);
+        else
+            copy_range(fr->memfs_rd_fd_, fr->html5fs_fd_, e.first, e.second);
+        bytes += e.second - e.first;
+    }
+    backlog_bytes.fetch_sub(bytes);
+}
+
+void close_file_ref(file_ref* fr);
+
+// copy fr's dirty ranges from /.memfs_shadow to /.html5fs_shadow.  Only called on fr's
+// shard's worker
+void flush_dirty(file_ref* fr)
+{
+    std::map<off_t, off_t> extents;
+    bool close_it;
+    {
+        std::unique_lock<std::mutex> lk(dirty_mtx);
+        close_it = take_dirty(fr, extents);
+    }
+    write_dirty(fr, extents);
+    if (close_it)
+        close_file_ref(fr);
+}
+
+// flush every one of shard's files whose data has been dirty for flush_delay_us (or every
+// dirty file if 'all', or the backlog is over its limit).  Files that have been closed are
+// then finished off
+void flush_aged_files(size_t shard, bool all)
+{
+    all = all || over_backlog_bytes();
+    struct due_file
+    {
+        file_ref*               fr_;
+        std::map<off_t, off_t>  extents_;
+        bool                    close_;
+    };
+    std::vector<due_file> due;
+    {
+        std::unique_lock<std::mutex> lk(dirty_mtx);
+        if (dirty_files.empty())
+            return;
+        auto now = now_us();
+        for (auto it = dirty_files.begin(); it != dirty_files.end(); )
+        {
+            // take_dirty erases fr from dirty_files
+            auto fr = *it++;
+            if (fr->shard_ == shard && (all || now - fr->dirty_since_us_ >= flush_delay_us))
+            {
+                due.push_back(due_file());
+                due.back().fr_ = fr;
+                due.back().close_ = take_dirty(fr, due.back().extents_);
+            }
+        }
+    }
+    for (auto& d : due)
+    {
+        write_dirty(d.fr_, d.extents_);
+        if (d.close_)
+            close_file_ref(d.fr_);
+    }
+}
+
+// how long until shard's oldest dirty data is due to be flushed, or -1 if it has nothing dirty
+int64_t next_flush_in_us(size_t shard)
+{
+    std::unique_lock<std::mutex> lk(dirty_mtx);
+    int64_t oldest = INT64_MAX;
+    for (auto fr : dirty_files)
+    {
+        if (fr->shard_ == shard)
+            oldest = std::min(oldest, fr->dirty_since_us_);
+    }
+    if (oldest == INT64_MAX)
+        return -1;
+    if (over_backlog_bytes())
+        return 0;
+    return std::max<int64_t>(0, oldest + flush_delay_us - now_us());
+}
+
+/*
+    journal (persistent_journal).  Instead of repeating each op against /.html5fs_shadow,
+    the background thread appends a record describing it to a single journal file, with
+    one sequential write per batch of ops.  Every so often, when the background thread is
+    idle, the whole of /.memfs_shadow is written to a checkpoint file (a manifest with the
+    contents of every file packed into it, see "manifest" below) and the journal starts
+    over.  Start up loads the checkpoint, reads whatever dirs it doesn't cover from
+    /.html5fs_shadow, and then replays the journal on top of it all.
+    
+    The checkpoint and the journal both carry a generation number, and the journal is only
+    replayed if its generation matches the checkpoint's, so crashing between writing a new
+    checkpoint and resetting the journal can't replay ops twice.  Each record has its own
+    length and checksum, and replay stops at the first one that is incomplete or damaged.
+    
+        journal:    "MSPJ" u32 version, u64 generation, records
+        record:     u32 body length, u32 checksum (FNV-1a of the body), body
+        body:       u8 op, then the op's fields (see journal_ops) with paths as u32 length + bytes
+        checkpoint: u64 generation, then a manifest
+*/
+enum journal_ops
+{
+    journal_create = 1,     // path, u32 mode, u8 truncate
+    journal_mkdir,          // path, u32 mode
+    journal_rename,         // path, new path
+    journal_truncate,       // path, i64 size
+    journal_write,          // path, i64 position, data (the rest of the body)
+    journal_unlink,         // path
+    journal_rmdir,          // path
+    journal_chmod,          // path, u32 mode
+    journal_utimes          // path, u8 has times, i64 atime sec, i64 atime usec, i64 mtime sec, i64 mtime usec
+};
+
+const char      journal_magic[4] = { 'M', 'S', 'P', 'J' };
+const uint32_t  journal_version = 1;
+const size_t    journal_header_bytes = 16;
+const size_t    journal_record_data_bytes = 1024 * 1024;    // largest write record
+const size_t    journal_buffer_bytes = 4 * 1024 * 1024;     // commit early once this much is buffered
+const uint64_t  journal_checkpoint_bytes = 4 * 1024 * 1024; // checkpoint once the journal is this big (and bigger than the last checkpoint)
+
+// only used by the background thread (and populate_memfs before it becomes the background thread)
+int                     journal_fd = -1;
+uint64_t                journal_generation = 0;
+uint64_t                journal_size = 0;           // bytes committed to the journal file
+uint64_t                checkpoint_size = 0;
+bool                    checkpoint_wanted = false;  // the journal's base isn't in a checkpoint yet
+std::vector<char>       journal_buf;                // records not yet committed
+
+template<typename T>
+void put(std::vector<char>& out, T v)
+{
+    out.insert(out.end(), reinterpret_cast<const char*>(&v), reinterpret_cast<const char*>(&v) + sizeof(v));
+}
+
+void put_string(std::vector<char>& out, const std::string& str)
+{
+    put(out, (uint32_t)str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+void put_field(std::vector<char>& out, const std::string& str) { put_string(out, str); }
+void put_field(std::vector<char>& out, uint8_t v) { put(out, v); }
+void put_field(std::vector<char>& out, uint32_t v) { put(out, v); }
+void put_field(std::vector<char>& out, int64_t v) { put(out, v); }
+
+uint32_t fnv1a(const char* p, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)p[i]) * 16777619u;
+    return h;
+}
+
+// start a record at the end of 'out'.  Returns where it starts, for end_record
+size_t begin_record(std::vector<char>& out, uint8_t op)
+{
+    auto start = out.size();
+    out.resize(start + 2 * sizeof(uint32_t));
+    put(out, op);
+    return start;
+}
+
+void end_record(std::vector<char>& out, size_t start)
+{
+    auto body = start + 2 * sizeof(uint32_t);
+    uint32_t len = (uint32_t)(out.size() - body);
+    uint32_t sum = fnv1a(&out[body], len);
+    memcpy(&out[start], &len, sizeof(len));
+    memcpy(&out[start + sizeof(len)], &sum, sizeof(sum));
+}
+
+// background thread: add a finished record to the journal
+void journal_append(const std::vector<char>& rec)
+{
+    manifest_changing();
+    journal_buf.insert(journal_buf.end(), rec.begin(), rec.end());
+    if (journal_buf.size() >= journal_buffer_bytes)
+        journal_commit();
+}
+
+// background thread: write the buffered records to the journal file
+void journal_commit()
+{
+    if (journal_buf.empty())
+        return;
+    auto bytes = pwrite(journal_fd, journal_buf.data(), journal_buf.size(), journal_size);
+    if (bytes != (ssize_t)journal_buf.size())
+        fprintf(stderr, "pwrite(%d, %p, %d, %d) returned unexpected value (%d instead of %d), errno: %d\n",
+                journal_fd, journal_buf.data(), (int)journal_buf.size(), (int)journal_size, (int)bytes, (int)journal_buf.size(), errno);
+    if (bytes > 0)
+        journal_size += bytes;
+    journal_buf.clear();
+}
+
+// background thread: commit the journal and make sure it has reached storage
+void journal_sync()
+{
+    journal_commit();
+    if (fsync(journal_fd) != 0)
+        fprintf(stderr, "fsync(%d) failed, errno: %d\n", journal_fd, errno);
+}
+
+// background thread: journal [start, end) of fr, read from /.memfs_shadow
+void journal_write_extent(file_ref* fr, off_t start, off_t end)
+{
+    if (fr->path_.empty())
+        return;
+    off_t pos = start;
+    while (pos < end)
+    {
+        auto want = (size_t)std::min<off_t>(end - pos, journal_record_data_bytes);
+        auto rec = begin_record(journal_buf, journal_write);
+        put_field(journal_buf, fr->path_);
+        put_field(journal_buf, (int64_t)pos);
+        auto data = journal_buf.size();
+        journal_buf.resize(data + want);
+        auto got = pread(fr->memfs_rd_fd_, &journal_buf[data], want, pos);
+        if (got <= 0)
+        {
+            if (got < 0)
+                fprintf(stderr, "pread(%d, %p, %d, %d) failed with errno: %d\n", fr->memfs_rd_fd_, &journal_buf[data], (int)want, (int)pos, errno);
+            journal_buf.resize(rec);
+            return;
+        }
+        journal_buf.resize(data + got);
+        end_record(journal_buf, rec);
+        pos += got;
+        if (journal_buf.size() >= journal_buffer_bytes)
+            journal_commit();
+    }
+}
+
+// background thread: journal whatever /.memfs_shadow/'path' has past 'pos' (see recopy_after_truncate)
+void journal_after_truncate(const std::string& path, off_t pos)
+{
+    file_ref fr(-1);
+    fr.path_ = path;
+    fr.memfs_rd_fd_ = open((mem_shadow_name + path).c_str(), O_RDONLY);
+    struct stat st;
+    if (fr.memfs_rd_fd_ != -1 && fstat(fr.memfs_rd_fd_, &st) == 0 && st.st_size > pos)
+        journal_write_extent(&fr, pos, st.st_size);
+    if (fr.memfs_rd_fd_ != -1)
+        close(fr.memfs_rd_fd_);
+}
+
+// called by the pbmemfs_ ops: queue a record for 'op' with the given fields, and then
+// (on the background thread) call 'after' with 'args'.  The journal only has the one
+// shard
+template<typename F, typename... Args>
+void journal_op_then(std::vector<char>&& rec, F&& after, Args&&... args)
+{
+    bkg_call_on(0, lane_meta, [](std::vector<char> rec, typename std::decay<F>::type after, typename std::decay<Args>::type... args)
+        {
+            journal_append(rec);
+            after(args...);
+        },
+        std::move(rec), std::forward<F>(after), std::forward<Args>(args)...);
+}
+
+template<typename... Fields>
+std::vector<char> journal_record(uint8_t op, const Fields&... fields)
+{
+    std::vector<char> rec;
+    auto start = begin_record(rec, op);
+    int expand[] = { 0, (put_field(rec, fields), 0)... };
+    (void)expand;
+    end_record(rec, start);
+    return rec;
+}
+
+template<typename... Fields>
+void journal_op(uint8_t op, const Fields&... fields)
+{
+    journal_op_then(journal_record(op, fields...), []{});
+}
+
+/*
+    op elision.  A queued op can be made pointless by a later one, so rather than repeat
+    every op against /.html5fs_shadow (persistent_mirror):
+    
+      - chmod, utimes and truncate calls on a path are merged into one path_update while
+        its task is still queued.  The last mode and times win, and the truncate is to the
+        smallest size asked for, after which anything /.memfs_shadow has past that size is
+        copied back (see recopy_after_truncate).  Anything that changes which file a path
+        names -- create, open for writing, rename, unlink, rmdir -- closes the path (and
+        everything under it) to merging, so no merged op moves ahead of one of those.
+      - repeated ftruncates of an open file are merged the same way (file_ref::trunc_to_),
+        and each one drops the file's dirty extents past the new size.
+      - closing a file doesn't flush it straight away.  Its dirty extents are left for
+        flush_aged_files, and if the file is unlinked, or renamed over, before then (the
+        usual fate of a temp file) they are dropped instead of being written.
+    
+    The last two also apply to persistent_journal.
+*/
+struct path_update
+{
+    path_update()
+        : started_(false),
+          trunc_to_(-1),
+          has_mode_(false),
+          mode_(0),
+          has_times_(false),
+          now_(false)
+    {}
+    
+    bool            started_;       // apply_path_update has taken the values
+    off_t           trunc_to_;      // -1 if there is no truncate
+    bool            has_mode_;
+    mode_t          mode_;
+    bool            has_times_;
+    bool            now_;           // utimes(path, 0)
+    struct timeval  tv_[2];
+};
+
+std::mutex                                              path_updates_mtx;
+std::map<std::string, std::shared_ptr<path_update>>     path_updates;           // the ones still open to merging
+uint64_t                                                path_updates_closed = 0;    // count of close_path_updates calls
+
+std::mutex              open_files_mtx;
+std::set<file_ref*>     open_files;     // to keep their path_ up to date.  Protected by open_files_mtx
+
+// flush shard's files open on 'path' now.  A utimes is applied after this, so that the
+// writes made before it don't reach storage later and change the file's time again
+void flush_path_files(size_t shard, const std::string& path)
+{
+    std::vector<std::pair<file_ref*, bool>> due;
+    std::vector<std::map<off_t, off_t>> extents;
+    {
+        // path_ is protected by open_files_mtx, which is taken before dirty_mtx
+        std::unique_lock<std::mutex> lk(open_files_mtx);
+        std::unique_lock<std::mutex> lk2(dirty_mtx);
+        for (auto it = dirty_files.begin(); it != dirty_files.end(); )
+        {
+            // take_dirty erases fr from dirty_files
+            auto fr = *it++;
+            if (fr->shard_ == shard && fr->path_ == path)
+            {
+                extents.push_back(std::map<off_t, off_t>());
+                due.push_back(std::make_pair(fr, take_dirty(fr, extents.back())));
+            }
+        }
+    }
+    for (size_t i = 0; i < due.size(); i++)
+    {
+        write_dirty(due[i].first, extents[i]);
+        if (due[i].second)
+            close_file_ref(due[i].first);
+    }
+}
+
+// background thread
+void apply_path_update(const std::string& path, const std::shared_ptr<path_update>& pu)
+{
+    path_update u;
+    {
+        std::unique_lock<std::mutex> lk(path_updates_mtx);
+        pu->started_ = true;
+        auto it = path_updates.find(path);
+        if (it != path_updates.end() && it->second == pu)
+            path_updates.erase(it);
+        u = *pu;
+    }
+    
+    auto html5_path = html5_shadow_name + path;
+    if (u.trunc_to_ != -1)
+    {
+        int fd = open(html5_path.c_str(), O_WRONLY);
+        if (fd == -1 || ftruncate(fd, u.trunc_to_) != 0)
+            fprintf(stderr, "truncate(%s, %d) failed with errno: %d\n", html5_path.c_str(), (int)u.trunc_to_, errno);
+        else
+        {
+            int mem_fd = open((mem_shadow_name + path).c_str(), O_RDONLY);
+            if (mem_fd != -1)
+            {
+                recopy_after_truncate(mem_fd, fd, u.trunc_to_);
+                close(mem_fd);
+            }
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    if (u.has_mode_ && chmod(html5_path.c_str(), u.mode_) != 0)
+        fprintf(stderr, "chmod(%s, 0%o) failed with errno: %d\n", html5_path.c_str(), u.mode_, errno);
+    if (u.has_times_)
+        flush_path_files(shard_for(path), path);
+    if (u.has_times_ && utimes(html5_path.c_str(), u.now_ ? 0 : u.tv_) != 0)
+        fprintf(stderr, "utimes(%s, (timespec)) failed with errno: %d\n", html5_path.c_str(), errno);
+}
+
+// apply 'change' to the path_update queued for 'path', or queue a new one if there isn't one
+// open to merging
+template<typename F>
+void update_path(const std::string& path, F change)
+{
+    uint64_t closed;
+    {
+        std::unique_lock<std::mutex> lk(path_updates_mtx);
+        auto it = path_updates.find(path);
+        if (it != path_updates.end())
+        {
+            change(*it->second);
+            pbmemfs_stats.elided_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        closed = path_updates_closed;
+    }
+    
+    auto pu = std::make_shared<path_update>();
+    change(*pu);
+    bkg_call_on(shard_for(path), lane_meta, apply_path_update, path, pu);
+    
+    // open it to merging, unless it has already run or the path has been closed since it was queued
+    std::unique_lock<std::mutex> lk(path_updates_mtx);
+    if (!pu->started_ && closed == path_updates_closed)
+        path_updates.insert(std::make_pair(path, pu));
+}
+
+// called before queuing an op that changes which file 'path' names
+void close_path_updates(const std::string& path)
+{
+    std::unique_lock<std::mutex> lk(path_updates_mtx);
+    path_updates_closed++;
+    if (path_updates.empty())
+        return;
+    path_updates.erase(path);
+    auto dir_prefix = path + "/";
+    auto it = path_updates.lower_bound(dir_prefix);
+    while (it != path_updates.end() && it->first.compare(0, dir_prefix.size(), dir_prefix) == 0)
+        it = path_updates.erase(it);
+}
+
+/*
+    html5fs descriptor cache.  Opening and closing a file in html5fs each take a round
+    trip to the browser, so when a file_ref is closed its /.html5fs_shadow descriptor is
+    kept, under the file's path, and the next open of that path takes it instead of
+    opening the file again.  This makes the common open-append-close pattern cheap.  At
+    most html5_fd_cache_size are kept, and the least recently closed is closed first.
+    
+    Entries are added by close_file_ref, and removed for the paths that file_unlinked and
+    file_renamed change, all while holding open_files_mtx, so an entry never outlives the
+    file its path named when it was added.  The descriptors themselves are closed after
+    open_files_mtx has been released.
+*/
+const size_t    html5_fd_cache_size = 16;
+
+struct cached_html5_fd
+{
+    std::string path_;
+    int         fd_;
+    int         flags_;
+};
+
+std::mutex                  html5_fd_cache_mtx;
+std::list<cached_html5_fd>  html5_fd_cache;         // most recently closed first
+std::atomic<uint64_t>       html5_fds_reused(0);
+
+// background thread: keep 'fd' for the next open of 'path'.  The caller holds open_files_mtx,
+// and closes whatever this adds to 'closing'
+void keep_html5_fd(const std::string& path, int fd, int flags, std::vector<int>& closing)
+{
+    std::unique_lock<std::mutex> lk(html5_fd_cache_mtx);
+    for (auto it = html5_fd_cache.begin(); it != html5_fd_cache.end(); ++it)
+    {
+        if (it->path_ == path)
+        {
+            closing.push_back(it->fd_);
+            html5_fd_cache.erase(it);
+            break;
+        }
+    }
+    cached_html5_fd c = { path, fd, flags };
+    html5_fd_cache.push_front(c);
+    if (html5_fd_cache.size() > html5_fd_cache_size)
+    {
+        closing.push_back(html5_fd_cache.back().fd_);
+        html5_fd_cache.pop_back();
+    }
+}
+
+// background thread: a kept descriptor for 'path' that can be used for an open with 'flags',
+// or -1.  It is truncated if 'flags' has O_TRUNC
+int take_html5_fd(const std::string& path, int flags)
+{
+    int fd = -1;
+    {
+        std::unique_lock<std::mutex> lk(html5_fd_cache_mtx);
+        for (auto it = html5_fd_cache.begin(); it != html5_fd_cache.end(); ++it)
+        {
+            if (it->path_ != path)
+                continue;
+            auto mode = it->flags_ & O_ACCMODE;
+            if ((it->flags_ & O_APPEND) == (flags & O_APPEND) && (mode == O_RDWR || mode == (flags & O_ACCMODE)))
+            {
+                fd = it->fd_;
+                html5_fd_cache.erase(it);
+            }
+            break;
+        }
+    }
+    if (fd == -1)
+        return -1;
+    html5_fds_reused.fetch_add(1, std::memory_order_relaxed);
+    if ((flags & O_TRUNC) != 0 && ftruncate(fd, 0) != 0)
+        fprintf(stderr, "ftruncate(%d, 0) failed with errno: %d\n", fd, errno);
+    return fd;
+}
+
+// background thread: forget the kept descriptors for 'path' and anything under it.  The caller
+// holds open_files_mtx, and closes whatever this adds to 'closing'
+void drop_html5_fds(const std::string& path, std::vector<int>& closing)
+{
+    std::unique_lock<std::mutex> lk(html5_fd_cache_mtx);
+    auto dir_prefix = path + "/";
+    for (auto it = html5_fd_cache.begin(); it != html5_fd_cache.end(); )
+    {
+        if (it->path_ == path || it->path_.compare(0, dir_prefix.size(), dir_prefix) == 0)
+        {
+            closing.push_back(it->fd_);
+            it = html5_fd_cache.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// background thread: open 'path' in /.html5fs_shadow, reusing a kept descriptor if there is one
+int open_html5_file(const std::string& path, int flags, mode_t mode)
+{
+    int fd = take_html5_fd(path, flags);
+    if (fd != -1)
+        return fd;
+    return open(shadow_path(html5_shadow_name, path).c_str(), flags, mode);
+}
+
+void close_html5_fds(const std::vector<int>& fds)
+{
+    for (auto fd : fds)
+    {
+        if (close(fd) != 0)
+            fprintf(stderr, "close(%d) failed, errno: %d\n", fd, errno);
+    }
+}
+
+// background thread: the file has been closed, and whatever was written to it flushed or dropped
+void close_file_ref(file_ref* fr)
+{
+    if (fr->memfs_rd_fd_ != -1)
+        close(fr->memfs_rd_fd_);
+    std::vector<int> closing;
+    {
+        std::unique_lock<std::mutex> lk(open_files_mtx);
+        open_files.erase(fr);
+        if (!pbmemfs_journal && fr->html5fs_fd_ != -1)
+        {
+            if (fr->path_.empty())
+                closing.push_back(fr->html5fs_fd_);
+            else
+                keep_html5_fd(fr->path_, fr->html5fs_fd_, fr->html5fs_flags_, closing);
+        }
+    }
+    close_html5_fds(closing);
+    delete fr;
+}
+
+// background thread: fsync the /.html5fs_shadow descriptors of shard's open files and, for
+// shard 0, the kept ones as well (flush_persistent's barrier in mirror mode).  They are
+// dup'd under the locks and synced after, so a close on another thread can't race the fsync
+void sync_html5_fds(size_t shard)
+{
+    std::vector<int> fds;
+    {
+        std::unique_lock<std::mutex> lk(open_files_mtx);
+        for (auto fr : open_files)
+        {
+            if (fr->shard_ == shard && fr->html5fs_fd_ != -1)
+                fds.push_back(dup(fr->html5fs_fd_));
+        }
+        if (shard == 0)
+        {
+            std::unique_lock<std::mutex> lk2(html5_fd_cache_mtx);
+            for (auto& c : html5_fd_cache)
+                fds.push_back(dup(c.fd_));
+        }
+    }
+    for (auto fd : fds)
+    {
+        if (fd == -1)
+            fprintf(stderr, "dup failed, errno: %d\n", errno);
+        else if (fsync(fd) != 0)
+            fprintf(stderr, "fsync(%d) failed, errno: %d\n", fd, errno);
+    }
+    fds.erase(std::remove(fds.begin(), fds.end(), -1), fds.end());
+    close_html5_fds(fds);
+}
+
+// background thread: nothing can reach fr's file any more, so don't write its dirty extents.
+// The caller holds open_files_mtx.  Returns true if fr has been released and the caller
+// must now close it (see take_dirty)
+bool drop_file_ref(file_ref* fr)
+{
+    fr->path_.clear();
+    std::map<off_t, off_t> extents;
+    std::unique_lock<std::mutex> lk(dirty_mtx);
+    if (fr->dirty_.empty())
+        return false;
+    pbmemfs_stats.elided_.fetch_add(1, std::memory_order_relaxed);
+    backlog_bytes.fetch_sub(fr->dirty_bytes_);
+    return take_dirty(fr, extents);
+}
+
+// background thread: keep the paths of open files in step with renames and unlinks
+void file_opened(file_ref* fr, const std::string& path)
+{
+    std::unique_lock<std::mutex> lk(open_files_mtx);
+    fr->path_ = path;
+    open_files.insert(fr);
+}
+
+void file_renamed(const std::string& path, const std::string& new_path)
+{
+    if (path == new_path)
+        return;
+    auto dir_prefix = path + "/";
+    std::vector<file_ref*> closing;
+    std::vector<int> closing_fds;
+    {
+        std::unique_lock<std::mutex> lk(open_files_mtx);
+        drop_html5_fds(path, closing_fds);
+        drop_html5_fds(new_path, closing_fds);
+        std::vector<file_ref*> replaced;
+        for (auto fr : open_files)
+        {
+            if (fr->path_ == new_path)
+                replaced.push_back(fr);
+            else if (fr->path_ == path)
+                fr->path_ = new_path;
+            else if (fr->path_.compare(0, dir_prefix.size(), dir_prefix) == 0)
+                fr->path_ = new_path + fr->path_.substr(path.size());
+        }
+        for (auto fr : replaced)
+        {
+            if (drop_file_ref(fr))
+                closing.push_back(fr);
+        }
+    }
+    close_html5_fds(closing_fds);
+    for (auto fr : closing)
+        close_file_ref(fr);
+}
+
+void file_unlinked(const std::string& path)
+{
+    std::vector<file_ref*> closing;
+    std::vector<int> closing_fds;
+    {
+        std::unique_lock<std::mutex> lk(open_files_mtx);
+        drop_html5_fds(path, closing_fds);
+        for (auto fr : open_files)
+        {
+            if (fr->path_ == path && drop_file_ref(fr))
+                closing.push_back(fr);
+        }
+    }
+    close_html5_fds(closing_fds);
+    for (auto fr : closing)
+        close_file_ref(fr);
+}
+
+// reads what put/put_string wrote
+struct byte_reader
+{
+    const char* p_;
+    const char* end_;
+    
+    template<typename T>
+    bool get(T& v)
+    {
+        if ((size_t)(end_ - p_) < sizeof(v))
+            return false;
+        memcpy(&v, p_, sizeof(v));
+        p_ += sizeof(v);
+        return true;
+    }
+    
+    bool get_string(std::string& str)
+    {
+        uint32_t len;
+        if (!get(len) || (size_t)(end_ - p_) < len)
+            return false;
+        str.assign(p_, len);
+        p_ += len;
+        return true;
+    }
+};
+
+// apply one record's body to /.memfs_shadow.  Returns false if the body doesn't parse
+bool replay_record(byte_reader rd)
+{
+    uint8_t op;
+    std::string path;
+    if (!rd.get(op) || !rd.get_string(path))
+        return false;
+    auto mem_path = mem_shadow_name + path;
+    switch (op)
+    {
+        case journal_create:
+        {
+            uint32_t mode;
+            uint8_t trunc;
+            if (!rd.get(mode) || !rd.get(trunc))
+                return false;
+            int fd = open(mem_path.c_str(), O_CREAT | O_WRONLY | (trunc ? O_TRUNC : 0), mode);
+            if (fd != -1)
+                close(fd);
+            return true;
+        }
+        case journal_mkdir:
+        case journal_chmod:
+        {
+            uint32_t mode;
+            if (!rd.get(mode))
+                return false;
+            if (op == journal_mkdir)
+                mkdir(mem_path.c_str(), mode);
+            else
+                chmod(mem_path.c_str(), mode);
+            return true;
+        }
+        case journal_rename:
+        {
+            std::string new_path;
+            if (!rd.get_string(new_path))
+                return false;
+            rename(mem_path.c_str(), (mem_shadow_name + new_path).c_str());
+            return true;
+        }
+        case journal_truncate:
+        {
+            int64_t size;
+            if (!rd.get(size))
+                return false;
+            truncate(mem_path.c_str(), size);
+            return true;
+        }
+        case journal_write:
+        {
+            int64_t pos;
+            if (!rd.get(pos))
+                return false;
+            int fd = open(mem_path.c_str(), O_WRONLY);
+            if (fd != -1)
+            {
+                if (pwrite(fd, rd.p_, rd.end_ - rd.p_, pos) != rd.end_ - rd.p_)
+                    fprintf(stderr, "pwrite(%s, %d, %d) failed during journal replay, errno: %d\n", mem_path.c_str(), (int)(rd.end_ - rd.p_), (int)pos, errno);
+                close(fd);
+            }
+            return true;
+        }
+        case journal_unlink:
+            unlink(mem_path.c_str());
+            return true;
+        case journal_rmdir:
+            rmdir(mem_path.c_str());
+            return true;
+        case journal_utimes:
+        {
+            uint8_t has_tv;
+            int64_t t[4];
+            if (!rd.get(has_tv) || !rd.get(t[0]) || !rd.get(t[1]) || !rd.get(t[2]) || !rd.get(t[3]))
+                return false;
+            struct timeval tv[2];
+            tv[0].tv_sec = t[0];
+            tv[0].tv_usec = t[1];
+            tv[1].tv_sec = t[2];
+            tv[1].tv_usec = t[3];
+            utimes(mem_path.c_str(), has_tv ? tv : 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+// replay the records in 'data' (the journal, after its header).  Returns how many bytes were good
+size_t replay_journal(const char* data, size_t size)
+{
+    byte_reader rd = { data, data + size };
+    while (true)
+    {
+        auto start = rd.p_;
+        uint32_t len, sum;
+        if (!rd.get(len) || !rd.get(sum) || (size_t)(rd.end_ - rd.p_) < len || fnv1a(rd.p_, len) != sum)
+            return start - data;
+        byte_reader body = { rd.p_, rd.p_ + len };
+        if (!replay_record(body))
+            return start - data;
+        rd.p_ += len;
+    }
+}
+
+// background thread: start a new, empty, journal of the given generation
+void reset_journal(uint64_t generation)
+{
+    std::vector<char> header(journal_magic, journal_magic + sizeof(journal_magic));
+    put(header, journal_version);
+    put(header, generation);
+    if (ftruncate(journal_fd, 0) != 0 || pwrite(journal_fd, header.data(), header.size(), 0) != (ssize_t)header.size())
+        fprintf(stderr, "unable to reset the journal, errno: %d\n", errno);
+    journal_generation = generation;
+    journal_size = header.size();
+    journal_buf.clear();
+}
+
+/*
+    persistent_load_on_open.  At start up only the directories, and an empty placeholder
+    for each file, are made in /.memfs_shadow.  The placeholder has the file's mode and
+    times, and lazy_files records its real size (keyed by the path under /persistent).
+    The file's contents are copied in the first time it is opened or truncated.  That
+    copy is done by the path's shard's worker, so it only reads /.html5fs_shadow after
+    every op queued on the path before it has been applied there.  lazy_mtx isn't held
+    while html5fs is read (the main thread takes it), the entry is marked with the load's
+    id instead.  A rename moves the mark along with the entry, and the copy is swapped in
+    wherever the entry is once it has been read.  An unlink (or truncate to 0) removes the
+    entry, and the copy is dropped.  Never call bkg_call_on while holding lazy_mtx (a worker
+    may be waiting for it).
+    
+    Files of at least cache_min_file_size that are opened read-only aren't loaded at all,
+    they are read through the block cache instead (see "block cache" below).  cache_ is
+    shared by everything that has the file open that way.
+*/
+struct cached_file;
+
+// the block cache's blocks.  These are declared ahead of lazy_files so that they outlive it
+// at exit -- destroying a cached_file drops its blocks from here
+struct cache_block
+{
+    uint64_t            file_id_;
+    uint64_t            index_;
+    std::vector<char>   data_;
+};
+
+std::mutex                                                          cache_mtx;
+std::list<cache_block>                                              cache_lru;      // most recently used first
+std::map<std::pair<uint64_t, uint64_t>, std::list<cache_block>::iterator>    cache_index;
+uint64_t                                                            cache_budget_bytes = 0;
+uint64_t                                                            cache_bytes = 0;
+std::atomic<uint64_t>                                               cache_hits(0);
+std::atomic<uint64_t>                                               cache_misses(0);
+
+struct lazy_file
+{
+    lazy_file()
+        : size_(0),
+          loading_(0)
+    {}
+    
+    off_t                           size_;
+    std::shared_ptr<cached_file>    cache_;
+    uint64_t                        loading_;   // the id of the load copying it in, or 0
+};
 
-namespace {
+std::mutex                          lazy_mtx;
+std::condition_variable             lazy_cnd;   // notified when a load finishes
+std::map<std::string, lazy_file>    lazy_files;
+uint64_t                            lazy_load_id = 0;
+std::atomic<size_t>                 lazy_count(0);
+bool                                lazy_prefetch = false;
+uint64_t                            cache_min_file_size = 0;    // 0 means there is no block cache
 
-// where we mount the html5fs file system
-std::string html5_shadow_name = "/.html5fs_shadow";
+bool read_whole_file(const std::string& name, std::vector<char>& data);
+void make_mem_file(const std::string& mem_path, const char* data, size_t size, const struct stat& st);
+void loaded_cached_file(cached_file* cf, const std::string& mem_path);
 
-// the file data itself for /persistent is actually mounted here.
-// our fuse-based code supporting the /persistent directory is a
-// redirect to this location, and then a background thread mirrors
-// everything to /.html5fs_shadow
-std::string mem_shadow_name = "/.memfs_shadow";
+// the entry that load 'id' is copying in, which is normally still at 'path' but may have
+// been renamed since.  lazy_files.end() if it has been removed.  The caller holds lazy_mtx
+std::map<std::string, lazy_file>::iterator find_lazy_load(const std::string& path, uint64_t id)
+{
+    auto it = lazy_files.find(path);
+    if (it != lazy_files.end() && it->second.loading_ == id)
+        return it;
+    for (it = lazy_files.begin(); it != lazy_files.end(); ++it)
+    {
+        if (it->second.loading_ == id)
+            break;
+    }
+    return it;
+}
 
-// data structures we use to coordinate tasks on the background thread
-std::list<std::pair<void (*)(void*), void*> >   pbmemfs_task_list;
-std::mutex                                      pbmemfs_mtx;
-std::condition_variable                         pbmemfs_cnd;
+// background thread: copy in the contents of 'path' if they haven't been already
+void load_lazy_file(const std::string& path)
+{
+    std::unique_lock<std::mutex> lk(lazy_mtx);
+    auto it = lazy_files.find(path);
+    if (it == lazy_files.end())
+        return;
+    if (it->second.loading_ != 0)
+    {
+        // another worker is loading it (prefetch_lazy_file can race load_if_lazy)
+        auto id = it->second.loading_;
+        lazy_cnd.wait(lk, [&]{ return find_lazy_load(path, id) == lazy_files.end(); });
+        return;
+    }
+    auto id = it->second.loading_ = ++lazy_load_id;
+    lk.unlock();
+    
+    std::vector<char> data;
+    bool read = read_whole_file(html5_shadow_name + path, data);
+    
+    lk.lock();
+    it = find_lazy_load(path, id);
+    if (it != lazy_files.end())
+    {
+        if (!read && it->first != path)
+        {
+            // renamed while we read it, and html5fs has caught up with that.  The next load reads the new path
+            it->second.loading_ = 0;
+            lazy_cnd.notify_all();
+            return;
+        }
+        if (!read)
+            fprintf(stderr, "unable to read %s, errno: %d\n", (html5_shadow_name + path).c_str(), errno);
+        
+        // nothing has the placeholder open.  Replace it rather than writing into it, in case it is
+        // read-only.  It has the current mode and times (a chmod or utimes may have changed them since)
+        auto cache = it->second.cache_;
+        auto mem_path = mem_shadow_name + it->first;
+        struct stat st;
+        if (stat(mem_path.c_str(), &st) == 0 && unlink(mem_path.c_str()) == 0)
+            make_mem_file(mem_path, data.data(), data.size(), st);
+        lazy_files.erase(it);
+        lazy_count.fetch_sub(1, std::memory_order_release);
+        
+        // anyone reading it through the block cache switches to the copy in /.memfs_shadow
+        if (cache)
+            loaded_cached_file(cache.get(), mem_path);
+    }
+    lazy_cnd.notify_all();
+}
 
-// thread proc that runs forever, waiting for new "tasks"
-// to show up in the pbmemfs_task_list.  It executes them
-// when it gets them.
-void pbmemfs_worker()
+// shard 0's worker: load one of the files that haven't been opened yet.  Returns false
+// when there are none left, or while any shard has ops still to apply
+bool prefetch_lazy_file()
 {
-    bool printed_sleep = true;
-    while (true)
+    if (!lazy_prefetch || lazy_count.load(std::memory_order_acquire) == 0)
+        return false;
+    if (pbmemfs_stats.completed_.load(std::memory_order_acquire) != pbmemfs_stats.queued_.load(std::memory_order_acquire))
+        return false;
+    std::string path;
     {
-        std::pair<void (*)(void*), void*> task;
+        // files that are read through the block cache are never loaded
+        std::unique_lock<std::mutex> lk(lazy_mtx);
+        for (auto& f : lazy_files)
         {
-            std::unique_lock<std::mutex> lk(pbmemfs_mtx);
-#if 1
-            pbmemfs_cnd.wait(lk, []{return !pbmemfs_task_list.empty();});
-#else
-            while (pbmemfs_task_list.empty())
-            {
-                if (!printed_sleep)
-                {
-                    printed_sleep = true;
-                    printf("no more tasks waiting, sleeping\n");
-                }
-                pbmemfs_cnd.wait(lk);
-            }
-            
-            if (printed_sleep)
+            if (cache_min_file_size == 0 || (uint64_t)f.second.size_ < cache_min_file_size)
             {
-                printed_sleep = false;
-                printf("tasks queued, working on them\n");
+                path = f.first;
+                break;
             }
-#endif
-            task = pbmemfs_task_list.front();
-            pbmemfs_task_list.pop_front();
         }
-        task.first(task.second);
+        if (path.empty())
+        {
+            lazy_prefetch = false;
+            return false;
+        }
     }
+    load_lazy_file(path);
+    return true;
 }
 
-// given an arbitrary callable function 'f', along with an arbitrary
-// list of (copyable) arguments, add a task that will execute
-// "f(args...)", to pbmemfs_task_list and then signal pbmemfs_worker
-// to pick up and execute that task.
-//
-// for example:
-//
-//    bkg_call(foo,100,j);
-//
-// causes "foo(100,j)" to execute in the background thread
-//
-template<typename F, typename ...Args>
-auto bkg_call(F&& f, Args&&... args) -> typename std::result_of<F (Args...)>::type
+// make sure the contents of 'path' are in /.memfs_shadow before it is opened.
+// Returns 0 or -errno
+int load_if_lazy(const std::string& path)
 {
-    auto b = std::bind(f, std::forward<Args>(args)...);
-    using function_type = decltype(b);
-    auto p = new function_type(b);
+    if (lazy_count.load(std::memory_order_acquire) == 0)
+        return 0;
+    {
+        std::unique_lock<std::mutex> lk(lazy_mtx);
+        if (lazy_files.find(path) == lazy_files.end())
+            return 0;
+    }
     
-    std::unique_lock<std::mutex> lk(pbmemfs_mtx);
-    pbmemfs_task_list.push_back(std::make_pair<void (*)(void*), void*>(
-        [] (void* _f)
+    #if defined(__native_client__)
+    // html5fs can't be used from the main thread, and the background thread can't use it while we block the main thread
+    if (pp::Module::Get()->core()->IsMainThread())
+        return -EWOULDBLOCK;
+    #endif
+    
+    std::promise<void> done;
+    bkg_call_on(shard_for(path), lane_meta, [](std::string path, std::promise<void>* done)
         {
-            function_type* f = static_cast<function_type*>(_f);
-            (*f)();
-            delete f;
-        }, p)
-                            );
-    pbmemfs_cnd.notify_one();
+            load_lazy_file(path);
+            done->set_value();
+        },
+        path, &done);
+    done.get_future().wait();
+    return 0;
 }
 
-// simple data structure for when we need to keep track
-// of both the file descriptor in /.memfs_shadow as well
-// as the one in /.html5fs_shadow
-struct file_ref
+// the file at 'path' has been removed, or truncated to 0, so there is nothing to load
+void forget_lazy(const std::string& path)
 {
-    int	memfs_fd_;
-    int html5fs_fd_;
+    if (lazy_count.load(std::memory_order_acquire) == 0)
+        return;
+    std::unique_lock<std::mutex> lk(lazy_mtx);
+    if (lazy_files.erase(path))
+        lazy_count.fetch_sub(1, std::memory_order_release);
+}
+
+// the caller holds lazy_mtx and has just renamed 'path' (a file or a directory) to 'new_path'
+void rename_lazy(const std::string& path, const std::string& new_path)
+{
+    if (lazy_files.erase(new_path))
+        lazy_count.fetch_sub(1, std::memory_order_release);
     
-    file_ref(int memfs_fd)
-        : memfs_fd_(memfs_fd),
-          html5fs_fd_(-1)
+    std::vector<std::pair<std::string, lazy_file>> moved;
+    auto dir_prefix = path + "/";
+    for (auto it = lazy_files.lower_bound(path); it != lazy_files.end(); )
+    {
+        if (it->first == path)
+            moved.push_back(std::make_pair(new_path, it->second));
+        else if (it->first.compare(0, dir_prefix.size(), dir_prefix) == 0)
+            moved.push_back(std::make_pair(new_path + it->first.substr(path.size()), it->second));
+        else if (it->first > dir_prefix)
+            break;
+        else
+        {
+            ++it;
+            continue;
+        }
+        it = lazy_files.erase(it);
+    }
+    lazy_files.insert(moved.begin(), moved.end());
+}
+
+/*
+    block cache.  A file read through the cache is read directly from /.html5fs_shadow,
+    in cache_block_size blocks, which are kept (most recently used first) until the total
+    goes over cache_budget_bytes.  Reads that continue where the previous one stopped
+    have the background thread read the next cache_readahead_blocks ahead of time.
+    
+    html5_fd_ is opened by the path's shard's worker, so that it is opened after every op
+    queued on the path before it has been applied to /.html5fs_shadow.  Nothing else changes the
+    /.html5fs_shadow file while it is in lazy_files.  If the file is loaded (because it
+    was opened for writing) mem_fd_ is set, and reads use the /.memfs_shadow copy instead.
+    nacl's main thread only ever copies blocks out of the cache, a miss there has the
+    worker read the block.
+*/
+const size_t    cache_block_size = 64 * 1024;
+const size_t    cache_readahead_blocks = 4;
+
+struct cached_file : public std::enable_shared_from_this<cached_file>
+{
+    cached_file(off_t size)
+        : id_(next_id_++),
+          size_(size),
+          html5_fd_(-1),
+          mem_fd_(-1),
+          next_pos_(0),
+          readahead_to_(0)
     {}
+    ~cached_file();
+    
+    static std::atomic<uint64_t>    next_id_;
+    uint64_t                        id_;            // cache key, so blocks don't keep the file alive
+    off_t                           size_;
+    std::atomic<int>                html5_fd_;
+    std::atomic<int>                mem_fd_;
+    std::atomic<off_t>              next_pos_;      // where a sequential read would continue
+    std::atomic<uint64_t>           readahead_to_;  // blocks before this have been asked for
+};
+std::atomic<uint64_t> cached_file::next_id_(1);
+
+// what finfo->fh points to for a file read through the cache
+struct cached_ref
+{
+    std::shared_ptr<cached_file>    file_;
+    struct stat                     st_;            // for fstat
 };
 
+// html5fs can't be used from nacl's main thread, so the background thread closes those
+std::mutex          deferred_close_mtx;
+std::vector<int>    deferred_close_fds;
+
+void close_html5_fd(int fd)
+{
+    #if defined(__native_client__)
+    if (pp::Module::Get()->core()->IsMainThread())
+    {
+        std::unique_lock<std::mutex> lk(deferred_close_mtx);
+        deferred_close_fds.push_back(fd);
+        return;
+    }
+    #endif
+    close(fd);
+}
+
+// background thread: close the fds that close_html5_fd couldn't
+void close_deferred_fds()
+{
+    std::vector<int> fds;
+    {
+        std::unique_lock<std::mutex> lk(deferred_close_mtx);
+        fds.swap(deferred_close_fds);
+    }
+    for (auto fd : fds)
+        close(fd);
+}
+
+// forget every block of file 'id'
+void drop_cached_blocks(uint64_t id)
+{
+    std::unique_lock<std::mutex> lk(cache_mtx);
+    for (auto it = cache_index.lower_bound(std::make_pair(id, (uint64_t)0)); it != cache_index.end() && it->first.first == id; )
+    {
+        cache_bytes -= it->second->data_.size();
+        cache_lru.erase(it->second);
+        it = cache_index.erase(it);
+    }
+}
+
+cached_file::~cached_file()
+{
+    drop_cached_blocks(id_);
+    if (html5_fd_ != -1)
+        close_html5_fd(html5_fd_);
+    if (mem_fd_ != -1)
+        close(mem_fd_);
+}
+
+void loaded_cached_file(cached_file* cf, const std::string& mem_path)
+{
+    cf->mem_fd_ = open(mem_path.c_str(), O_RDONLY);
+    drop_cached_blocks(cf->id_);
+}
+
+// copy what we have of block 'index' of 'cf' into 'buf', starting 'offset' bytes into the block.
+// Returns the number of bytes copied, or -1 if the block isn't cached
+ssize_t copy_cached_block(cached_file* cf, uint64_t index, size_t offset, char* buf, size_t count)
+{
+    std::unique_lock<std::mutex> lk(cache_mtx);
+    auto it = cache_index.find(std::make_pair(cf->id_, index));
+    if (it == cache_index.end())
+        return -1;
+    cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+    auto& data = it->second->data_;
+    if (offset >= data.size())
+        return 0;
+    count = std::min(count, data.size() - offset);
+    memcpy(buf, &data[offset], count);
+    return count;
+}
+
+bool is_cached(uint64_t id, uint64_t index)
+{
+    std::unique_lock<std::mutex> lk(cache_mtx);
+    return cache_index.find(std::make_pair(id, index)) != cache_index.end();
+}
+
+// read block 'index' of 'cf' from /.html5fs_shadow and add it to the cache
+bool read_cached_block(cached_file* cf, uint64_t index)
+{
+    cache_block block;
+    block.file_id_ = cf->id_;
+    block.index_ = index;
+    block.data_.resize(cache_block_size);
+    auto got = pread(cf->html5_fd_, block.data_.data(), cache_block_size, index * cache_block_size);
+    if (got < 0)
+    {
+        fprintf(stderr, "pread(%d, %p, %d, %d) failed with errno: %d\n", (int)cf->html5_fd_, block.data_.data(), (int)cache_block_size, (int)(index * cache_block_size), errno);
+        return false;
+    }
+    block.data_.resize(got);
+    
+    std::unique_lock<std::mutex> lk(cache_mtx);
+    auto key = std::make_pair(cf->id_, index);
+    if (cache_index.find(key) != cache_index.end())
+        return true;    // someone else got there first
+    cache_bytes += block.data_.size();
+    cache_lru.push_front(std::move(block));
+    cache_index[key] = cache_lru.begin();
+    while (cache_bytes > cache_budget_bytes && cache_lru.size() > 1)
+    {
+        auto& victim = cache_lru.back();
+        cache_bytes -= victim.data_.size();
+        cache_index.erase(std::make_pair(victim.file_id_, victim.index_));
+        cache_lru.pop_back();
+    }
+    return true;
+}
+
+// have the file's shard's worker read blocks [from, last) of 'cf' that aren't cached yet
+void queue_cached_blocks(cached_file* cf, uint64_t from, uint64_t last)
+{
+    bkg_call_on(cf->id_ % pbmemfs_shard_count, lane_data, [](std::shared_ptr<cached_file> cf, uint64_t from, uint64_t last)
+        {
+            for (auto index = from; index < last && cf->mem_fd_ == -1; index++)
+            {
+                if (!is_cached(cf->id_, index))
+                    read_cached_block(cf.get(), index);
+            }
+        },
+        cf->shared_from_this(), from, last);
+}
+
+// pbmemfs_read for a file read through the cache
+int cached_read(cached_file* cf, char* buf, size_t count, off_t pos)
+{
+    int mem_fd = cf->mem_fd_;
+    if (mem_fd != -1)
+    {
+        auto bytes = pread(mem_fd, buf, count, pos);
+        return bytes < 0 ? -errno : (int)bytes;
+    }
+    
+    if (pos >= cf->size_)
+        return 0;
+    count = (size_t)std::min<off_t>(count, cf->size_ - pos);
+    size_t done = 0;
+    while (done < count)
+    {
+        auto at = pos + done;
+        auto index = (uint64_t)at / cache_block_size;
+        auto offset = (size_t)(at % cache_block_size);
+        auto bytes = copy_cached_block(cf, index, offset, &buf[done], count - done);
+        if (bytes < 0)
+        {
+            cache_misses.fetch_add(1, std::memory_order_relaxed);
+            #if defined(__native_client__)
+            // html5fs can't be read on the main thread (see close_html5_fd), so the worker
+            // reads the block and the caller tries again once it is there
+            if (pp::Module::Get()->core()->IsMainThread())
+            {
+                if (done != 0)
+                    break;
+                queue_cached_blocks(cf, index, index + 1);
+                return -EWOULDBLOCK;
+            }
+            #endif
+            if (!read_cached_block(cf, index))
+                return done ? (int)done : -EIO;
+            bytes = copy_cached_block(cf, index, offset, &buf[done], count - done);
+        }
+        else
+            cache_hits.fetch_add(1, std::memory_order_relaxed);
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+    
+    // sequential reads get the next few blocks read ahead of time
+    bool sequential = cf->next_pos_.exchange(pos + done) == pos;
+    uint64_t next = (pos + done + cache_block_size - 1) / cache_block_size;
+    uint64_t last = std::min<uint64_t>(next + cache_readahead_blocks, (cf->size_ + cache_block_size - 1) / cache_block_size);
+    uint64_t from = std::max<uint64_t>(next, cf->readahead_to_.load());
+    if (sequential && from < last && cf->readahead_to_.exchange(last) < last)
+        queue_cached_blocks(cf, from, last);
+    return (int)done;
+}
+
+// open 'path' for reading through the block cache, if that's how it is read.  Returns
+// the cached_ref to use as the file handle, or 0 if it should be opened normally
+cached_ref* open_cached(const std::string& path, int flags, int* err)
+{
+    *err = 0;
+    if (cache_min_file_size == 0 || (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC) || lazy_count.load(std::memory_order_acquire) == 0)
+        return 0;
+    std::shared_ptr<cached_file> cf;
+    {
+        std::unique_lock<std::mutex> lk(lazy_mtx);
+        auto it = lazy_files.find(path);
+        if (it == lazy_files.end() || (uint64_t)it->second.size_ < cache_min_file_size)
+            return 0;
+        if (!it->second.cache_)
+            it->second.cache_ = std::make_shared<cached_file>(it->second.size_);
+        cf = it->second.cache_;
+    }
+    
+    if (cf->html5_fd_ == -1)
+    {
+        #if defined(__native_client__)
+        // see load_if_lazy
+        if (pp::Module::Get()->core()->IsMainThread())
+        {
+            *err = -EWOULDBLOCK;
+            return 0;
+        }
+        #endif
+        
+        std::promise<void> done;
+        bkg_call_on(shard_for(path), lane_meta, [](cached_file* cf, std::string path, std::promise<void>* done)
+            {
+                if (cf->html5_fd_ == -1)
+                {
+                    cf->html5_fd_ = open(path.c_str(), O_RDONLY);
+                    if (cf->html5_fd_ == -1)
+                        fprintf(stderr, "open(%s, O_RDONLY) failed with errno: %d\n", path.c_str(), errno);
+                }
+                done->set_value();
+            },
+            cf.get(), html5_shadow_name + path, &done);
+        done.get_future().wait();
+        if (cf->html5_fd_ == -1)
+        {
+            *err = -EIO;
+            return 0;
+        }
+    }
+    
+    auto cr = new cached_ref;
+    cr->file_ = cf;
+    if (stat((mem_shadow_name + path).c_str(), &cr->st_) != 0)
+        memset(&cr->st_, 0, sizeof(cr->st_));
+    cr->st_.st_size = cf->size_;
+    cr->st_.st_blocks = (cf->size_ + 511) / 512;
+    return cr;
+}
+
+// a read-only file has just its /.memfs_shadow file descriptor.  malloc'ed pointers can't
+// have anything in the low 2 bits, so use them to distinguish between this, file_ref's
+// and cached_ref's.
+void set_ro_fh(struct fuse_file_info* finfo, int fd)
+{
+    finfo->fh = (fd << 2) | 1;
+}
+
 // set the 'fh' field of finfo.  If the file is writable
 // then we use an allocated datastructure (file_ref) to keep
 // track of both the file descriptor in /.memfs_shadow as well
 // as /.html5fs_shadow.  Otherwise we just keep track of the
-// the one in /.memfs_shadow
-bool set_fh(struct fuse_file_info* finfo, int flags, int fd)
+// the one in /.memfs_shadow.  'path' is relative to /persistent
+bool set_fh(struct fuse_file_info* finfo, int flags, int fd, const std::string& path)
 {
     if ((flags & O_ACCMODE) != O_RDONLY)
     {
         // it is possible that it will be written to
         auto fr = new file_ref(fd);
+        auto mem_path = mem_shadow_name + path;
+        fr->shard_ = shard_for(path);
+        fr->memfs_rd_fd_ = open(mem_path.c_str(), O_RDONLY);
+        fr->append_ = (flags & O_APPEND) != 0;
         finfo->fh = reinterpret_cast<decltype(finfo->fh)>(fr);
         return true;
     }
     else
     {
-        // malloc'ed pointers can't have 1 in the low bit, so use that
-        // to distinguish between the two cases.
-        finfo->fh = (fd << 1) | 1;
+        set_ro_fh(finfo, fd);
         return false;
     }
 }
 
+// files read through the block cache have a cached_ref instead of a file descriptor
+void set_cached_fh(struct fuse_file_info* finfo, cached_ref* cr)
+{
+    finfo->fh = reinterpret_cast<decltype(finfo->fh)>(cr) | 2;
+}
+
 // get the file_ref if there is one (the file is writable)
 // or 0 if not.
 file_ref* get_fr(struct fuse_file_info* finfo)
 {
-    if (finfo->fh & 1)
+    if (finfo->fh & 3)
         return 0;
     return reinterpret_cast<file_ref*>(finfo->fh);
 }
 
+// get the cached_ref if the file is read through the block cache, or 0 if not
+cached_ref* get_cr(struct fuse_file_info* finfo)
+{
+    if ((finfo->fh & 3) != 2)
+        return 0;
+    return reinterpret_cast<cached_ref*>(finfo->fh & ~(decltype(finfo->fh))3);
+}
+
 // get the primary file descriptor (for the file in
-// in /.memfs_shadow)
+// in /.memfs_shadow), or -1 for files read through the block cache
 int get_fd(struct fuse_file_info* finfo)
 {
+    if (get_cr(finfo))
+        return -1;
     auto fr = get_fr(finfo);
-    return fr ? fr->memfs_fd_ : finfo->fh >> 1;
+    return fr ? fr->memfs_fd_ : finfo->fh >> 2;
+}
+
+// the flags to open the /.html5fs_shadow file with.  Dirty extents are
+// written at their own offsets, so that file must not be O_APPEND
+int html5_flags(struct fuse_file_info* finfo)
+{
+    auto fr = get_fr(finfo);
+    return fr && fr->memfs_rd_fd_ != -1 ? finfo->flags & ~O_APPEND : finfo->flags;
 }
     
 ///////////////////////////////////////////////////////////
@@ -213,32 +3113,54 @@ void pbmemfs_destroy(void* p)
 // Called by access()
 int pbmemfs_access(const char* path, int mode)
 {
-    return access((mem_shadow_name + path).c_str(),mode);
+    return access(shadow_path(mem_shadow_name, path).c_str(),mode);
 }
 
 // Called when O_CREAT is passed to open()
 int pbmemfs_create(const char* _path, mode_t mode, struct fuse_file_info* finfo)
 {
     std::string path(_path);
-    int fd = open((mem_shadow_name + path).c_str(),finfo->flags,mode);
+    int err = wait_for_backlog(false);
+    if (err == 0)
+        err = load_if_lazy(path);
+    if (err != 0)
+        return err;
+    int fd = open(shadow_path(mem_shadow_name, path).c_str(),finfo->flags,mode);
     if (fd >= 0)
     {
-        set_fh(finfo, finfo->flags, fd);
-        bkg_call([](std::string path, int flags, mode_t mode, file_ref* fr)
+        set_fh(finfo, finfo->flags, fd, path);
+        if (pbmemfs_journal)
+        {
+            journal_op_then(journal_record(journal_create, path, (uint32_t)mode, (uint8_t)((finfo->flags & O_TRUNC) != 0)),
+                [](file_ref* fr, std::string path)
+                {
+                    if (fr)
+                        file_opened(fr, path);
+                },
+                get_fr(finfo), path);
+            return 0;
+        }
+        close_path_updates(path);
+        bkg_call_on(shard_for(path), lane_meta, [](std::string path, int flags, mode_t mode, file_ref* fr)
             {
-                int fd = open(path.c_str(), flags, mode);
+                // fr will be null if the caller called open(path, O_RDONLY | O_CREAT, mode);
+                int fd = fr ? open_html5_file(path, flags, mode) : open(shadow_path(html5_shadow_name, path).c_str(), flags, mode);
                 if (fd >= 0)
                 {
-                    // fr will be null if the caller called open(path, O_RDONLY | O_CREAT, mode);
                     if (fr)
+                    {
                         fr->html5fs_fd_ = fd;
+                        fr->html5fs_flags_ = flags;
+                    }
                     else
                         close(fd);
                 }
                 else
-                    fprintf(stderr, "open(%s, %o, %o) failed with errno: %d\n", path.c_str(), (int)flags, (int)mode, errno);
+                    fprintf(stderr, "open(%s, %o, %o) failed with errno: %d\n", (html5_shadow_name + path).c_str(), (int)flags, (int)mode, errno);
+                if (fr)
+                    file_opened(fr, path);
             },
-            html5_shadow_name + path, finfo->flags, mode,get_fr(finfo));
+            path, html5_flags(finfo), mode,get_fr(finfo));
         return 0;
     }
     return -errno;
@@ -249,14 +3171,32 @@ int pbmemfs_create(const char* _path, mode_t mode, struct fuse_file_info* finfo)
 // file.
 int pbmemfs_getattr(const char* path, struct stat* st)
 {
-    if (stat((mem_shadow_name + path).c_str(), st) == 0)
+    if (stat(shadow_path(mem_shadow_name, path).c_str(), st) == 0)
+    {
+        // a placeholder for a file that hasn't been loaded yet is empty, report the real size
+        if (S_ISREG(st->st_mode) && lazy_count.load(std::memory_order_acquire) != 0)
+        {
+            std::unique_lock<std::mutex> lk(lazy_mtx);
+            auto it = lazy_files.find(path);
+            if (it != lazy_files.end())
+            {
+                st->st_size = it->second.size_;
+                st->st_blocks = (it->second.size_ + 511) / 512;
+            }
+        }
         return 0;
+    }
     return -errno;
 }
 
 // Called by fstat()
 int pbmemfs_fgetattr(const char* path, struct stat* st, struct fuse_file_info* finfo)
 {
+    if (auto cr = get_cr(finfo))
+    {
+        *st = cr->st_;
+        return 0;
+    }
     if (finfo->fh != 0)
     {
         if (fstat(get_fd(finfo), st) == 0)
@@ -267,25 +3207,115 @@ int pbmemfs_fgetattr(const char* path, struct stat* st, struct fuse_file_info* f
         return pbmemfs_getattr(path, st);
 }
 
+// background thread: write out whatever of fr is dirty and sync it, then record that the
+// first 'changes' writes and ftruncates are durable.  Queued in lane_data, so every op
+// queued for fr before it has already been done
+void sync_file(file_ref* fr, uint64_t changes)
+{
+    flush_dirty(fr);
+    if (pbmemfs_journal)
+        journal_sync();
+    else if (fr->html5fs_fd_ != -1 && fsync(fr->html5fs_fd_) != 0)
+        fprintf(stderr, "fsync(%d) failed, errno: %d\n", fr->html5fs_fd_, errno);
+    auto synced = fr->synced_.load(std::memory_order_relaxed);
+    while (synced < changes && !fr->synced_.compare_exchange_weak(synced, changes, std::memory_order_release))
+        ;
+}
+
 // Called by fsync(). The datasync paramater is not currently supported.
+// Returns once the background thread has written everything queued for this file
+// and synced it.  The main thread can't wait for that (see "backpressure"), so
+// there the sync is queued and fsync fails with EAGAIN until it has been done.
+// Calling it again then returns 0, as long as nothing was written in between.
 int pbmemfs_fsync(const char* path, int datasync, struct fuse_file_info* finfo)
 {
-    // this can be a no-op for us, we always sync when
-    // the io operation happens
+    file_ref* fr = get_fr(finfo);
+    if (!fr)
+        return 0;
+    auto changes = fr->changes_.load(std::memory_order_acquire);
+    if (fr->synced_.load(std::memory_order_acquire) >= changes)
+        return 0;
+    if (on_main_thread())
+    {
+        // one queued sync covers every retry until there is another write
+        if (fr->sync_queued_.exchange(changes, std::memory_order_relaxed) != changes)
+            bkg_call_on(fr->shard_, lane_data, [](file_ref* fr, uint64_t changes)
+                {
+                    sync_file(fr, changes);
+                },
+                fr, changes);
+        return -EAGAIN;
+    }
+    std::promise<void> done;
+    bkg_call_on(fr->shard_, lane_data, [](file_ref* fr, uint64_t changes, std::promise<void>* done)
+        {
+            sync_file(fr, changes);
+            done->set_value();
+        },
+        fr, changes, &done);
+    done.get_future().wait();
     return 0;
 }
 
 // Called by ftruncate()
 int pbmemfs_ftruncate(const char* _path, off_t pos, struct fuse_file_info* finfo)
 {
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
     if (ftruncate(get_fd(finfo), pos) == 0)
     {
-        bkg_call([](off_t pos, file_ref* fr)
+        file_ref* fr = get_fr(finfo);
+        fr->changes_.fetch_add(1, std::memory_order_release);
+        {
+            std::unique_lock<std::mutex> lk(dirty_mtx);
+            truncate_dirty(fr, pos);
+            
+            // merge it into an ftruncate that is still queued (see "op elision")
+            if (!pbmemfs_journal)
+            {
+                if (fr->trunc_to_ != -1)
+                {
+                    fr->trunc_to_ = std::min(fr->trunc_to_, pos);
+                    pbmemfs_stats.elided_.fetch_add(1, std::memory_order_relaxed);
+                    return 0;
+                }
+                fr->trunc_to_ = pos;
+            }
+        }
+        if (pbmemfs_journal)
+        {
+            bkg_call_on(fr->shard_, lane_meta, [](off_t pos, file_ref* fr)
+                {
+                    if (fr->path_.empty())
+                        return;
+                    journal_append(journal_record(journal_truncate, fr->path_, (int64_t)pos));
+                    journal_after_truncate(fr->path_, pos);
+                },
+                pos, fr);
+            return 0;
+        }
+        bkg_call_on(fr->shard_, lane_meta, [](file_ref* fr)
             {
+                off_t pos;
+                {
+                    std::unique_lock<std::mutex> lk(dirty_mtx);
+                    pos = fr->trunc_to_;
+                    fr->trunc_to_ = -1;
+                }
+                
+                // nothing can reach the file once it has been unlinked
+                {
+                    std::unique_lock<std::mutex> lk(open_files_mtx);
+                    if (fr->path_.empty())
+                        return;
+                }
                 if (ftruncate(fr->html5fs_fd_,pos))
                     fprintf(stderr, "ftruncate(%d, %d) failed with errno: %d\n", fr->html5fs_fd_, (int)pos, errno);
+                else if (fr->memfs_rd_fd_ != -1)
+                    recopy_after_truncate(fr->memfs_rd_fd_, fr->html5fs_fd_, pos);
             },
-            pos, get_fr(finfo));
+            fr);
         return 0;
     }
     return -errno;
@@ -295,9 +3325,17 @@ int pbmemfs_ftruncate(const char* _path, off_t pos, struct fuse_file_info* finfo
 int pbmemfs_mkdir(const char* _path, mode_t mode)
 {
     std::string path(_path);
-    if (mkdir((mem_shadow_name + path).c_str(), mode) == 0)
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
+    if (mkdir(shadow_path(mem_shadow_name, path).c_str(), mode) == 0)
     {
-        bkg_call([](std::string path, mode_t mode)
+        if (pbmemfs_journal)
+        {
+            journal_op(journal_mkdir, path, (uint32_t)mode);
+            return 0;
+        }
+        bkg_call_all([](std::string path, mode_t mode)
             {
                 if (mkdir(path.c_str(), mode) != 0)
                     fprintf(stderr, "mkdir(%s, %d) failed with errno: %d\n", path.c_str(), (int)mode, errno);
@@ -324,37 +3362,119 @@ int pbmemfs_mknod(const char* path, mode_t mode, dev_t dev)
 // Called by open()
 int pbmemfs_open(const char* _path, struct fuse_file_info* finfo)
 {
+    // reading a file that is already in memory is the common case, and
+    // doesn't involve the background threads (or any allocation)
+    if ((finfo->flags & O_ACCMODE) == O_RDONLY && lazy_count.load(std::memory_order_acquire) == 0)
+    {
+        int fd = open(shadow_path(mem_shadow_name, _path).c_str(), finfo->flags);
+        if (fd < 0)
+            return -errno;
+        set_ro_fh(finfo, fd);
+        return 0;
+    }
+    
     std::string path(_path);
-    int fd = open((mem_shadow_name + path).c_str(),finfo->flags);
+    int err;
+    if ((finfo->flags & O_ACCMODE) != O_RDONLY)
+    {
+        err = wait_for_backlog(false);
+        if (err != 0)
+            return err;
+    }
+    auto cr = open_cached(path, finfo->flags, &err);
+    if (cr)
+    {
+        set_cached_fh(finfo, cr);
+        return 0;
+    }
+    if (err == 0)
+        err = load_if_lazy(path);
+    if (err != 0)
+        return err;
+    int fd = open(shadow_path(mem_shadow_name, path).c_str(),finfo->flags);
     if (fd >= 0)
     {
-        if (set_fh(finfo, finfo->flags, fd))
-            bkg_call([](std::string path, int flags, file_ref* fr)
-                {
-                    int fd = open(path.c_str(), flags);
-                    if (fd >= 0)
-                        fr->html5fs_fd_ = fd;
-                    else
-                        fprintf(stderr, "open(%s, %o) failed with errno: %d\n", path.c_str(), (int)flags, errno);
-                },
-                html5_shadow_name + path, finfo->flags, get_fr(finfo));
-
+        if (set_fh(finfo, finfo->flags, fd, path))
+        {
+            if (pbmemfs_journal)
+                bkg_call_on(0, lane_meta, file_opened, get_fr(finfo), path);
+            else
+            {
+                close_path_updates(path);
+                bkg_call_on(shard_for(path), lane_meta, [](std::string path, int flags, file_ref* fr)
+                    {
+                        int fd = open_html5_file(path, flags, 0);
+                        if (fd >= 0)
+                        {
+                            fr->html5fs_fd_ = fd;
+                            fr->html5fs_flags_ = flags;
+                        }
+                        else
+                            fprintf(stderr, "open(%s, %o) failed with errno: %d\n", (html5_shadow_name + path).c_str(), (int)flags, errno);
+                        file_opened(fr, path);
+                    },
+                    path, html5_flags(finfo), get_fr(finfo));
+            }
+        }
         return 0;
     }
     return -errno;
 }
 
+// an open directory: its entries, and their attributes, as they were when it was opened
+struct pbmemfs_dir
+{
+    mutantspider::dir_scan  scan_;
+    size_t                  next_;      // the next entry pbmemfs_readdir will return
+};
+
+// list /persistent/'path' into 'scan'.  Returns 0 or an errno value
+int scan_mem_dir(const char* path, mutantspider::dir_scan& scan, bool dots)
+{
+    int err = scan_real_dir(shadow_path(mem_shadow_name, path).c_str(), scan, dots);
+    if (err != 0 || lazy_count.load(std::memory_order_acquire) == 0)
+        return err;
+    
+    // placeholders for files that haven't been loaded yet are empty, report the real sizes (see pbmemfs_getattr)
+    std::string file_path = strcmp(path, "/") == 0 ? "/" : std::string(path) + "/";
+    auto base = file_path.size();
+    std::unique_lock<std::mutex> lk(lazy_mtx);
+    for (size_t i = 0; i < scan.entries.size(); i++)
+    {
+        auto& st = scan.entries[i].st;
+        if (!S_ISREG(st.st_mode))
+            continue;
+        file_path.resize(base);
+        file_path += scan.name(i);
+        auto it = lazy_files.find(file_path);
+        if (it != lazy_files.end())
+        {
+            st.st_size = it->second.size_;
+            st.st_blocks = (it->second.size_ + 511) / 512;
+        }
+    }
+    return 0;
+}
+
 // Called by getdents(), which is called by the more standard functions
-// opendir()/readdir().  NaCl's fuse implementation calls our pbmemfs_readdir
-// once for each file/dir being enumerated.  So we just call opendir
-// here, keep the DIR*, and then call readdir (once) in our pbmemfs_readdir.
-// Unfortunately, NaCl calls this function (pbmemfs_opendir) once for each
-// file/dir too, so we test to see whether we have already done the opendir
-// step.
+// opendir()/readdir().  The directory's entries, and their attributes, are
+// all read here, so pbmemfs_readdir can return as many as fit in one call.
+// NaCl calls this function (pbmemfs_opendir) before each call to
+// pbmemfs_readdir, so we test to see whether we have already done it.
 int pbmemfs_opendir(const char* path, struct fuse_file_info* finfo)
 {
     if (finfo->fh == 0)
-        finfo->fh = reinterpret_cast<decltype(finfo->fh)>(opendir((mem_shadow_name + path).c_str()));
+    {
+        auto d = new pbmemfs_dir;
+        int err = scan_mem_dir(path, d->scan_, true);
+        if (err != 0)
+        {
+            delete d;
+            return -err;
+        }
+        d->next_ = 0;
+        finfo->fh = reinterpret_cast<decltype(finfo->fh)>(d);
+    }
     return 0;
 }
 
@@ -364,6 +3484,8 @@ int pbmemfs_opendir(const char* path, struct fuse_file_info* finfo)
 int pbmemfs_read(const char* path, char* buf, size_t count, off_t pos,
              struct fuse_file_info* finfo)
 {
+    if (auto cr = get_cr(finfo))
+        return cached_read(cr->file_.get(), buf, count, pos);
     size_t bytesRead = 0;
     while (bytesRead < count)
     {
@@ -378,19 +3500,23 @@ int pbmemfs_read(const char* path, char* buf, size_t count, off_t pos,
 }
 
 // (big, long comment from fuse.h omitted)
+// Fills in entries until filldir says the caller's buffer is full.  The offset
+// given to filldir is never 0, which tells nacl's fuse that we stop when full
+// and carry on from the offset of the last entry the caller kept, which is
+// 'pos' on the next call.  Entry i is given offset i+1, so 'pos' is the index
+// of the next entry to return.
 int pbmemfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t pos,
                 struct fuse_file_info* finfo)
 {
-    DIR* dir = (DIR*)finfo->fh; // see pbmemfs_opendir
-    
-    struct dirent *ent = readdir(dir);
-    if (ent)
+    auto d = reinterpret_cast<pbmemfs_dir*>(finfo->fh); // see pbmemfs_opendir
+    d->next_ = pos < 0 ? 0 : (size_t)pos;
+    auto& ents = d->scan_.entries;
+    while (d->next_ < ents.size())
     {
-        struct stat st;
-        if (stat((mem_shadow_name + path + "/" + ent->d_name).c_str(),&st) == 0)
-            (*filldir)(buf, ent->d_name, &st, pos);
+        if ((*filldir)(buf, d->scan_.name(d->next_), &ents[d->next_].st, (off_t)d->next_ + 1) != 0)
+            break;
+        d->next_++;
     }
-    
     return 0;
 }
 
@@ -399,15 +3525,28 @@ int pbmemfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t
 // called instead.
 int pbmemfs_release(const char* path, struct fuse_file_info* finfo)
 {
+    if (auto cr = get_cr(finfo))
+    {
+        delete cr;
+        return 0;
+    }
     if (close(get_fd(finfo)) == 0)
     {
         file_ref* fr = get_fr(finfo);
         if (fr)
-            bkg_call([](file_ref* fr)
+            bkg_call_on(fr->shard_, lane_data, [](file_ref* fr)
                 {
-                    if (close(fr->html5fs_fd_) != 0)
-                        fprintf(stderr, "close(%d) failed, errno: %d\n", fr->html5fs_fd_, errno);
-                    delete fr;
+                    // leave anything still dirty to flush_aged_files, in case the file is
+                    // about to be unlinked (see "op elision")
+                    {
+                        std::unique_lock<std::mutex> lk(dirty_mtx);
+                        if (!fr->dirty_.empty())
+                        {
+                            fr->released_ = true;
+                            return;
+                        }
+                    }
+                    close_file_ref(fr);
                 },
                 fr);
         return 0;
@@ -423,7 +3562,7 @@ int pbmemfs_releasedir(const char* path, struct fuse_file_info* finfo)
     // see pbmemfs_opendir
     if (finfo->fh)
     {
-        closedir((DIR*)finfo->fh);
+        delete reinterpret_cast<pbmemfs_dir*>(finfo->fh);
         finfo->fh = 0;
     }
     
@@ -435,15 +3574,29 @@ int pbmemfs_rename(const char* _path, const char* _new_path)
 {
     std::string path(_path);
     std::string new_path(_new_path);
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
     
-    if (rename((mem_shadow_name + path).c_str(), (mem_shadow_name + new_path).c_str()) == 0)
+    std::unique_lock<std::mutex> lk(lazy_mtx);
+    if (rename(shadow_path(mem_shadow_name, path).c_str(), shadow_path(mem_shadow_name, new_path).c_str()) == 0)
     {
-        bkg_call([](std::string path, std::string new_path)
+        rename_lazy(path, new_path);
+        lk.unlock();
+        if (pbmemfs_journal)
+        {
+            journal_op_then(journal_record(journal_rename, path, new_path), file_renamed, path, new_path);
+            return 0;
+        }
+        close_path_updates(path);
+        close_path_updates(new_path);
+        bkg_call_all([](std::string path, std::string new_path)
             {
-                if (rename(path.c_str(), new_path.c_str()) != 0)
-                    fprintf(stderr, "rename(%s, %s) failed with errno: %d\n", path.c_str(), new_path.c_str(), errno);
+                if (rename(shadow_path(html5_shadow_name, path).c_str(), shadow_path(html5_shadow_name, new_path).c_str()) != 0)
+                    fprintf(stderr, "rename(%s, %s) failed with errno: %d\n", (html5_shadow_name + path).c_str(), (html5_shadow_name + new_path).c_str(), errno);
+                file_renamed(path, new_path);
             },
-            html5_shadow_name + path, html5_shadow_name + new_path);
+            path, new_path);
         return 0;
     }
     return -errno;
@@ -454,6 +3607,9 @@ int pbmemfs_rename(const char* _path, const char* _new_path)
 int pbmemfs_utimens(const char* _path, const struct timespec _tv[2])
 {
     std::string path(_path);
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
     struct timeval tv[2];
     if (_tv != 0)
     {
@@ -462,18 +3618,35 @@ int pbmemfs_utimens(const char* _path, const struct timespec _tv[2])
         tv[1].tv_sec  = _tv[1].tv_sec;
         tv[1].tv_usec = _tv[1].tv_nsec / 1000;
     }
-    auto tvp = &tv;
-    if (!_tv)
-        tvp = 0;
+    else
+        memset(tv, 0, sizeof(tv));
     
-    if (utimes((mem_shadow_name + path).c_str(), *tvp) == 0)
+    if (utimes(shadow_path(mem_shadow_name, path).c_str(), _tv ? tv : 0) == 0)
     {
-        bkg_call([](std::string path, const struct timeval tv[2])
+        if (pbmemfs_journal)
+        {
+            // the file's unflushed writes go in the journal first (see flush_path_files)
+            auto rec = journal_record(journal_utimes, path, (uint8_t)(_tv != 0), (int64_t)tv[0].tv_sec, (int64_t)tv[0].tv_usec,
+                        (int64_t)tv[1].tv_sec, (int64_t)tv[1].tv_usec);
+            bkg_call_on(0, lane_meta, [](std::string path, std::vector<char> rec)
+                {
+                    flush_path_files(0, path);
+                    journal_append(rec);
+                },
+                path, std::move(rec));
+            return 0;
+        }
+        // 'tv' is on our stack, so pass the two values (not a pointer to them)
+        bool now = _tv == 0;
+        struct timeval tv0 = tv[0];
+        struct timeval tv1 = tv[1];
+        update_path(path, [now, tv0, tv1](path_update& u)
             {
-                if (utimes(path.c_str(), tv) != 0)
-                    fprintf(stderr, "utimes(%s, (timespec)) failed with errno: %d\n", path.c_str(), errno);
-            },
-            html5_shadow_name + path, *tvp);
+                u.has_times_ = true;
+                u.now_ = now;
+                u.tv_[0] = tv0;
+                u.tv_[1] = tv1;
+            });
         return 0;
     }
     
@@ -483,14 +3656,21 @@ int pbmemfs_utimens(const char* _path, const struct timespec _tv[2])
 int pbmemfs_chmod(const char* _path, mode_t mode)
 {
     std::string path(_path);
-    if (chmod((mem_shadow_name + path).c_str(), mode) == 0)
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
+    if (chmod(shadow_path(mem_shadow_name, path).c_str(), mode) == 0)
     {
-        bkg_call([](std::string path, mode_t mode)
+        if (pbmemfs_journal)
+        {
+            journal_op(journal_chmod, path, (uint32_t)mode);
+            return 0;
+        }
+        update_path(path, [mode](path_update& u)
             {
-                if (chmod(path.c_str(), mode) != 0)
-                    fprintf(stderr, "chmod(%s, 0%o) failed with errno: %d\n", path.c_str(), mode, errno);
-            },
-            html5_shadow_name + path, mode);
+                u.has_mode_ = true;
+                u.mode_ = mode;
+            });
         return 0;
     }
     return -errno;
@@ -501,9 +3681,18 @@ int pbmemfs_chmod(const char* _path, mode_t mode)
 int pbmemfs_rmdir(const char* _path)
 {
     std::string path(_path);
-    if (rmdir((mem_shadow_name + path).c_str()) == 0)
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
+    if (rmdir(shadow_path(mem_shadow_name, path).c_str()) == 0)
     {
-        bkg_call([](std::string path)
+        if (pbmemfs_journal)
+        {
+            journal_op(journal_rmdir, path);
+            return 0;
+        }
+        close_path_updates(path);
+        bkg_call_all([](std::string path)
             {
                 if (rmdir(path.c_str()) != 0)
                     fprintf(stderr, "rmdir(\"%s\") failed with errno: %d\n", path.c_str(), errno);
@@ -518,14 +3707,28 @@ int pbmemfs_rmdir(const char* _path)
 int pbmemfs_truncate(const char* _path, off_t pos)
 {
     std::string	path(_path);
-    if (truncate((mem_shadow_name + path).c_str(),pos) == 0)
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
+    if (pos == 0)
+        forget_lazy(path);
+    else
+    {
+        err = load_if_lazy(path);
+        if (err != 0)
+            return err;
+    }
+    if (truncate(shadow_path(mem_shadow_name, path).c_str(),pos) == 0)
     {
-        bkg_call([](std::string path, off_t pos)
+        if (pbmemfs_journal)
+        {
+            journal_op_then(journal_record(journal_truncate, path, (int64_t)pos), journal_after_truncate, path, pos);
+            return 0;
+        }
+        update_path(path, [pos](path_update& u)
             {
-                if (truncate(path.c_str(),pos) != 0)
-                    fprintf(stderr, "truncate(%s, %d) failed with errno: %d\n", path.c_str(), (int)pos, errno);
-            },
-            html5_shadow_name + path, pos);
+                u.trunc_to_ = u.trunc_to_ == -1 ? pos : std::min(u.trunc_to_, pos);
+            });
         return 0;
     }
     return -errno;
@@ -535,14 +3738,25 @@ int pbmemfs_truncate(const char* _path, off_t pos)
 int pbmemfs_unlink(const char* _path)
 {
     std::string path(_path);
-    if (unlink((mem_shadow_name + path).c_str()) == 0)
+    int err = wait_for_backlog(false);
+    if (err != 0)
+        return err;
+    if (unlink(shadow_path(mem_shadow_name, path).c_str()) == 0)
     {
-        bkg_call([](std::string path)
+        forget_lazy(path);
+        if (pbmemfs_journal)
+        {
+            journal_op_then(journal_record(journal_unlink, path), file_unlinked, path);
+            return 0;
+        }
+        close_path_updates(path);
+        bkg_call_on(shard_for(path), lane_meta, [](std::string path)
             {
-                if (unlink(path.c_str()) != 0)
-                    fprintf(stderr, "unlink(%s) failed with errno: %d\n", path.c_str(), errno);
+                if (unlink(shadow_path(html5_shadow_name, path).c_str()) != 0)
+                    fprintf(stderr, "unlink(%s) failed with errno: %d\n", (html5_shadow_name + path).c_str(), errno);
+                file_unlinked(path);
             },
-            html5_shadow_name + path);
+            path);
         return 0;
     }
     return -errno;
@@ -553,16 +3767,55 @@ int pbmemfs_unlink(const char* _path)
 int pbmemfs_write(const char* path, const char* buf, size_t count, off_t pos,
               struct fuse_file_info* finfo)
 {
+    int err = wait_for_backlog(true);
+    if (err != 0)
+        return err;
     int ret = pwrite(get_fd(finfo), buf, count, pos);
-    if (ret != -1)
-        bkg_call([](file_ref* fr, std::vector<char> buf, off_t pos)
+    file_ref* fr = get_fr(finfo);
+    if (ret > 0)
+        fr->changes_.fetch_add(1, std::memory_order_release);
+    if (ret > 0 && fr->memfs_rd_fd_ != -1)
+    {
+        // O_APPEND writes land at the end of the file, whatever 'pos' says
+        if (fr->append_)
+        {
+            struct stat st;
+            if (fstat(fr->memfs_fd_, &st) == 0)
+                pos = st.st_size - ret;
+        }
+        if (add_dirty(fr, pos, pos + ret) >= flush_threshold_bytes)
+            bkg_call_on(fr->shard_, lane_data, flush_dirty, fr);
+    }
+    else if (ret > 0 && pbmemfs_journal)
+    {
+        backlog_bytes.fetch_add(ret);
+        bkg_call_on(fr->shard_, lane_meta, [](file_ref* fr, std::vector<char> buf, off_t pos)
+            {
+                backlog_bytes.fetch_sub(buf.size());
+                if (fr->path_.empty())
+                    return;
+                auto rec = begin_record(journal_buf, journal_write);
+                put_field(journal_buf, fr->path_);
+                put_field(journal_buf, (int64_t)pos);
+                journal_buf.insert(journal_buf.end(), buf.begin(), buf.end());
+                end_record(journal_buf, rec);
+                manifest_changing();
+            },
+            fr, std::vector<char>(buf,&buf[ret]), pos);
+    }
+    else if (ret != -1)
+    {
+        backlog_bytes.fetch_add(ret);
+        bkg_call_on(fr->shard_, lane_meta, [](file_ref* fr, std::vector<char> buf, off_t pos)
             {
                 int ret;
-                if ((ret = pwrite(fr->html5fs_fd_, &buf.front(), buf.size(), pos)) != buf.size())
+                if ((ret = pwrite(fr->html5fs_fd_, &buf.front(), buf.size(), pos)) != (int)buf.size())
                     fprintf(stderr, "pwrite(%d, %p, %d, %d) returned unexpected value (%d instead of %d), errno: %d\n",
                             fr->html5fs_fd_, &buf.front(), (int)buf.size(), (int)pos, ret, (int)buf.size(), errno);
+                backlog_bytes.fetch_sub(buf.size());
             },
-            get_fr(finfo), std::vector<char>(buf,&buf[ret]), pos);
+            fr, std::vector<char>(buf,&buf[ret]), pos);
+    }
     return ret;
 }
 
@@ -634,103 +3887,694 @@ struct fuse_operations pbmemfs_ops = {
     0,                  // lock
     pbmemfs_utimens
 
-#endif
+#endif
+
+};
+
+// copy the contents of 'from' to 'to'.  'to' is sized up front and then filled
+// with reads of up to file_cp_buffer_bytes (the whole file, when it is small)
+const size_t file_cp_buffer_bytes = 1024 * 1024;
+
+void file_cp(const char *to, const char *from)
+{
+    auto from_f = open(from, O_RDONLY);
+    if (from_f == -1)
+    {
+        fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", from, errno);
+        return;
+    }
+    
+    struct stat st;
+    if (fstat(from_f, &st) != 0)
+    {
+        fprintf(stderr, "fstat(%d, %p) failed with errno: %d\n", from_f, &st, errno);
+        close(from_f);
+        return;
+    }
+    
+    auto to_f = open(to, O_CREAT | O_WRONLY, 0666);
+    if (to_f == -1)
+    {
+        fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY) failed with errno: %d\n", to, errno);
+        close(from_f);
+        return;
+    }
+    if (st.st_size > 0 && ftruncate(to_f, st.st_size) != 0)
+        fprintf(stderr, "ftruncate(%d, %d) failed with errno: %d\n", to_f, (int)st.st_size, errno);
+    
+    // one per thread, since several threads copy files at start up (see do_sync)
+    static thread_local std::vector<char> buf;
+    buf.resize(std::min<size_t>(std::max<off_t>(st.st_size, 4096), file_cp_buffer_bytes));
+    off_t pos = 0;
+    while (true)
+    {
+        auto nread = read(from_f, &buf[0], buf.size());
+        if (nread == 0)
+            break;
+        if (nread == -1)
+        {
+            fprintf(stderr, "read(%d, %p, %d) failed with errno: %d\n", from_f, &buf[0], (int)buf.size(), errno);
+            break;
+        }
+        ssize_t written = 0;
+        while (written < nread)
+        {
+            auto bytes = pwrite(to_f, &buf[written], nread - written, pos + written);
+            if (bytes == -1)
+            {
+                fprintf(stderr, "pwrite(%d, %p, %d, %d) failed with errno: %d\n", to_f, &buf[written], (int)(nread - written), (int)(pos + written), errno);
+                break;
+            }
+            written += bytes;
+        }
+        pos += written;
+        if (written < nread)
+            break;
+    }
+    
+    // the file may have been shorter than fstat said
+    if (pos != st.st_size && ftruncate(to_f, pos) != 0)
+        fprintf(stderr, "ftruncate(%d, %d) failed with errno: %d\n", to_f, (int)pos, errno);
+    
+    close(to_f);
+    close(from_f);
+    
+    if ((st.st_mode & 0777) != 0666)
+    {
+        if (chmod(to, st.st_mode & 0777) != 0)
+            fprintf(stderr, "chmod(%s, 0%o) failed with errno: %d\n", to, (int)(st.st_mode & O_ACCMODE), errno);
+    }
+    
+    // and the time stamps
+    struct timeval tv[2];
+    tv[0].tv_sec = st.st_atime;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = st.st_mtime;
+    tv[1].tv_usec = 0;
+    if (utimes(to, tv) != 0)
+        fprintf(stderr, "utimes(%s, (timeval)) failed with errno: %d\n", to, errno);
+}
+
+// make /.memfs_shadow/'mem_path' with the given contents, mode and times
+void make_mem_file(const std::string& mem_path, const char* data, size_t size, const struct stat& st)
+{
+    auto fd = open(mem_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, st.st_mode & 0777);
+    if (fd == -1)
+    {
+        fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY | O_TRUNC) failed with errno: %d\n", mem_path.c_str(), errno);
+        return;
+    }
+    size_t written = 0;
+    while (written < size)
+    {
+        auto bytes = write(fd, &data[written], size - written);
+        if (bytes == -1)
+        {
+            fprintf(stderr, "write(%d, %p, %d) failed with errno: %d\n", fd, &data[written], (int)(size - written), errno);
+            break;
+        }
+        written += bytes;
+    }
+    close(fd);
+    
+    struct timeval tv[2];
+    tv[0].tv_sec = st.st_atime;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = st.st_mtime;
+    tv[1].tv_usec = 0;
+    if (utimes(mem_path.c_str(), tv) != 0)
+        fprintf(stderr, "utimes(%s, (timeval)) failed with errno: %d\n", mem_path.c_str(), errno);
+}
+
+// make an empty /.memfs_shadow file standing in for 'path' until it is loaded (see lazy_files)
+void make_placeholder(const std::string& path, const std::string& mem_path, const struct stat& st)
+{
+    make_mem_file(mem_path, 0, 0, st);
+    if (st.st_size != 0)
+    {
+        std::unique_lock<std::mutex> lk(lazy_mtx);
+        lazy_files[path].size_ = st.st_size;
+        lazy_count.fetch_add(1, std::memory_order_release);
+    }
+}
+
+/*
+    start up sync.  Copying /.html5fs_shadow/dirName to /.memfs_shadow/dirName is spread
+    over sync_threads threads, since most of the time goes to waiting for html5fs.  The
+    threads share a queue of directories to walk and files to copy.  Walking a directory
+    adds its subdirectories and files to the queue.
+*/
+const size_t sync_threads = 4;
+
+struct sync_item
+{
+    std::string     path_;      // relative to the shadow directories, no leading '/'
+    bool            is_dir_;
+    struct stat     st_;        // files only
+};
+
+struct sync_job
+{
+    sync_job(mutantspider::persistent_load load)
+        : load_(load),
+          busy_(0),
+          files_(0),
+          bytes_(0)
+    {}
+    
+    mutantspider::persistent_load   load_;
+    std::mutex                      mtx_;
+    std::condition_variable         cnd_;
+    std::vector<sync_item>          items_;
+    size_t                          busy_;      // threads working on an item
+    std::atomic<uint64_t>           files_;
+    std::atomic<uint64_t>           bytes_;
+};
+
+void sync_dir(sync_job* job, const std::string& dirName)
+{
+    std::string html5_dir = html5_shadow_name + "/" + dirName;
+    std::string mem_dir = mem_shadow_name + "/" + dirName;
+    
+    // walk the html5 directory.
+    DIR	*dir;
+    if ((dir = opendir(html5_dir.c_str())) != 0)
+    {
+        std::vector<sync_item> found;
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != 0)
+        {
+            if (strcmp(ent->d_name,".") && strcmp(ent->d_name,".."))
+            {
+                sync_item item;
+                item.path_ = dirName + "/" + ent->d_name;
+                if (stat((html5_dir + "/" + ent->d_name).c_str(), &item.st_) == 0)
+                {
+                    item.is_dir_ = S_ISDIR(item.st_.st_mode);
+                    if (item.is_dir_)
+                        mkdir((mem_dir + "/" + ent->d_name).c_str(),0777);
+                    found.push_back(std::move(item));
+                }
+            }
+        }
+        closedir(dir);
+        
+        if (!found.empty())
+        {
+            std::unique_lock<std::mutex> lk(job->mtx_);
+            for (auto& item : found)
+                job->items_.push_back(std::move(item));
+            job->cnd_.notify_all();
+        }
+    }
+}
+
+void sync_file(sync_job* job, const sync_item& item)
+{
+    std::string mem_path = mem_shadow_name + "/" + item.path_;
+    if (job->load_ != mutantspider::persistent_load_all)
+        make_placeholder("/" + item.path_, mem_path, item.st_);
+    else
+    {
+        // copy the contents
+        file_cp(mem_path.c_str(), (html5_shadow_name + "/" + item.path_).c_str());
+        job->bytes_ += item.st_.st_size;
+    }
+    job->files_++;
+}
+
+// thread proc for the sync threads.  Returns when the queue is empty and no other thread can add to it
+void sync_worker(sync_job* job)
+{
+    std::unique_lock<std::mutex> lk(job->mtx_);
+    while (true)
+    {
+        job->cnd_.wait(lk, [job]{ return !job->items_.empty() || job->busy_ == 0; });
+        if (job->items_.empty())
+            return;
+        auto item = std::move(job->items_.back());
+        job->items_.pop_back();
+        ++job->busy_;
+        lk.unlock();
+        
+        if (item.is_dir_)
+            sync_dir(job, item.path_);
+        else
+            sync_file(job, item);
+        
+        lk.lock();
+        if (--job->busy_ == 0 && job->items_.empty())
+            job->cnd_.notify_all();
+    }
+}
+
+// copy the contents of /.html5fs_shadow/dirName to /.memfs_shadow/dirName (recursively).
+// With persistent_load_on_open only the directories and placeholders for the files are made.
+// Returns the number of files and bytes copied
+std::pair<uint64_t, uint64_t> do_sync(const std::string& dirName, mutantspider::persistent_load load)
+{
+    sync_job job(load);
+    sync_item root;
+    root.path_ = dirName;
+    root.is_dir_ = true;
+    job.items_.push_back(root);
+    
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < sync_threads; i++)
+        threads.push_back(std::thread(sync_worker, &job));
+    sync_worker(&job);
+    for (auto& t : threads)
+        t.join();
+    return std::make_pair(job.files_.load(), job.bytes_.load());
+}
+
+/*
+    manifest.  Walking html5fs at start up costs a round trip to the browser for every
+    directory, file and stat.  So when the background thread has been idle for a while it
+    writes a description of everything under the persistent dirs (from /.memfs_shadow, which
+    then matches /.html5fs_shadow) to a single file, and start up reads that instead.  Small
+    files have their contents in the manifest too, so they don't need to be read separately.
+    
+    Before the background thread changes anything in /.html5fs_shadow it deletes the manifest,
+    so a manifest that exists always describes what is there.  Layout (native byte order):
+    
+        "MSPM" u32 version
+        u32 root count, each: u32 length, path                  the persistent_dirs it covers
+        u32 entry count, each: u8 kind ('d' or 'f'), u32 mode, i64 size, i64 atime, i64 mtime,
+                               u32 length, path (relative to /.html5fs_shadow), u8 packed,
+                               and if packed, 'size' bytes of contents
+*/
+const char      manifest_magic[4] = { 'M', 'S', 'P', 'M' };
+const uint32_t  manifest_version = 1;
+const int64_t   manifest_delay_us = 1000 * 1000;
+const size_t    manifest_pack_file_bytes = 4096;
+const size_t    manifest_pack_total_bytes = 1024 * 1024;
+
+// every worker calls manifest_changing, so these are protected by manifest_mtx.  The manifest
+// itself is only written by shard 0's worker while the html5 gate is closed (and by populate_memfs
+// before the workers start)
+std::mutex                  manifest_mtx;
+std::vector<std::string>    manifest_roots;
+bool                        manifest_current = false;   // the manifest on disk describes /.html5fs_shadow
+bool                        manifest_wanted = false;    // there has been a change since it was last written
+int64_t                     manifest_changed_us = 0;
+
+std::string manifest_name()
+{
+    return html5_shadow_name + "/.pbmemfs_manifest";
+}
+
+// a background thread is about to change /.html5fs_shadow
+void manifest_changing()
+{
+    std::unique_lock<std::mutex> lk(manifest_mtx);
+    if (manifest_current)
+    {
+        if (unlink(manifest_name().c_str()) != 0 && errno != ENOENT)
+            fprintf(stderr, "unlink(%s) failed with errno: %d\n", manifest_name().c_str(), errno);
+        manifest_current = false;
+    }
+    manifest_wanted = true;
+    manifest_changed_us = now_us();
+}
+
+int64_t next_manifest_in_us()
+{
+    std::unique_lock<std::mutex> lk(manifest_mtx);
+    if (!manifest_wanted)
+        return -1;
+    return std::max<int64_t>(0, manifest_changed_us + manifest_delay_us - now_us());
+}
+
+// append the entries for everything under /.memfs_shadow/'dir_name'.  With 'pack_all'
+// every file's contents are included, and false is returned if any can't be read
+bool add_manifest_entries(std::vector<char>& out, uint32_t& count, size_t& packed_bytes, const std::string& dir_name, bool pack_all)
+{
+    std::string mem_dir = mem_shadow_name + "/" + dir_name;
+    DIR	*dir;
+    if ((dir = opendir(mem_dir.c_str())) == 0)
+        return !pack_all;
+    bool ok = true;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != 0)
+    {
+        if (!strcmp(ent->d_name,".") || !strcmp(ent->d_name,".."))
+            continue;
+        std::string path = dir_name + "/" + ent->d_name;
+        std::string mem_path = mem_dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(mem_path.c_str(), &st) != 0)
+            continue;
+        
+        bool is_dir = S_ISDIR(st.st_mode);
+        bool packed = false;
+        if (!is_dir)
+        {
+            std::unique_lock<std::mutex> lk(lazy_mtx);
+            auto it = lazy_files.find("/" + path);
+            if (it != lazy_files.end())
+                st.st_size = it->second.size_;
+            else
+                packed = pack_all || (st.st_size <= (off_t)manifest_pack_file_bytes && packed_bytes + st.st_size <= manifest_pack_total_bytes);
+        }
+        
+        std::vector<char> contents;
+        if (packed)
+        {
+            contents.resize(st.st_size);
+            auto fd = open(mem_path.c_str(), O_RDONLY);
+            packed = fd != -1 && pread(fd, contents.data(), contents.size(), 0) == (ssize_t)contents.size();
+            if (fd != -1)
+                close(fd);
+            if (!packed && pack_all)
+            {
+                ok = false;
+                break;
+            }
+        }
+        
+        put(out, (uint8_t)(is_dir ? 'd' : 'f'));
+        put(out, (uint32_t)st.st_mode);
+        put(out, (int64_t)(is_dir ? 0 : st.st_size));
+        put(out, (int64_t)st.st_atime);
+        put(out, (int64_t)st.st_mtime);
+        put_string(out, path);
+        put(out, (uint8_t)packed);
+        if (packed)
+        {
+            out.insert(out.end(), contents.begin(), contents.end());
+            packed_bytes += contents.size();
+        }
+        ++count;
+        
+        if (is_dir)
+            ok = add_manifest_entries(out, count, packed_bytes, path, pack_all);
+    }
+    closedir(dir);
+    return ok;
+}
+
+// background thread: describe everything in /.memfs_shadow (see "manifest").  Returns false if
+// that can't be done right now because it doesn't match what has been persisted
+bool build_manifest(std::vector<char>& out, bool pack_all)
+{
+    // nothing written since the last flush may still be waiting in memory
+    uint64_t writes;
+    {
+        std::unique_lock<std::mutex> lk(dirty_mtx);
+        if (!dirty_files.empty())
+            return false;
+        writes = dirty_writes;
+    }
+    auto queued = pbmemfs_stats.queued_.load(std::memory_order_acquire);
+    
+    out.insert(out.end(), manifest_magic, manifest_magic + sizeof(manifest_magic));
+    put(out, manifest_version);
+    put(out, (uint32_t)manifest_roots.size());
+    for (auto& root : manifest_roots)
+        put_string(out, root);
+    auto count_pos = out.size();
+    put(out, (uint32_t)0);
+    uint32_t count = 0;
+    size_t packed_bytes = 0;
+    for (auto& root : manifest_roots)
+    {
+        if (!add_manifest_entries(out, count, packed_bytes, root, pack_all))
+            return false;
+    }
+    memcpy(&out[count_pos], &count, sizeof(count));
+    
+    // if anything changed while we were reading /.memfs_shadow, what we read may not match
+    // what has been persisted.  Try again later
+    std::unique_lock<std::mutex> lk(dirty_mtx);
+    return dirty_writes == writes && pbmemfs_stats.queued_.load(std::memory_order_acquire) == queued;
+}
+
+// write 'data' to 'name' by way of a temporary file, so 'name' is either the old or the new contents
+bool replace_file(const std::string& name, const std::vector<char>& data)
+{
+    auto tmp_name = name + ".tmp";
+    auto fd = open(tmp_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1)
+    {
+        fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY | O_TRUNC) failed with errno: %d\n", tmp_name.c_str(), errno);
+        return false;
+    }
+    auto bytes = write(fd, data.data(), data.size());
+    close(fd);
+    if (bytes != (ssize_t)data.size())
+    {
+        fprintf(stderr, "write(%s, %d) returned %d, errno: %d\n", tmp_name.c_str(), (int)data.size(), (int)bytes, errno);
+        unlink(tmp_name.c_str());
+        return false;
+    }
+    if (rename(tmp_name.c_str(), name.c_str()) != 0)
+    {
+        fprintf(stderr, "rename(%s, %s) failed with errno: %d\n", tmp_name.c_str(), name.c_str(), errno);
+        return false;
+    }
+    return true;
+}
+
+std::string checkpoint_name()
+{
+    return html5_shadow_name + "/.pbmemfs_checkpoint";
+}
 
-};
+std::string journal_name()
+{
+    return html5_shadow_name + "/.pbmemfs_journal";
+}
 
-// copy the contents of 'from' to 'to'
-void file_cp(const char *to, const char *from)
+// background thread: persistent_journal's version of write_manifest.  Checkpoints when
+// the journal has grown enough to be worth it (or there is no checkpoint for it yet)
+void write_checkpoint(bool force)
 {
-    auto from_f = open(from, O_RDONLY);
-    if (from_f == -1)
+    bool due = checkpoint_wanted || (journal_size >= journal_checkpoint_bytes && journal_size >= checkpoint_size);
+    if (!due || (!force && next_manifest_in_us() != 0))
+        return;
+    journal_commit();
+    
+    std::vector<char> out;
+    put(out, journal_generation + 1);
+    if (!build_manifest(out, true))
+        return;
+    if (replace_file(checkpoint_name(), out))
     {
-        fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", from, errno);
+        reset_journal(journal_generation + 1);
+        checkpoint_size = out.size();
+        checkpoint_wanted = false;
+    }
+    manifest_wanted = false;
+}
+
+// background thread: write the manifest if there have been changes and things have been quiet
+// for manifest_delay_us (or whenever there have been changes, if 'force')
+void write_manifest(bool force)
+{
+    if (pbmemfs_journal)
+    {
+        write_checkpoint(force);
         return;
     }
+    if (!manifest_wanted || (!force && next_manifest_in_us() != 0))
+        return;
     
-    auto to_f = open(to, O_CREAT | O_WRONLY, 0666);
-    if (to_f == -1)
-    {
-        fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY) failed with errno: %d\n", to, errno);
-        close(from_f);
+    std::vector<char> out;
+    if (!build_manifest(out, false))
+        return;
+    manifest_current = replace_file(manifest_name(), out);
+    manifest_wanted = false;
+}
+
+// shard 0's worker, when it is idle: write the manifest once the other workers are idle too.
+// If one of them is busy, try again after another manifest_delay_us
+void idle_write_manifest()
+{
+    if (next_manifest_in_us() != 0)
         return;
+    bool quiet = close_html5_gate();
+    if (quiet)
+    {
+        if (pbmemfs_stats.completed_.load(std::memory_order_acquire) == pbmemfs_stats.queued_.load(std::memory_order_acquire))
+            write_manifest(false);
+        else
+            quiet = false;
+        open_html5_gate();
+    }
+    if (!quiet)
+    {
+        std::unique_lock<std::mutex> lk(manifest_mtx);
+        manifest_changed_us = now_us();
+    }
+}
+
+// read all of 'name' with one read.  Returns false if it can't be read
+bool read_whole_file(const std::string& name, std::vector<char>& data)
+{
+    auto fd = open(name.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+        data.resize(st.st_size);
+        ok = read(fd, data.data(), data.size()) == (ssize_t)data.size();
+    }
+    close(fd);
+    return ok;
+}
+
+// populate /.memfs_shadow from a manifest, for every dir in 'dirs' that it covers.  Those
+// are removed from 'dirs', so what is left still needs do_sync.  Returns false (leaving 'dirs'
+// alone) if the manifest isn't usable
+bool load_manifest(const char* data, size_t size, std::vector<std::string>& dirs, mutantspider::persistent_load load)
+{
+    byte_reader rd = { data, data + size };
+    uint32_t version, root_count, count;
+    if (size < sizeof(manifest_magic) || memcmp(rd.p_, manifest_magic, sizeof(manifest_magic)) != 0)
+        return false;
+    rd.p_ += sizeof(manifest_magic);
+    if (!rd.get(version) || version != manifest_version || !rd.get(root_count))
+        return false;
+    std::set<std::string> roots;
+    for (uint32_t i = 0; i < root_count; i++)
+    {
+        std::string root;
+        if (!rd.get_string(root))
+            return false;
+        roots.insert(root);
     }
+    if (!rd.get(count))
+        return false;
     
-    while (true)
+    std::vector<std::string> covered, not_covered;
+    for (auto& dir : dirs)
+        (roots.count(dir) ? covered : not_covered).push_back(dir);
+    auto is_covered = [&](const std::string& path)
+        {
+            for (auto& dir : covered)
+            {
+                if (path.compare(0, dir.size() + 1, dir + "/") == 0)
+                    return true;
+            }
+            return false;
+        };
+    
+    for (uint32_t i = 0; i < count; i++)
     {
-        char buf[4096];
-        auto nread = read(from_f, buf, sizeof(buf));
-        if (nread == 0)
-            break;
-        if (nread == -1)
+        uint8_t kind, packed;
+        uint32_t mode;
+        int64_t size, atime, mtime;
+        std::string path;
+        if (!rd.get(kind) || !rd.get(mode) || !rd.get(size) || !rd.get(atime) || !rd.get(mtime)
+                || !rd.get_string(path) || !rd.get(packed) || size < 0 || (packed && (uint64_t)(rd.end_ - rd.p_) < (uint64_t)size))
         {
-            fprintf(stderr, "read(%d, %p, %d) failed with errno: %d\n", from_f, buf, (int)sizeof(buf), errno);
-            return;
+            fprintf(stderr, "manifest is damaged, ignoring it\n");
+            return false;
         }
-        int written = 0;
-        while (written < nread)
+        const char* contents = rd.p_;
+        if (packed)
+            rd.p_ += size;
+        if (!is_covered(path))
+            continue;
+        
+        std::string mem_path = mem_shadow_name + "/" + path;
+        if (kind == 'd')
+            mkdir(mem_path.c_str(),0777);
+        else
         {
-            auto bytes = write(to_f, &buf[written], nread - written);
-            if (bytes == -1)
-            {
-                fprintf(stderr, "write(%d, %p, %d) failed with errno: %d\n", to_f, &buf[written], nread-written, errno);
-                return;
-            }
-            written += bytes;
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = mode;
+            st.st_size = size;
+            st.st_atime = atime;
+            st.st_mtime = mtime;
+            if (packed)
+                make_mem_file(mem_path, contents, size, st);
+            else if (load != mutantspider::persistent_load_all)
+                make_placeholder("/" + path, mem_path, st);
+            else
+                file_cp(mem_path.c_str(), (html5_shadow_name + "/" + path).c_str());
         }
     }
     
-    close(to_f);
-    close(from_f);
-    
-    struct stat st;
-    if (stat(from, &st) != 0)
+    dirs.swap(not_covered);
+    return true;
+}
+
+// persistent_journal start up: load the checkpoint.  Returns the dirs that it doesn't cover,
+// which must be read from /.html5fs_shadow the slow way before replay_journal_file replays
+// the journal on top of everything (after which a checkpoint is needed)
+std::vector<std::string> load_checkpoint(const std::vector<std::string>& persistent_dirs)
+{
+    auto uncovered = persistent_dirs;
+    std::vector<char> data;
+    uint64_t generation = 0;
+    bool have_checkpoint = read_whole_file(checkpoint_name(), data) && data.size() >= sizeof(generation);
+    if (have_checkpoint)
+    {
+        memcpy(&generation, data.data(), sizeof(generation));
+        have_checkpoint = load_manifest(data.data() + sizeof(generation), data.size() - sizeof(generation), uncovered, mutantspider::persistent_load_all);
+        if (have_checkpoint)
+            checkpoint_size = data.size();
+        else
+            generation = 0;
+    }
+    journal_generation = generation;
+    checkpoint_wanted = !have_checkpoint || !uncovered.empty();
+    return uncovered;
+}
+
+// persistent_journal start up, once load_checkpoint and do_sync have filled /.memfs_shadow:
+// replay the journal if it carries on from the checkpoint, or from nothing when there isn't
+// one yet.  Until the first checkpoint the journal is all there is of what was written
+void replay_journal_file()
+{
+    journal_fd = open(journal_name().c_str(), O_RDWR | O_CREAT, 0666);
+    if (journal_fd == -1)
     {
-        fprintf(stderr, "stat(%s, %p) failed with errno: %d\n", from, &st, errno);
+        fprintf(stderr, "open(\"%s\", O_RDWR | O_CREAT) failed with errno: %d\n", journal_name().c_str(), errno);
         return;
     }
-    if ((st.st_mode & 0777) != 0666)
+    
+    std::vector<char> data;
+    uint32_t version = 0;
+    uint64_t journal_gen = ~(uint64_t)0;
+    size_t good = 0;
+    if (read_whole_file(journal_name(), data) && data.size() >= journal_header_bytes
+            && memcmp(data.data(), journal_magic, sizeof(journal_magic)) == 0)
     {
-        if (chmod(to, st.st_mode & 0777) != 0)
-            fprintf(stderr, "chmod(%s, 0%o) failed with errno: %d\n", to, (int)(st.st_mode & O_ACCMODE), errno);
+        memcpy(&version, &data[4], sizeof(version));
+        memcpy(&journal_gen, &data[8], sizeof(journal_gen));
+    }
+    if (version == journal_version && journal_gen == journal_generation)
+        good = journal_header_bytes + replay_journal(data.data() + journal_header_bytes, data.size() - journal_header_bytes);
+    
+    if (good == 0)
+        reset_journal(journal_generation);
+    else
+    {
+        // drop whatever was partly written when we last stopped
+        if (good < data.size() && ftruncate(journal_fd, good) != 0)
+            fprintf(stderr, "ftruncate(%d, %d) failed with errno: %d\n", journal_fd, (int)good, errno);
+        journal_size = good;
     }
 }
 
-// copy the contents of /.html5fs_shadow/dirName to /.memfs_shadow/dirName (recursively)
-void do_sync(const std::string& dirName)
+// PostCommand from the thread running populate_memfs
+void post_startup_command(MS_AppInstance* inst, const std::string& cmd)
 {
-    std::string html5_dir = html5_shadow_name + "/" + dirName;
-    std::string mem_dir = mem_shadow_name + "/" + dirName;
-    
-    // walk the html5 directory.
-    DIR	*dir;
-    if ((dir = opendir(html5_dir.c_str())) != 0)
-    {
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != 0)
+#if defined(MUTANTSPIDER_HOST)
+    // the component's code runs on the host event loop's thread, not this one
+    mutantspider::CallOnMainThread(0, mutantspider::make_callback([inst, cmd](int32_t)
         {
-            if (strcmp(ent->d_name,".") && strcmp(ent->d_name,".."))
-            {
-                std::string html5_path = html5_dir + "/" + ent->d_name;
-                std::string mem_path = mem_dir + "/" + ent->d_name;
-                struct stat st;
-                if (stat(html5_path.c_str(),&st) == 0)
-                {
-                    if (S_ISDIR(st.st_mode))
-                    {
-                        mkdir(mem_path.c_str(),0777);
-                        do_sync(dirName + "/" + ent->d_name);
-                    }
-                    else
-                    {
-                        // copy the contents
-                        file_cp(mem_path.c_str(),html5_path.c_str());
-                    }
-                }
-            }
-        }
-        closedir(dir);
-    }
+            inst->PostCommand(cmd.c_str());
+        }));
+#else
+    inst->PostCommand(cmd.c_str());
+#endif
 }
 
 // assumes that the target directory is currently empty, and
@@ -739,19 +4583,56 @@ void do_sync(const std::string& dirName)
 // /.html5fs_shadow is one of nacl's html5fs mounts, which can
 // only be read from (or written to) from a non-main thread (while the
 // main thread is not blocked, waiting for this to complete)
-void populate_memfs(MS_AppInstance* inst, std::vector<std::string> persistent_dirs)
+void populate_memfs(MS_AppInstance* inst, std::vector<std::string> persistent_dirs, mutantspider::persistent_load load)
 {
+    // the journal's checkpoint holds the contents of every file, there is nothing to load lazily
+    if (pbmemfs_journal)
+        load = mutantspider::persistent_load_all;
+    lazy_prefetch = load == mutantspider::persistent_load_on_open_prefetch;
+    manifest_roots = persistent_dirs;
     for (auto dir : persistent_dirs)
     {
         mkdir_p(html5_shadow_name + "/" + dir);
         mkdir_p(mem_shadow_name + "/" + dir);
-        do_sync(dir);
     }
+    
+    // anything the manifest (or journal) doesn't cover is read the slow way, after which
+    // the manifest (or a checkpoint) needs to be written
+    std::vector<std::string> uncovered;
+    if (pbmemfs_journal)
+        uncovered = load_checkpoint(persistent_dirs);
+    else
+    {
+        std::vector<char> data;
+        uncovered = persistent_dirs;
+        manifest_current = read_whole_file(manifest_name(), data) && load_manifest(data.data(), data.size(), uncovered, load);
+    }
+    for (auto dir : uncovered)
+    {
+        auto copied = do_sync(dir, load);
+        post_startup_command(inst, "async_startup_progress:" + std::to_string(copied.first) + ":" + std::to_string(copied.second) + ":" + dir);
+    }
+    if (pbmemfs_journal)
+        replay_journal_file();
+    if (!uncovered.empty() || checkpoint_wanted)
+        manifest_changing();
    
+#if defined(MUTANTSPIDER_HOST)
+    // the component's code runs on the host event loop's thread, not this one
+    mutantspider::CallOnMainThread(0, mutantspider::CompletionCallback([](void* inst, int32_t)
+        {
+            static_cast<MS_AppInstance*>(inst)->AsyncStartupComplete();
+            static_cast<MS_AppInstance*>(inst)->PostCommand("async_startup_complete:");
+        }, inst));
+#else
     inst->AsyncStartupComplete();
     inst->PostCommand("async_startup_complete:");
+#endif
     
-    pbmemfs_worker();   // note, this never returns
+    // this thread becomes shard 0's worker
+    for (size_t i = 1; i < pbmemfs_shard_count; i++)
+        std::thread(pbmemfs_worker, i).detach();
+    pbmemfs_worker(0);  // note, this never returns
 }
 
 //#define _do_clear_
@@ -815,31 +4696,6 @@ void clear_all()
 
 #if defined(MUTANTSPIDER_HAS_RESOURCES)
 
-const mutantspider::rez_dir_ent* get_dir_ent(const std::string& path,const mutantspider::rez_dir* dir)
-{
-    // path always starts with a '/'
-    
-    auto pos = path.find("/",1);
-    auto d_name = path.substr(1,pos == std::string::npos ? path.length() - 1 : pos - 1);
-    for (size_t i = 0; i < dir->num_ents; i++)
-    {
-        if (d_name == dir->ents[i].d_name)
-        {
-            if (pos == std::string::npos)
-                return &dir->ents[i];
-            if (dir->ents[i].is_dir != 0)
-                return get_dir_ent(path.substr(pos, path.length() - pos), dir->ents[i].ptr.dir);
-            return 0;
-        }
-    }
-    return 0;
-}
-
-const mutantspider::rez_dir_ent* get_dir_ent(const std::string& path)
-{
-    return path == "/" ? &mutantspider::rez_root_dir_ent : get_dir_ent(path, &mutantspider::rez_root_dir);
-}
-
 // Called when a filesystem of this type is initialized.
 void* rezfs_init(struct fuse_conn_info* conn)
 {
@@ -958,8 +4814,7 @@ struct rez_dir_iter
     
 
 // Called by getdents(), which is called by the more standard functions
-// opendir()/readdir().  NaCl's fuse implementation calls our rezfs_readdir
-// once for each file/dir being enumerated.
+// opendir()/readdir().  See pbmemfs_opendir.
 int rezfs_opendir(const char* path, struct fuse_file_info* finfo)
 {
     if (finfo->fh == 0)
@@ -986,21 +4841,19 @@ int rezfs_read(const char* path, char* buf, size_t count, off_t pos,
              struct fuse_file_info* finfo)
 {
     const mutantspider::rez_dir_ent* ent = reinterpret_cast<const mutantspider::rez_dir_ent*>(finfo->fh);
-    if ((size_t)pos > ent->ptr.file->file_data_sz)
-        pos = (off_t)ent->ptr.file->file_data_sz;
-    size_t mx_count = ent->ptr.file->file_data_sz - (size_t)pos;
-    if (count > mx_count)
-        count = mx_count;
-    memcpy(buf, &ent->ptr.file->file_data[pos], count);
-    return (int)count;
+    return read_rez_file(ent->ptr.file, buf, count, (size_t)pos);
 }
 
 // (big, long comment from fuse.h omitted)
+// Like pbmemfs_readdir, fills in entries until the caller's buffer is full and
+// resumes from 'pos'.  "." and ".." are index_ -2 and -1, and each entry's
+// offset is index_+3, so the entry after the one with offset 'pos' is pos-2.
 int rezfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t pos,
                 struct fuse_file_info* finfo)
 {
     rez_dir_iter* it = reinterpret_cast<rez_dir_iter*>(finfo->fh);
-    if (it->index_ < (int)it->dir_->num_ents)
+    it->index_ = pos <= 0 ? -2 : (int)pos - 2;
+    while (it->index_ < (int)it->dir_->num_ents)
     {
         bool        is_dir;
         const char* d_name;
@@ -1035,8 +4888,9 @@ int rezfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t po
         else
             st.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
         
+        if ((*filldir)(buf, d_name, &st, it->index_ + 3) != 0)
+            break;
         ++it->index_;
-        (*filldir)(buf, d_name, &st, pos);
     }
     return 0;
 }
@@ -1181,10 +5035,56 @@ struct fuse_operations rezfs_ops = {
 
 }
 
+#if defined(MUTANTSPIDER_HOST)
+
+namespace {
+
+int rm_entry(const char* path, const struct stat*, int, struct FTW*)
+{
+    return remove(path);
+}
+
+// mem_shadow_name is a real directory on the host, so remove it on exit
+void remove_mem_shadow()
+{
+    nftw(mem_shadow_name.c_str(), rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// unlike nacl, host processes exit.  Let the background threads finish mirroring
+// whatever is queued, and then stop them before any of their data is destroyed.
+void stop_pbmemfs_worker()
+{
+    std::promise<void> done;
+    auto barrier = std::make_shared<pbmemfs_barrier>([&done]
+        {
+            journal_commit();
+            write_manifest(true);
+            done.set_value();
+        });
+    {
+        std::unique_lock<std::mutex> lk(pbmemfs_barrier_mtx);
+        for (size_t i = 0; i < pbmemfs_shard_count; i++)
+            bkg_call_on(i, lane_meta, [](size_t shard, const std::shared_ptr<pbmemfs_barrier>& barrier)
+                {
+                    flush_aged_files(shard, true);
+                    barrier->arrive();
+                    pthread_exit(0);
+                },
+                i, barrier);
+    }
+    done.get_future().wait();
+}
+
+}
+
+#endif
+
 namespace mutantspider
 {
     
-void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs)
+#if defined(__native_client__)
+
+void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs, persistent_load load, persistent_store store)
 {
     nacl_io_init_ppapi(inst->pp_instance(), pp::Module::Get()->get_browser_interface());
     
@@ -1192,6 +5092,7 @@ void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_di
     mount("", "/", "memfs", 0, "");
     
     #if defined(MUTANTSPIDER_HAS_RESOURCES)
+    rez_pack_inst = inst;
     nacl_io_register_fs_type("rez_fs", &rezfs_ops);
     mount("", "/resources", "rez_fs", 0, "");
     #endif
@@ -1212,16 +5113,195 @@ void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_di
         return;
         #endif
         
+        pbmemfs_journal = store == persistent_journal;
+        make_pbmemfs_shards();
         mount("", persistent_name.c_str(), "persist_backed_mem_fs", 0, "");
         
-        std::thread(std::bind(populate_memfs,inst,persistent_dirs)).detach();
+        std::thread(std::bind(populate_memfs,inst,persistent_dirs,load)).detach();
+    }
+}
+
+#else
+
+/*
+    host version.  The host directory host::fs_root() plays the part of the browser's
+    html5fs storage, and a temporary directory (in /dev/shm when there is one) plays
+    the part of nacl's memfs.
+*/
+void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs, persistent_load load, persistent_store store)
+{
+    #if defined(MUTANTSPIDER_HAS_RESOURCES)
+    rez_pack_inst = inst;
+    if (ms_host_io_mount("/resources", &rezfs_ops) != 0)
+        fprintf(stderr, "ms_host_io_mount(\"/resources\") failed, errno: %d\n", errno);
+    #endif
+    
+    if (persistent_dirs.empty())
+    {
+        inst->AsyncStartupComplete();
+        inst->PostCommand("async_startup_complete:");
+    }
+    else
+    {
+        // nacl_io has no umask, and the component expects the modes it asks for
+        // to be the ones it gets (and the ones that are stored)
+        umask(0);
+        
+        pbmemfs_journal = store == persistent_journal;
+        make_pbmemfs_shards();
+        html5_shadow_name = host::fs_root();
+        mkdir_p(html5_shadow_name);
+        
+        char tmpl[] = "/dev/shm/ms_memfs_XXXXXX";
+        char tmpl2[] = "/tmp/ms_memfs_XXXXXX";
+        const char* shadow = mkdtemp(tmpl);
+        if (!shadow)
+            shadow = mkdtemp(tmpl2);
+        if (!shadow)
+        {
+            fprintf(stderr, "mkdtemp failed, errno: %d\n", errno);
+            inst->PostCommand("async_startup_failed:unable to create memfs shadow directory");
+            return;
+        }
+        mem_shadow_name = shadow;
+        
+        // atexit functions run in reverse order, so the worker is stopped first
+        atexit(remove_mem_shadow);
+        atexit(stop_pbmemfs_worker);
+        
+        if (ms_host_io_mount(persistent_name.c_str(), &pbmemfs_ops) != 0)
+            fprintf(stderr, "ms_host_io_mount(\"%s\") failed, errno: %d\n", persistent_name.c_str(), errno);
+        
+        std::thread(std::bind(populate_memfs,inst,persistent_dirs,load)).detach();
+    }
+}
+
+#endif
+
+persistent_stats get_persistent_stats()
+{
+    persistent_stats stats;
+    stats.ops_queued = pbmemfs_stats.queued_.load(std::memory_order_relaxed);
+    stats.ops_completed = pbmemfs_stats.completed_.load(std::memory_order_relaxed);
+    stats.queue_depth = (uint32_t)(stats.ops_queued - std::min(stats.ops_queued, stats.ops_completed));
+    stats.max_queue_depth = pbmemfs_stats.max_depth_.load(std::memory_order_relaxed);
+    stats.last_latency_us = pbmemfs_stats.last_latency_us_.load(std::memory_order_relaxed);
+    stats.max_latency_us = pbmemfs_stats.max_latency_us_.load(std::memory_order_relaxed);
+    stats.total_latency_us = pbmemfs_stats.total_latency_us_.load(std::memory_order_relaxed);
+    stats.batches = pbmemfs_stats.batches_.load(std::memory_order_relaxed);
+    stats.ops_elided = pbmemfs_stats.elided_.load(std::memory_order_relaxed);
+    stats.files_not_loaded = (uint32_t)lazy_count.load(std::memory_order_relaxed);
+    stats.cache_hits = cache_hits.load(std::memory_order_relaxed);
+    stats.cache_misses = cache_misses.load(std::memory_order_relaxed);
+    stats.fds_reused = html5_fds_reused.load(std::memory_order_relaxed);
+    {
+        std::unique_lock<std::mutex> lk(cache_mtx);
+        stats.cache_bytes = cache_bytes;
+    }
+    return stats;
+}
+
+void set_persistent_cache(uint64_t min_file_size, uint64_t budget_bytes)
+{
+    cache_min_file_size = min_file_size;
+    cache_budget_bytes = budget_bytes;
+}
+
+void flush_persistent(const CompletionCallback& callback)
+{
+    if (pbmemfs_shards == 0)
+    {
+        CallOnMainThread(0, callback, 0);
+        return;
+    }
+    
+    // like stop_pbmemfs_worker, but the workers carry on afterwards
+    auto barrier = std::make_shared<pbmemfs_barrier>([callback]
+        {
+            if (pbmemfs_journal)
+                journal_sync();
+            CallOnMainThread(0, callback, 0);
+        });
+    std::unique_lock<std::mutex> lk(pbmemfs_barrier_mtx);
+    for (size_t i = 0; i < pbmemfs_shard_count; i++)
+        bkg_call_on(i, lane_meta, [](size_t shard, const std::shared_ptr<pbmemfs_barrier>& barrier)
+            {
+                flush_aged_files(shard, true);
+                if (!pbmemfs_journal)
+                    sync_html5_fds(shard);
+                barrier->arrive();
+            },
+            i, barrier);
+}
+
+void set_persistent_backlog_limit(uint64_t max_bytes, uint64_t max_ops)
+{
+    backlog_limit_bytes = max_bytes;
+    backlog_limit_ops = max_ops;
+    // raising a limit can let waiting writers go
+    std::unique_lock<std::mutex> lk(backlog_mtx);
+    backlog_cnd.notify_all();
+}
+
+persistent_backlog get_persistent_backlog()
+{
+    persistent_backlog backlog;
+    backlog.bytes = backlog_bytes.load(std::memory_order_relaxed);
+    auto queued = pbmemfs_stats.queued_.load(std::memory_order_relaxed);
+    backlog.ops = queued - std::min(queued, pbmemfs_stats.completed_.load(std::memory_order_relaxed));
+    backlog.max_bytes = backlog_limit_bytes.load(std::memory_order_relaxed);
+    backlog.max_ops = backlog_limit_ops.load(std::memory_order_relaxed);
+    backlog.waits = backlog_waits.load(std::memory_order_relaxed);
+    backlog.rejects = backlog_rejects.load(std::memory_order_relaxed);
+    return backlog;
+}
+
+// if 'path' is 'mount_point' or inside it, the rest of it ("/" for the mount point itself)
+static const char* path_in_mount(const std::string& path, const std::string& mount_point)
+{
+    if (path.compare(0, mount_point.size(), mount_point) != 0)
+        return 0;
+    if (path.size() == mount_point.size())
+        return "/";
+    return path[mount_point.size()] == '/' ? &path[mount_point.size()] : 0;
+}
+
+int scan_dir(const std::string& _path, dir_scan& scan)
+{
+    scan.entries.clear();
+    scan.names.clear();
+    auto path = _path;
+    while (path.size() > 1 && path[path.size() - 1] == '/')
+        path.resize(path.size() - 1);
+    
+    #if defined(MUTANTSPIDER_HAS_RESOURCES)
+    if (auto rel = path_in_mount(path, "/resources"))
+    {
+        auto ent = get_dir_ent(rel);
+        if (!ent)
+            return ENOENT;
+        if (!ent->is_dir)
+            return ENOTDIR;
+        auto dir = ent->ptr.dir;
+        for (size_t i = 0; i < dir->num_ents; i++)
+        {
+            struct stat st;
+            rezfs_setattr(&dir->ents[i], &st);
+            add_scan_entry(scan, dir->ents[i].d_name, st);
+        }
+        return 0;
     }
+    #endif
+    
+    if (auto rel = path_in_mount(path, persistent_name))
+        return scan_mem_dir(rel, scan, false);
+    return scan_real_dir(path, scan, false);
 }
 
 // end of namespace mutantspider
 }
 
-// #if defined(__native_client__)
+// #if defined(__native_client__) || defined(MUTANTSPIDER_HOST)
 #endif
 
 #if defined(EMSCRIPTEN)
@@ -1229,9 +5309,10 @@ void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_di
 namespace mutantspider
 {
     
-void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs)
+void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_dirs, persistent_load load, persistent_store store)
 {
     #if defined(MUTANTSPIDER_HAS_RESOURCES)
+    rez_pack_inst = inst;
     mkdir("/resources", 0777);
     ms_rez_mount("/resources", &rez_root_dir);
     #endif
@@ -1249,12 +5330,62 @@ void init_fs(MS_AppInstance* inst, const std::vector<std::string>& persistent_di
             mkdir_p(path);
             ms_persist_mount(path.c_str());
         }
+        // IDBFS only loads whole mounts, so 'load' is always treated as persistent_load_all, and
+        // library_pbmemfs.js writes each file to its own IndexedDB entry, so 'store' is ignored
         ms_syncfs_from_persistent();
     }
 }
 
+// the asm.js /persistent code (library_pbmemfs.js) writes to IndexedDB directly, there is no queue to report on
+persistent_stats get_persistent_stats()
+{
+    persistent_stats stats = persistent_stats();
+    return stats;
+}
+
+// asm.js builds always hold every /persistent file in memory
+void set_persistent_cache(uint64_t min_file_size, uint64_t budget_bytes)
+{
+}
+
+// library_pbmemfs.js starts an IndexedDB transaction for each change as it happens, and
+// there is nothing here that tracks them, so this only defers the callback the same way
+void flush_persistent(const CompletionCallback& callback)
+{
+    CallOnMainThread(0, callback, 0);
+}
+
+// nothing is queued in asm.js builds, so there is nothing to cap
+void set_persistent_backlog_limit(uint64_t max_bytes, uint64_t max_ops)
+{
+}
+
+persistent_backlog get_persistent_backlog()
+{
+    persistent_backlog backlog = persistent_backlog();
+    return backlog;
+}
+
+// emscripten's readdir and stat are plain function calls, so there's nothing to gain from going around them
+int scan_dir(const std::string& path, dir_scan& scan)
+{
+    scan.entries.clear();
+    scan.names.clear();
+    return scan_real_dir(path, scan, false);
+}
+
 // end of namespace mutantspider
 }
 
+#if defined(MUTANTSPIDER_HAS_RESOURCES)
+
+// library_rezfs.js reads compressed resources through this (see read_rez_file)
+extern "C" int MS_RezRead(const mutantspider::rez_file_ent* file, char* buf, size_t count, size_t pos)
+{
+    return read_rez_file(file, buf, count, pos);
+}
+
+#endif
+
 // #if defined(EMSCRIPTEN)
 #endif
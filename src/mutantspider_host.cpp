@@ -0,0 +1,634 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "mutantspider_host.h"
+
+#if defined(MUTANTSPIDER_HOST)
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+    native implementations of the functions that library_mutantspider.js implements
+    for emscripten builds.  Where there is a choice, these try to behave the way
+    mutantspider.js behaves -- for example, completion callbacks are always
+    asynchronous even when the result is known immediately.
+*/
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+struct timed_callback
+{
+    clock_type::time_point  due_;
+    uint64_t                seq_;
+    void                    (*proc_)(void*, int32_t);
+    void*                   user_data_;
+    int32_t                 result_;
+
+    // std::priority_queue puts the "largest" one on top.  We want the
+    // earliest due time there, and FIFO order for equal due times
+    bool operator<(const timed_callback& other) const
+    {
+        if (due_ != other.due_)
+            return due_ > other.due_;
+        return seq_ > other.seq_;
+    }
+};
+
+std::priority_queue<timed_callback> callback_queue;
+uint64_t                            callback_seq = 0;
+std::mutex                          callback_mtx;
+std::condition_variable             callback_cnd;
+
+std::atomic<bool>                   startup_done(false);
+std::atomic<std::thread::id>        main_thread_id;     // the last thread to call run_once
+
+void default_message_handler(const char* msg, void*)
+{
+    printf("%s\n", msg);
+    fflush(stdout);
+}
+
+mutantspider::host::message_handler msg_handler = default_message_handler;
+void*                               msg_handler_data = 0;
+
+// the two surfaces.  The back buffer is what ms_back_buffer_clear and
+// ms_stretch_blit_pixels draw into, ms_paint_back_buffer copies it to
+// the front buffer.
+std::vector<uint32_t>               back_pixels;
+std::vector<uint32_t>               front_pixels;
+int                                 surface_width = 0;
+int                                 surface_height = 0;
+std::atomic<uint64_t>               frames(0);
+
+struct http_request
+{
+    http_request() : read_pos_(0), size_(0), has_data_(false) {}
+
+    std::vector<char>   data_;
+    size_t              read_pos_;
+    size_t              size_;
+    bool                has_data_;
+};
+
+std::map<int, http_request>         http_requests;
+int                                 http_request_index = 1;
+
+std::string env_or(const char* name, const char* def)
+{
+    auto v = getenv(name);
+    return v && *v ? v : def;
+}
+
+std::string& url_root()
+{
+    static std::string root = env_or("MS_HOST_URL_ROOT", ".");
+    return root;
+}
+
+std::string& fs_root_dir()
+{
+    static std::string root = env_or("MS_HOST_FS_ROOT", "ms_host_fs");
+    return root;
+}
+
+// "http://host/a/b.txt?x=1" -> url_root() + "/a/b.txt"
+std::string url_to_path(const char* url)
+{
+    std::string u(url);
+    auto pos = u.find("://");
+    if (pos != std::string::npos)
+    {
+        pos = u.find('/', pos + 3);
+        u = pos == std::string::npos ? std::string("/") : u.substr(pos);
+    }
+    pos = u.find_first_of("?#");
+    if (pos != std::string::npos)
+        u.erase(pos);
+    if (u.empty() || u[0] != '/')
+        u = "/" + u;
+    return url_root() + u;
+}
+
+bool read_file(const std::string& path, std::vector<char>* data)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+    data->resize(st.st_size);
+    size_t total = 0;
+    while (total < data->size())
+    {
+        auto bytes = read(fd, &(*data)[total], data->size() - total);
+        if (bytes <= 0)
+            break;
+        total += bytes;
+    }
+    close(fd);
+    data->resize(total);
+    return true;
+}
+
+// bytes 'first' through 'last' (inclusive, like a Range header) of the file at 'path'.  Fails if they aren't all there
+bool read_file_range(const std::string& path, size_t first, size_t last, std::vector<char>* data)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    data->resize(last + 1 - first);
+    bool ok = pread(fd, &(*data)[0], data->size(), (off_t)first) == (ssize_t)data->size();
+    close(fd);
+    return ok;
+}
+
+// the range in a "Range: bytes=first-last" line of 'headers', the only form of Range the host supports
+bool parse_range(const char* headers, size_t* first, size_t* last)
+{
+    const char* range = headers ? strstr(headers, "Range: bytes=") : 0;
+    unsigned long long f, l;
+    if (!range || sscanf(range, "Range: bytes=%llu-%llu", &f, &l) != 2 || l < f)
+        return false;
+    *first = (size_t)f;
+    *last = (size_t)l;
+    return true;
+}
+
+template<typename T>
+void put(std::vector<uint8_t>* msg, T val)
+{
+    auto pos = msg->size();
+    msg->resize(pos + sizeof(T));
+    memcpy(&(*msg)[pos], &val, sizeof(T));
+}
+
+void put_bytes(std::vector<uint8_t>* msg, const void* bytes, size_t len)
+{
+    put(msg, (uint32_t)len);
+    msg->insert(msg->end(), (const uint8_t*)bytes, (const uint8_t*)bytes + len);
+}
+
+// a malloc'd copy of an array buffer's data, listed in the message's block table
+struct message_block
+{
+    uint32_t    len;
+    void*       data;
+};
+
+// append 'var' to 'msg' in the encoding MS_MessageProc expects (see mutantspider.cpp),
+// adding the data of any array buffers to 'blocks'
+void encode_var(const mutantspider::Var& var, std::vector<uint8_t>* msg, std::vector<message_block>* blocks)
+{
+    if (var.is_null())
+        put(msg, (uint8_t)MS_VARTYPE_NULL);
+    else if (var.is_bool())
+    {
+        put(msg, (uint8_t)MS_VARTYPE_BOOL);
+        put(msg, (uint8_t)var.AsBool());
+    }
+    else if (var.is_int())
+    {
+        put(msg, (uint8_t)MS_VARTYPE_INT32);
+        put(msg, var.AsInt());
+    }
+    else if (var.is_double())
+    {
+        put(msg, (uint8_t)MS_VARTYPE_DOUBLE);
+        put(msg, var.AsDouble());
+    }
+    else if (var.is_string())
+    {
+        auto str = var.AsString();
+        put(msg, (uint8_t)MS_VARTYPE_STRING);
+        put_bytes(msg, str.data(), str.size());
+    }
+    else if (var.is_array())
+    {
+        mutantspider::VarArray arr(var);
+        put(msg, (uint8_t)MS_VARTYPE_ARRAY);
+        put(msg, arr.GetLength());
+        for (uint32_t i = 0; i < arr.GetLength(); i++)
+            encode_var(arr.Get(i), msg, blocks);
+    }
+    else if (var.is_dictionary())
+    {
+        mutantspider::VarDictionary dict(var);
+        mutantspider::VarArray keys(dict.GetKeys());
+        put(msg, (uint8_t)MS_VARTYPE_DICTIONARY);
+        put(msg, keys.GetLength());
+        for (uint32_t i = 0; i < keys.GetLength(); i++)
+        {
+            auto key = keys.Get(i).AsString();
+            put_bytes(msg, key.data(), key.size());
+            encode_var(dict.Get(key.c_str()), msg, blocks);
+        }
+    }
+    else if (var.is_array_buffer())
+    {
+        // like send_command, hand over a malloc'd copy that the component will own
+        mutantspider::VarArrayBuffer ab(var);
+        auto len = ab.ByteLength();
+        void* data = malloc(len ? len : 1);
+        memcpy(data, ab.Map(), len);
+        put(msg, (uint8_t)MS_VARTYPE_ARRAY_BUFFER);
+        put(msg, (uint32_t)blocks->size());
+        blocks->push_back(message_block{len, data});
+    }
+    else
+        put(msg, (uint8_t)MS_VARTYPE_UNDEFINED);
+}
+
+}
+
+extern "C" {
+
+void ms_timed_callback(int milli, void (*callbackAddr)(void*, int32_t), void* user_data, int result)
+{
+    timed_callback cb;
+    cb.due_ = clock_type::now() + std::chrono::milliseconds(milli < 0 ? 0 : milli);
+    cb.proc_ = callbackAddr;
+    cb.user_data_ = user_data;
+    cb.result_ = result;
+
+    std::unique_lock<std::mutex> lk(callback_mtx);
+    cb.seq_ = callback_seq++;
+    callback_queue.push(cb);
+    callback_cnd.notify_all();
+}
+
+void ms_post_string_message(const char* msg)
+{
+    static const char startup_tok[] = "#command:async_startup_complete:";
+    if (strncmp(msg, startup_tok, sizeof(startup_tok) - 1) == 0)
+        startup_done = true;
+    msg_handler(msg, msg_handler_data);
+}
+
+void ms_post_completion_message(int task_index, const void* buffer1, int len1, const void* buffer2, int len2, int is_final)
+{
+    char msg[128];
+    snprintf(msg, sizeof(msg), "#completion:cb_index=%d,is_final=%d,len1=%d,len2=%d", task_index, is_final, len1, len2);
+    msg_handler(msg, msg_handler_data);
+}
+
+void ms_bind_graphics(int width, int height)
+{
+    surface_width = width;
+    surface_height = height;
+    back_pixels.assign((size_t)width * height, 0);
+    front_pixels.assign((size_t)width * height, 0);
+}
+
+void ms_back_buffer_clear(int red, int green, int blue)
+{
+    // ImageData byte order, r, g, b, a
+    uint8_t px[4] = { (uint8_t)red, (uint8_t)green, (uint8_t)blue, 255 };
+    uint32_t v;
+    memcpy(&v, px, sizeof(v));
+    std::fill(back_pixels.begin(), back_pixels.end(), v);
+}
+
+// same geometry as the canvas code in mutantspider.js: scale(xscale,yscale) followed
+// by drawImage(src,dstOrigX,dstOrigY), sampled nearest-neighbor
+void ms_stretch_blit_pixels(const void* data, int srcWidth, int srcHeight, float dstOrigX, float dstOrigY, float xscale, float yscale)
+{
+    if (!data || srcWidth <= 0 || srcHeight <= 0 || xscale <= 0 || yscale <= 0)
+        return;
+    auto src = static_cast<const uint32_t*>(data);
+    int x0 = std::max(0, (int)(dstOrigX * xscale));
+    int y0 = std::max(0, (int)(dstOrigY * yscale));
+    int x1 = std::min(surface_width, (int)((dstOrigX + srcWidth) * xscale));
+    int y1 = std::min(surface_height, (int)((dstOrigY + srcHeight) * yscale));
+    for (int y = y0; y < y1; y++)
+    {
+        int sy = std::min(srcHeight - 1, (int)((y + 0.5f) / yscale - dstOrigY));
+        auto srow = &src[(size_t)sy * srcWidth];
+        auto drow = &back_pixels[(size_t)y * surface_width];
+        if (xscale == 1 && dstOrigX == (int)dstOrigX)
+            memcpy(&drow[x0], &srow[x0 - (int)dstOrigX], (x1 - x0) * sizeof(uint32_t));
+        else
+        {
+            for (int x = x0; x < x1; x++)
+                drow[x] = srow[std::min(srcWidth - 1, (int)((x + 0.5f) / xscale - dstOrigX))];
+        }
+    }
+}
+
+void ms_paint_back_buffer(void)
+{
+    front_pixels = back_pixels;
+    ++frames;
+}
+
+int ms_new_http_request(void)
+{
+    int id = http_request_index++;
+    http_requests[id];
+    return id;
+}
+
+void ms_delete_http_request(int id)
+{
+    http_requests.erase(id);
+}
+
+int ms_open_http_request(int id, const char* method, const char* urlAddr, const char* headers, void (*callback)(void*, int32_t), void* cb_user_data)
+{
+    auto it = http_requests.find(id);
+    if (it == http_requests.end())
+    {
+        ms_timed_callback(0, callback, cb_user_data, MS_ERROR_BADARGUMENT);
+        return 0;
+    }
+
+    auto& req = it->second;
+    std::string path = url_to_path(urlAddr);
+    size_t first, last;
+    bool ok;
+    if (strcmp(method, "GET") != 0)
+        ok = false;
+    else if (parse_range(headers, &first, &last))
+        ok = read_file_range(path, first, last, &req.data_);
+    else
+        ok = read_file(path, &req.data_);
+    if (ok)
+    {
+        req.read_pos_ = 0;
+        req.size_ = req.data_.size();
+        req.has_data_ = true;
+        ms_timed_callback(0, callback, cb_user_data, MS_OK);
+    }
+    else
+    {
+        fprintf(stderr, "%s %s (%s) failed\n", method, urlAddr, path.c_str());
+        ms_timed_callback(0, callback, cb_user_data, MS_ERROR_FAILED);
+    }
+    return 0;
+}
+
+int ms_get_http_download_size(int id)
+{
+    auto it = http_requests.find(id);
+    return it == http_requests.end() ? MS_ERROR_BADARGUMENT : (int)it->second.size_;
+}
+
+int ms_read_http_response(int id, void* buffer, int bytes_to_read)
+{
+    if (bytes_to_read == 0)
+        return 0;
+    auto it = http_requests.find(id);
+    if (it == http_requests.end())
+        return MS_ERROR_BADARGUMENT;
+    auto& req = it->second;
+    if (!req.has_data_)
+        return MS_OK_COMPLETIONPENDING;
+
+    size_t avail = req.data_.size() - req.read_pos_;
+    size_t len = std::min(avail, (size_t)bytes_to_read);
+    memcpy(buffer, &req.data_[req.read_pos_], len);
+    req.read_pos_ += len;
+    if (req.read_pos_ == req.data_.size())
+    {
+        std::vector<char>().swap(req.data_);
+        req.has_data_ = false;
+    }
+    return (int)len;
+}
+
+void ms_initialize(void)
+{
+    MS_Init(0);
+}
+
+int ms_browser_supports_persistent_storage(void)
+{
+    return 1;
+}
+
+}
+
+namespace mutantspider
+{
+
+Graphics3D::Graphics3D(MS_AppInstance* instance,
+                        const int32_t attrib_list[])
+    : is_null_(false)
+{
+    int i = 0;
+    int32_t width = 0, height = 0;
+    while (attrib_list[i] != MS_GRAPHICS3DATTRIB_NONE)
+    {
+        auto v = attrib_list[i++];
+        if (v == MS_GRAPHICS3DATTRIB_WIDTH)
+            width = attrib_list[i];
+        else if (v == MS_GRAPHICS3DATTRIB_HEIGHT)
+            height = attrib_list[i];
+        ++i;
+    }
+    ResizeBuffers(width, height);
+}
+
+void* Graphics3D::pp_resource()
+{
+    return 0;
+}
+
+int32_t Graphics3D::ResizeBuffers(int32_t width, int32_t height)
+{
+    return MS_OK;
+}
+
+int32_t Graphics3D::SwapBuffers(const CompletionCallback& cc)
+{
+    ++frames;
+    cc.Run(0);
+    return 0;
+}
+
+namespace host
+{
+
+int run_once(int timeout_ms)
+{
+    main_thread_id.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    auto deadline = clock_type::now() + std::chrono::milliseconds(timeout_ms < 0 ? 0 : timeout_ms);
+    std::vector<timed_callback> due;
+    {
+        std::unique_lock<std::mutex> lk(callback_mtx);
+        while (callback_queue.empty() || callback_queue.top().due_ > clock_type::now())
+        {
+            auto wake = callback_queue.empty() ? deadline : std::min(deadline, callback_queue.top().due_);
+            if (clock_type::now() >= deadline)
+                break;
+            callback_cnd.wait_until(lk, wake);
+        }
+
+        // only the ones due now.  Callbacks queued while these run go to the next call
+        auto now = clock_type::now();
+        while (!callback_queue.empty() && callback_queue.top().due_ <= now)
+        {
+            due.push_back(callback_queue.top());
+            callback_queue.pop();
+        }
+    }
+
+    for (auto& cb : due)
+        cb.proc_(cb.user_data_, cb.result_);
+    return (int)due.size();
+}
+
+void run_until_idle()
+{
+    while (pending_callbacks() != 0)
+        run_once(1000);
+}
+
+void run_for(int milliseconds)
+{
+    auto deadline = clock_type::now() + std::chrono::milliseconds(milliseconds);
+    auto now = clock_type::now();
+    while (now < deadline)
+    {
+        run_once((int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count());
+        now = clock_type::now();
+    }
+}
+
+bool run_until(const std::function<bool()>& done, int timeout_ms)
+{
+    auto deadline = clock_type::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done())
+    {
+        auto now = clock_type::now();
+        if (now >= deadline)
+            return done();
+        // wake up at least every 10ms so that 'done' is polled even when nothing is queued
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+        run_once((int)std::min<decltype(remaining)>(remaining, 10));
+    }
+    return true;
+}
+
+size_t pending_callbacks()
+{
+    std::unique_lock<std::mutex> lk(callback_mtx);
+    return callback_queue.size();
+}
+
+bool startup_complete()
+{
+    return startup_done;
+}
+
+bool is_main_thread()
+{
+    return main_thread_id.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
+
+void set_message_handler(message_handler handler, void* user_data)
+{
+    msg_handler = handler ? handler : default_message_handler;
+    msg_handler_data = user_data;
+}
+
+void send_message(const mutantspider::Var& msg)
+{
+    std::vector<uint8_t> value;
+    std::vector<message_block> blocks;
+    encode_var(msg, &value, &blocks);
+    
+    // the block table comes first, then the value
+    std::vector<uint8_t> encoded;
+    encoded.reserve(4 + blocks.size() * 12 + value.size());
+    put(&encoded, (uint32_t)blocks.size());
+    for (auto& b : blocks)
+    {
+        put(&encoded, b.len);
+        put(&encoded, (uint64_t)(uintptr_t)b.data);
+    }
+    encoded.insert(encoded.end(), value.begin(), value.end());
+    MS_MessageProc(&encoded[0], (int)encoded.size());
+}
+
+const uint32_t* front_buffer(int* width, int* height)
+{
+    *width = surface_width;
+    *height = surface_height;
+    return front_pixels.empty() ? 0 : &front_pixels[0];
+}
+
+uint64_t frame_count()
+{
+    return frames;
+}
+
+void set_url_root(const std::string& dir)
+{
+    url_root() = dir;
+}
+
+void set_fs_root(const std::string& dir)
+{
+    fs_root_dir() = dir;
+}
+
+const std::string& fs_root()
+{
+    return fs_root_dir();
+}
+
+std::vector<std::pair<std::string, std::string>>& init_attribute_list()
+{
+    static std::vector<std::pair<std::string, std::string>> attributes;
+    return attributes;
+}
+
+void add_init_attribute(const std::string& name, const std::string& value)
+{
+    init_attribute_list().push_back(std::make_pair(name, value));
+}
+
+const std::vector<std::pair<std::string, std::string>>& init_attributes()
+{
+    return init_attribute_list();
+}
+
+}
+
+}
+
+// MUTANTSPIDER_HOST
+#endif
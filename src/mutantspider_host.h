@@ -0,0 +1,150 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+/*
+    Driver interface for the native "host" build of mutantspider (MUTANTSPIDER_HOST).
+
+    In the browser, mutantspider.js plays the role of the page: it creates the component,
+    feeds it view changes, input events and messages, and runs the callbacks it asks for.
+    In the host build there is no page, so whatever drives the component (the default
+    driver in mutantspider_host_main.cpp, a benchmark, or your own main) does that work
+    through the functions declared here.  Everything that a component sees through
+    mutantspider.h behaves the same as it does in the emscripten build.
+*/
+
+#include "mutantspider.h"
+
+#if defined(MUTANTSPIDER_HOST)
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    entry points implemented in mutantspider.cpp.  In emscripten builds these are called
+    from mutantspider.js.  In host builds they are called by the driver.
+*/
+extern "C" {
+void MS_Init(int init_flags);
+int  MS_MouseProc(int eventType, int timeStamp, int modifiers, int button, int positionX, int positionY, int clickCount, int movementX, int movementY);
+int  MS_TouchProc(int eventType, int timeStamp, int modifiers, int* touchData);
+void MS_FocusProc(int focus);
+void MS_KeyProc(int eventType, int timeStamp, int modifiers, int keycode, int keytext);
+void MS_DidChangeView(int x, int y, int width, int height);
+void MS_MessageProc(const void* msg, int msg_len);
+void MS_AsyncStartupComplete();
+}
+
+namespace mutantspider
+{
+namespace host
+{
+    /*
+        The host event loop.  Callbacks handed to CallOnMainThread (and the completion
+        callbacks of Graphics2D::Flush, URLLoader::Open, etc...) are queued here and run
+        on whatever thread calls one of these run functions -- that thread is the host
+        build's "main thread".
+    */
+
+    // run every callback that is due now, waiting up to 'timeout_ms' for the first one
+    // to become due if none are.  Returns the number of callbacks that ran.
+    int run_once(int timeout_ms);
+
+    // run callbacks until none are queued (including ones with a future due time)
+    void run_until_idle();
+
+    // run callbacks for 'milliseconds' of wall clock time
+    void run_for(int milliseconds);
+
+    // run callbacks until 'done' returns true or 'timeout_ms' expires.  Returns 'done()'
+    bool run_until(const std::function<bool()>& done, int timeout_ms);
+
+    // number of callbacks currently queued
+    size_t pending_callbacks();
+
+    // true once the component has reported "async_startup_complete" (see init_fs)
+    bool startup_complete();
+
+    // true on the main thread, once it has called one of the run functions
+    bool is_main_thread();
+
+    /*
+        Messages the component sends with PostMessage/PostCommand/PostCompletion are
+        passed to this handler.  The default handler prints them to stdout.  'msg'
+        is the string that would have been delivered to the page.
+    */
+    typedef void (*message_handler)(const char* msg, void* user_data);
+    void set_message_handler(message_handler handler, void* user_data);
+
+    /*
+        Deliver 'msg' to the component's HandleMessage, the way mutantspider.send_command
+        does in the browser.  It goes through the same encoding (and MS_MessageProc) that
+        send_command uses, and is delivered before this returns.
+    */
+    void send_message(const mutantspider::Var& msg);
+
+    /*
+        The in-memory surfaces used by Graphics2D/Graphics2DP.  The front buffer contains
+        the pixels as of the most recent Flush/SwapBuffers, in the same byte order the
+        component wrote them.  'frame_count' is the number of Flush/SwapBuffers calls.
+    */
+    const uint32_t* front_buffer(int* width, int* height);
+    uint64_t frame_count();
+
+    /*
+        Where URLLoader reads "downloads" from.  URLs are mapped to local files by stripping
+        any scheme and host ("http://host/a/b.txt" -> "a/b.txt") and resolving the remainder
+        relative to this directory.  Defaults to $MS_HOST_URL_ROOT, or the current directory.
+    */
+    void set_url_root(const std::string& dir);
+
+    /*
+        The host directory standing in for the browser's local storage.  /persistent data is
+        mirrored into this directory, and loaded from it when init_fs is called.  Defaults to
+        $MS_HOST_FS_ROOT, or "ms_host_fs" in the current directory.  Must be set before init_fs
+        is called.
+    */
+    void set_fs_root(const std::string& dir);
+    const std::string& fs_root();
+    
+    /*
+        In nacl, a component's Init is handed the attributes of its embed element.  MS_Init
+        hands it "has_webgl", followed by each name/value added here (in the order added).
+        Must be called before MS_Init.
+    */
+    void add_init_attribute(const std::string& name, const std::string& value);
+    const std::vector<std::pair<std::string, std::string>>& init_attributes();
+    
+    /*
+        The most directory entries one fuse readdir call may return before the host's stand-in
+        for nacl_io says the buffer is full, after which the next call carries on from the last
+        entry's offset.  The default (and what 0 restores) is about what fits in a 32KB getdents
+        buffer.  Tests set it small to check that a file system resumes listings correctly.
+    */
+    void set_readdir_batch_size(size_t entries);
+}
+}
+
+#endif
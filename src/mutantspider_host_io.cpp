@@ -0,0 +1,849 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#if defined(MUTANTSPIDER_HOST)
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "mutantspider_host_io.h"
+#include "mutantspider_host.h"
+
+#include <dlfcn.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    How this works:
+
+    Every libc entry point that takes a path or a file descriptor, and that the file system
+    code in mutantspider (or a component using it) calls, is defined here.  Because these
+    definitions are linked into the executable they are found before the ones in libc.
+    If the path is inside one of the mount points, the call is translated to the matching
+    fuse callback, the same way nacl_io does it.  Otherwise it is forwarded to libc's version,
+    which we find with dlsym(RTLD_NEXT, ...).
+
+    File descriptors for files in a mount point are real descriptors (for /dev/null),
+    so they can never collide with any other descriptor in the process.  We just keep a
+    table of which ones are ours.
+*/
+
+namespace {
+
+// look up (once) the libc version of 'name'
+#define MS_REAL(name) \
+    static auto real_##name = reinterpret_cast<decltype(&::name)>(dlsym(RTLD_NEXT, #name))
+
+struct mount_point
+{
+    char                            path[256];
+    size_t                          path_len;
+    const struct fuse_operations*   ops;
+};
+
+// mount points are only ever added, and an entry is fully written before
+// num_mounts is incremented, so readers don't need to lock
+const int                   max_mounts = 8;
+mount_point                 mounts[max_mounts];
+std::atomic<int>            num_mounts(0);
+std::mutex                  mount_mtx;
+
+// if 'path' is inside of one of our mount points, return that mount point and
+// set 'rel' to the mount-relative path (which always starts with a '/').
+//
+// In nacl and emscripten the current directory is always "/", so components can
+// use paths like "persistent/my_file".  The host process keeps its own current
+// directory, but a relative path that starts with a mount point's name is still
+// treated as if the current directory were "/".
+const mount_point* find_mount(const char* path, const char** rel)
+{
+    if (!path || path[0] == 0)
+        return 0;
+    int skip = path[0] == '/' ? 0 : 1;
+    int n = num_mounts.load(std::memory_order_acquire);
+    for (int i = 0; i < n; i++)
+    {
+        auto mp = &mounts[i];
+        if (strncmp(path, mp->path + skip, mp->path_len - skip) == 0)
+        {
+            auto r = &path[mp->path_len - skip];
+            if (*r == 0)
+            {
+                *rel = "/";
+                return mp;
+            }
+            if (*r == '/')
+            {
+                *rel = r;
+                return mp;
+            }
+        }
+    }
+    return 0;
+}
+
+// an open file (or directory opened with open()) inside one of our mount points
+struct host_file
+{
+    const struct fuse_operations*   ops;
+    std::string                     path;
+    struct fuse_file_info           fi;
+    off_t                           pos;
+    bool                            is_dir;
+};
+
+std::mutex                              files_mtx;
+std::unordered_map<int, host_file*>     files;
+
+host_file* get_file(int fd)
+{
+    std::unique_lock<std::mutex> lk(files_mtx);
+    auto it = files.find(fd);
+    return it == files.end() ? 0 : it->second;
+}
+
+// an open directory stream (opendir) inside one of our mount points
+struct host_dir
+{
+    const struct fuse_operations*   ops;
+    std::string                     path;
+    struct fuse_file_info           fi;
+    off_t                           pos;
+    std::vector<struct dirent>      ents;
+    size_t                          next;
+};
+
+std::mutex                              dirs_mtx;
+std::unordered_map<void*, host_dir*>    dirs;
+
+host_dir* get_dir(void* d)
+{
+    std::unique_lock<std::mutex> lk(dirs_mtx);
+    auto it = dirs.find(d);
+    return it == dirs.end() ? 0 : it->second;
+}
+
+// convert the return value of a fuse callback to the posix convention
+int fuse_ret(int ret)
+{
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+int do_open(const mount_point* mp, const char* rel, int flags, mode_t mode)
+{
+    auto ops = mp->ops;
+    struct stat st;
+    int ret = ops->getattr ? ops->getattr(rel, &st) : -ENOSYS;
+    bool exists = ret == 0;
+    if (!exists && (ret != -ENOENT || !(flags & O_CREAT)))
+        return fuse_ret(ret);
+    if (exists && (flags & O_CREAT) && (flags & O_EXCL))
+        return fuse_ret(-EEXIST);
+
+    auto f = new host_file;
+    f->ops = ops;
+    f->path = rel;
+    memset(&f->fi, 0, sizeof(f->fi));
+    f->fi.flags = flags;
+    f->pos = 0;
+    f->is_dir = exists && S_ISDIR(st.st_mode);
+
+    if (f->is_dir)
+    {
+        if ((flags & O_ACCMODE) != O_RDONLY)
+            ret = -EISDIR;
+    }
+    else if (flags & O_CREAT)
+        ret = ops->create ? ops->create(rel, mode, &f->fi) : -ENOSYS;
+    else
+        ret = ops->open ? ops->open(rel, &f->fi) : -ENOSYS;
+
+    // like nacl_io, O_TRUNC is implemented with ftruncate
+    if (ret == 0 && !f->is_dir && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+    {
+        ret = ops->ftruncate ? ops->ftruncate(rel, 0, &f->fi) : -ENOSYS;
+        if (ret != 0 && ops->release)
+            ops->release(rel, &f->fi);
+    }
+
+    if (ret != 0)
+    {
+        delete f;
+        return fuse_ret(ret);
+    }
+
+    MS_REAL(open);
+    int fd = real_open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int err = errno;
+        if (!f->is_dir && ops->release)
+            ops->release(rel, &f->fi);
+        delete f;
+        errno = err;
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lk(files_mtx);
+    files[fd] = f;
+    return fd;
+}
+
+ssize_t do_read(host_file* f, void* buf, size_t count, off_t pos)
+{
+    if (f->is_dir)
+        return fuse_ret(-EISDIR);
+    if ((f->fi.flags & O_ACCMODE) == O_WRONLY)
+        return fuse_ret(-EBADF);
+    return fuse_ret(f->ops->read(f->path.c_str(), (char*)buf, count, pos, &f->fi));
+}
+
+ssize_t do_write(host_file* f, const void* buf, size_t count, off_t pos)
+{
+    if (f->is_dir || (f->fi.flags & O_ACCMODE) == O_RDONLY)
+        return fuse_ret(-EBADF);
+    return fuse_ret(f->ops->write(f->path.c_str(), (const char*)buf, count, pos, &f->fi));
+}
+
+int do_fstat(host_file* f, struct stat* st)
+{
+    if (!f->is_dir && f->ops->fgetattr)
+        return fuse_ret(f->ops->fgetattr(f->path.c_str(), st, &f->fi));
+    return fuse_ret(f->ops->getattr(f->path.c_str(), st));
+}
+
+/*
+    like nacl_io, which has no way to map a fuse file's own memory: anonymous private pages
+    with the file's contents read into them (and zeros past its end).  So writes to the pages
+    never reach the file, even with MAP_SHARED
+*/
+void* do_mmap(host_file* f, void* addr, size_t length, int prot, int flags, off_t offset)
+{
+    if (f->is_dir)
+    {
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+    if (prot & PROT_EXEC)
+    {
+        errno = EPERM;
+        return MAP_FAILED;
+    }
+    MS_REAL(mmap);
+    auto mem = (char*)real_mmap(addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | (flags & MAP_FIXED), -1, 0);
+    if (mem == MAP_FAILED)
+        return MAP_FAILED;
+    size_t done = 0;
+    while (done < length)
+    {
+        auto ret = do_read(f, mem + done, length - done, offset + done);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+        {
+            int err = errno;
+            munmap(mem, length);
+            errno = err;
+            return MAP_FAILED;
+        }
+        done += ret;
+    }
+    if (!(prot & PROT_WRITE))
+        mprotect(mem, length, prot);
+    return mem;
+}
+
+// the most entries one call to a file system's readdir can return, as if it were filling
+// a 32KB getdents buffer.  Tests can make it smaller (host::set_readdir_batch_size) to
+// exercise the "buffer full, carry on from 'off'" path
+const size_t default_dir_batch_size = 32 * 1024 / sizeof(struct dirent);
+std::atomic<size_t> dir_batch_size(default_dir_batch_size);
+
+// the fuse_fill_dir_t we hand to readdir
+int fill_dir(void* buf, const char* name, const struct stat* st, off_t off)
+{
+    auto d = static_cast<host_dir*>(buf);
+    if (d->ents.size() >= dir_batch_size.load(std::memory_order_relaxed))
+        return 1;
+    struct dirent ent;
+    memset(&ent, 0, sizeof(ent));
+    ent.d_ino = st ? st->st_ino : 0;
+    ent.d_off = off;
+    ent.d_reclen = sizeof(ent);
+    if (st)
+        ent.d_type = S_ISDIR(st->st_mode) ? DT_DIR : S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN;
+    strncpy(ent.d_name, name, sizeof(ent.d_name) - 1);
+    d->ents.push_back(ent);
+    return 0;
+}
+
+// fopencookie glue for fopen on a file in one of our mount points
+ssize_t cookie_read(void* c, char* buf, size_t size)
+{
+    return read((int)(intptr_t)c, buf, size);
+}
+
+ssize_t cookie_write(void* c, const char* buf, size_t size)
+{
+    return write((int)(intptr_t)c, buf, size);
+}
+
+int cookie_seek(void* c, off64_t* offset, int whence)
+{
+    auto ret = lseek((int)(intptr_t)c, *offset, whence);
+    if (ret == -1)
+        return -1;
+    *offset = ret;
+    return 0;
+}
+
+int cookie_close(void* c)
+{
+    return close((int)(intptr_t)c);
+}
+
+int fopen_flags(const char* mode)
+{
+    int flags;
+    switch (mode[0])
+    {
+        case 'r':
+            flags = O_RDONLY;
+            break;
+        case 'w':
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        case 'a':
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        default:
+            return -1;
+    }
+    if (strchr(mode, '+'))
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    if (strchr(mode, 'x'))
+        flags |= O_EXCL;
+    return flags;
+}
+
+}
+
+namespace mutantspider
+{
+namespace host
+{
+
+void set_readdir_batch_size(size_t entries)
+{
+    dir_batch_size.store(entries ? entries : default_dir_batch_size, std::memory_order_relaxed);
+}
+
+}
+}
+
+extern "C" {
+
+int ms_host_io_mount(const char* target, const struct fuse_operations* ops)
+{
+    std::unique_lock<std::mutex> lk(mount_mtx);
+    size_t len = strlen(target);
+    while (len > 1 && target[len-1] == '/')
+        --len;
+    int n = num_mounts.load(std::memory_order_relaxed);
+    if (target[0] != '/' || len >= sizeof(mounts[0].path) || n == max_mounts)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (mounts[i].path_len == len && strncmp(mounts[i].path, target, len) == 0)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    memcpy(mounts[n].path, target, len);
+    mounts[n].path[len] = 0;
+    mounts[n].path_len = len;
+    mounts[n].ops = ops;
+    if (ops->init)
+        ops->init(0);
+    num_mounts.store(n + 1, std::memory_order_release);
+    return 0;
+}
+
+int open(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return do_open(mp, rel, flags, mode);
+    MS_REAL(open);
+    return real_open(path, flags, mode);
+}
+
+int creat(const char* path, mode_t mode)
+{
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
+
+int close(int fd)
+{
+    MS_REAL(close);
+    if (!files.empty())
+    {
+        host_file* f = 0;
+        {
+            std::unique_lock<std::mutex> lk(files_mtx);
+            auto it = files.find(fd);
+            if (it != files.end())
+            {
+                f = it->second;
+                files.erase(it);
+            }
+        }
+        if (f)
+        {
+            int ret = 0;
+            if (!f->is_dir && f->ops->release)
+                ret = f->ops->release(f->path.c_str(), &f->fi);
+            real_close(fd);
+            delete f;
+            return fuse_ret(ret);
+        }
+    }
+    return real_close(fd);
+}
+
+ssize_t read(int fd, void* buf, size_t count)
+{
+    if (auto f = get_file(fd))
+    {
+        auto ret = do_read(f, buf, count, f->pos);
+        if (ret > 0)
+            f->pos += ret;
+        return ret;
+    }
+    MS_REAL(read);
+    return real_read(fd, buf, count);
+}
+
+ssize_t pread(int fd, void* buf, size_t count, off_t pos)
+{
+    if (auto f = get_file(fd))
+        return do_read(f, buf, count, pos);
+    MS_REAL(pread);
+    return real_pread(fd, buf, count, pos);
+}
+
+ssize_t write(int fd, const void* buf, size_t count)
+{
+    if (auto f = get_file(fd))
+    {
+        if (f->fi.flags & O_APPEND)
+        {
+            struct stat st;
+            if (do_fstat(f, &st) != 0)
+                return -1;
+            f->pos = st.st_size;
+        }
+        auto ret = do_write(f, buf, count, f->pos);
+        if (ret > 0)
+            f->pos += ret;
+        return ret;
+    }
+    MS_REAL(write);
+    return real_write(fd, buf, count);
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t pos)
+{
+    if (auto f = get_file(fd))
+        return do_write(f, buf, count, pos);
+    MS_REAL(pwrite);
+    return real_pwrite(fd, buf, count, pos);
+}
+
+off_t lseek(int fd, off_t offset, int whence) throw()
+{
+    if (auto f = get_file(fd))
+    {
+        off_t base;
+        switch (whence)
+        {
+            case SEEK_SET:
+                base = 0;
+                break;
+            case SEEK_CUR:
+                base = f->pos;
+                break;
+            case SEEK_END:
+            {
+                struct stat st;
+                if (do_fstat(f, &st) != 0)
+                    return -1;
+                base = st.st_size;
+            }   break;
+            default:
+                return fuse_ret(-EINVAL);
+        }
+        if (base + offset < 0)
+            return fuse_ret(-EINVAL);
+        f->pos = base + offset;
+        return f->pos;
+    }
+    MS_REAL(lseek);
+    return real_lseek(fd, offset, whence);
+}
+
+int fstat(int fd, struct stat* st) throw()
+{
+    if (auto f = get_file(fd))
+        return do_fstat(f, st);
+    MS_REAL(fstat);
+    return real_fstat(fd, st);
+}
+
+int ftruncate(int fd, off_t length) throw()
+{
+    if (auto f = get_file(fd))
+    {
+        if (f->is_dir || (f->fi.flags & O_ACCMODE) == O_RDONLY)
+            return fuse_ret(-EBADF);
+        return fuse_ret(f->ops->ftruncate(f->path.c_str(), length, &f->fi));
+    }
+    MS_REAL(ftruncate);
+    return real_ftruncate(fd, length);
+}
+
+int fsync(int fd)
+{
+    if (auto f = get_file(fd))
+        return fuse_ret(f->ops->fsync && !f->is_dir ? f->ops->fsync(f->path.c_str(), 0, &f->fi) : 0);
+    MS_REAL(fsync);
+    return real_fsync(fd);
+}
+
+int fdatasync(int fd)
+{
+    if (auto f = get_file(fd))
+        return fuse_ret(f->ops->fsync && !f->is_dir ? f->ops->fsync(f->path.c_str(), 1, &f->fi) : 0);
+    MS_REAL(fdatasync);
+    return real_fdatasync(fd);
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) throw()
+{
+    if (!(flags & MAP_ANONYMOUS))
+    {
+        if (auto f = get_file(fd))
+            return do_mmap(f, addr, length, prot, flags, offset);
+    }
+    MS_REAL(mmap);
+    return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int stat(const char* path, struct stat* st) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->getattr(rel, st));
+    MS_REAL(stat);
+    return real_stat(path, st);
+}
+
+int lstat(const char* path, struct stat* st) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->getattr(rel, st));
+    MS_REAL(lstat);
+    return real_lstat(path, st);
+}
+
+int access(const char* path, int mode) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->access ? mp->ops->access(rel, mode) : mp->ops->getattr(rel, 0));
+    MS_REAL(access);
+    return real_access(path, mode);
+}
+
+int mkdir(const char* path, mode_t mode) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->mkdir ? mp->ops->mkdir(rel, mode) : -EROFS);
+    MS_REAL(mkdir);
+    return real_mkdir(path, mode);
+}
+
+int rmdir(const char* path) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->rmdir ? mp->ops->rmdir(rel) : -EROFS);
+    MS_REAL(rmdir);
+    return real_rmdir(path);
+}
+
+int unlink(const char* path) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->unlink ? mp->ops->unlink(rel) : -EROFS);
+    MS_REAL(unlink);
+    return real_unlink(path);
+}
+
+int remove(const char* path) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+    {
+        struct stat st;
+        int ret = mp->ops->getattr(rel, &st);
+        if (ret == 0)
+            ret = S_ISDIR(st.st_mode) ? (mp->ops->rmdir ? mp->ops->rmdir(rel) : -EROFS)
+                                      : (mp->ops->unlink ? mp->ops->unlink(rel) : -EROFS);
+        return fuse_ret(ret);
+    }
+    MS_REAL(remove);
+    return real_remove(path);
+}
+
+int rename(const char* path, const char* new_path) throw()
+{
+    const char* rel;
+    const char* new_rel;
+    auto mp = find_mount(path, &rel);
+    auto new_mp = find_mount(new_path, &new_rel);
+    if (mp || new_mp)
+    {
+        if (mp != new_mp)
+            return fuse_ret(-EXDEV);
+        return fuse_ret(mp->ops->rename ? mp->ops->rename(rel, new_rel) : -EROFS);
+    }
+    MS_REAL(rename);
+    return real_rename(path, new_path);
+}
+
+int truncate(const char* path, off_t length) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->truncate ? mp->ops->truncate(rel, length) : -EROFS);
+    MS_REAL(truncate);
+    return real_truncate(path, length);
+}
+
+int chmod(const char* path, mode_t mode) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+        return fuse_ret(mp->ops->chmod ? mp->ops->chmod(rel, mode) : -EROFS);
+    MS_REAL(chmod);
+    return real_chmod(path, mode);
+}
+
+int utimes(const char* path, const struct timeval tv[2]) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+    {
+        if (!mp->ops->utimens)
+            return fuse_ret(-EROFS);
+        if (!tv)
+            return fuse_ret(mp->ops->utimens(rel, 0));
+        struct timespec ts[2];
+        for (int i = 0; i < 2; i++)
+        {
+            ts[i].tv_sec = tv[i].tv_sec;
+            ts[i].tv_nsec = tv[i].tv_usec * 1000;
+        }
+        return fuse_ret(mp->ops->utimens(rel, ts));
+    }
+    MS_REAL(utimes);
+    return real_utimes(path, tv);
+}
+
+int utime(const char* path, const struct utimbuf* times) throw()
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+    {
+        if (!mp->ops->utimens)
+            return fuse_ret(-EROFS);
+        if (!times)
+            return fuse_ret(mp->ops->utimens(rel, 0));
+        struct timespec ts[2];
+        ts[0].tv_sec = times->actime;
+        ts[0].tv_nsec = 0;
+        ts[1].tv_sec = times->modtime;
+        ts[1].tv_nsec = 0;
+        return fuse_ret(mp->ops->utimens(rel, ts));
+    }
+    MS_REAL(utime);
+    return real_utime(path, times);
+}
+
+DIR* opendir(const char* path)
+{
+    const char* rel;
+    if (auto mp = find_mount(path, &rel))
+    {
+        struct stat st;
+        int ret = mp->ops->getattr(rel, &st);
+        if (ret == 0 && !S_ISDIR(st.st_mode))
+            ret = -ENOTDIR;
+        auto d = new host_dir;
+        d->ops = mp->ops;
+        d->path = rel;
+        memset(&d->fi, 0, sizeof(d->fi));
+        d->pos = 0;
+        d->next = 0;
+        if (ret == 0 && mp->ops->opendir)
+            ret = mp->ops->opendir(rel, &d->fi);
+        if (ret != 0)
+        {
+            delete d;
+            fuse_ret(ret);
+            return 0;
+        }
+        std::unique_lock<std::mutex> lk(dirs_mtx);
+        dirs[d] = d;
+        return reinterpret_cast<DIR*>(d);
+    }
+    MS_REAL(opendir);
+    return real_opendir(path);
+}
+
+struct dirent* readdir(DIR* dirp)
+{
+    if (auto d = get_dir(dirp))
+    {
+        if (d->next >= d->ents.size())
+        {
+            d->ents.clear();
+            d->next = 0;
+            // nacl_io calls opendir before each readdir, and the fuse file systems
+            // written for it expect that (they ignore the call if fi.fh is set)
+            if (d->ops->opendir)
+                d->ops->opendir(d->path.c_str(), &d->fi);
+            int ret = d->ops->readdir(d->path.c_str(), d, fill_dir, d->pos, &d->fi);
+            if (ret < 0)
+            {
+                fuse_ret(ret);
+                return 0;
+            }
+            if (d->ents.empty())
+                return 0;
+            // like nacl_io, the next call starts from the offset of the last entry we got
+            d->pos = d->ents.back().d_off;
+        }
+        return &d->ents[d->next++];
+    }
+    MS_REAL(readdir);
+    return real_readdir(dirp);
+}
+
+int closedir(DIR* dirp)
+{
+    if (!dirs.empty())
+    {
+        host_dir* d = 0;
+        {
+            std::unique_lock<std::mutex> lk(dirs_mtx);
+            auto it = dirs.find(dirp);
+            if (it != dirs.end())
+            {
+                d = it->second;
+                dirs.erase(it);
+            }
+        }
+        if (d)
+        {
+            int ret = d->ops->releasedir ? d->ops->releasedir(d->path.c_str(), &d->fi) : 0;
+            delete d;
+            return fuse_ret(ret);
+        }
+    }
+    MS_REAL(closedir);
+    return real_closedir(dirp);
+}
+
+FILE* fopen(const char* path, const char* mode)
+{
+    const char* rel;
+    if (find_mount(path, &rel))
+    {
+        int flags = fopen_flags(mode);
+        if (flags == -1)
+        {
+            errno = EINVAL;
+            return 0;
+        }
+        int fd = open(path, flags, 0666);
+        if (fd == -1)
+            return 0;
+        cookie_io_functions_t funcs = { cookie_read, cookie_write, cookie_seek, cookie_close };
+        auto f = fopencookie((void*)(intptr_t)fd, mode, funcs);
+        if (!f)
+            close(fd);
+        return f;
+    }
+    MS_REAL(fopen);
+    return real_fopen(path, mode);
+}
+
+}
+
+// MUTANTSPIDER_HOST
+#endif
@@ -0,0 +1,129 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+/*
+    A very small stand-in for the parts of nacl_io that mutantspider_fs.cpp uses, so that
+    the pbmemfs and rezfs fuse file systems run unchanged in the host build.
+
+    The declarations below match nacl_io/fuse.h (pepper 39 and later).  A file system
+    mounted with ms_host_io_mount is reached through the normal POSIX calls -- open, read,
+    stat, opendir, fopen, etc... -- because mutantspider_host_io.cpp interposes on those
+    libc functions and redirects any absolute path inside a mount point to the fuse
+    callbacks.  Everything else is passed through to libc.
+*/
+
+#if defined(MUTANTSPIDER_HOST)
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// the fuse_operations below has the same layout as pepper 39's
+#define PPAPI_RELEASE 39
+
+struct statvfs;
+
+struct fuse_file_info
+{
+    int             flags;
+    unsigned long   fh_old;
+    int             writepage;
+    unsigned int    direct_io : 1;
+    unsigned int    keep_cache : 1;
+    unsigned int    flush : 1;
+    unsigned int    nonseekable : 1;
+    unsigned int    padding : 28;
+    uint64_t        fh;
+    uint64_t        lock_owner;
+    uint32_t        poll_events;
+};
+
+struct fuse_conn_info
+{
+    unsigned        proto_major;
+    unsigned        proto_minor;
+    unsigned        async_read;
+    unsigned        max_write;
+    unsigned        max_readahead;
+    unsigned        capable;
+    unsigned        want;
+    unsigned        max_background;
+    unsigned        congestion_threshold;
+    unsigned        reserved[23];
+};
+
+// add an entry to a readdir() buffer.  Returns 1 if the buffer is full, 0 otherwise.
+typedef int (*fuse_fill_dir_t)(void* buf, const char* name, const struct stat* stbuf, off_t off);
+
+struct fuse_operations
+{
+    unsigned int flag_nopath : 1;
+    unsigned int flag_reserved : 31;
+
+    int (*getattr)(const char*, struct stat*);
+    int (*readlink)(const char*, char*, size_t);
+    int (*mknod)(const char*, mode_t, dev_t);
+    int (*mkdir)(const char*, mode_t);
+    int (*unlink)(const char*);
+    int (*rmdir)(const char*);
+    int (*symlink)(const char*, const char*);
+    int (*rename)(const char*, const char*);
+    int (*link)(const char*, const char*);
+    int (*chmod)(const char*, mode_t);
+    int (*chown)(const char*, uid_t, gid_t);
+    int (*truncate)(const char*, off_t);
+    int (*open)(const char*, struct fuse_file_info*);
+    int (*read)(const char*, char*, size_t, off_t, struct fuse_file_info*);
+    int (*write)(const char*, const char*, size_t, off_t, struct fuse_file_info*);
+    int (*statfs)(const char*, struct statvfs*);
+    int (*flush)(const char*, struct fuse_file_info*);
+    int (*release)(const char*, struct fuse_file_info*);
+    int (*fsync)(const char*, int, struct fuse_file_info*);
+    int (*setxattr)(const char*, const char*, const char*, size_t, int);
+    int (*getxattr)(const char*, const char*, char*, size_t);
+    int (*listxattr)(const char*, char*, size_t);
+    int (*removexattr)(const char*, const char*);
+    int (*opendir)(const char*, struct fuse_file_info*);
+    int (*readdir)(const char*, void*, fuse_fill_dir_t, off_t, struct fuse_file_info*);
+    int (*releasedir)(const char*, struct fuse_file_info*);
+    int (*fsyncdir)(const char*, int, struct fuse_file_info*);
+    void* (*init)(struct fuse_conn_info*);
+    void (*destroy)(void*);
+    int (*access)(const char*, int);
+    int (*create)(const char*, mode_t, struct fuse_file_info*);
+    int (*ftruncate)(const char*, off_t, struct fuse_file_info*);
+    int (*fgetattr)(const char*, struct stat*, struct fuse_file_info*);
+    int (*lock)(const char*, struct fuse_file_info*, int cmd, struct flock*);
+    int (*utimens)(const char*, const struct timespec tv[2]);
+};
+
+/*
+    make 'ops' reachable at the absolute path 'target' (for example "/persistent").
+    Like nacl_io, the paths handed to the fuse callbacks are relative to the mount
+    point and start with '/'.  Returns 0 on success, -1 (with errno set) on failure.
+*/
+extern "C" int ms_host_io_mount(const char* target, const struct fuse_operations* ops);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "mutantspider_host.h"
+
+#if defined(MUTANTSPIDER_HOST)
+
+#include <chrono>
+#include <math.h>
+#include <unistd.h>
+
+/*
+    The default driver for host builds.  It does roughly what mutantspider.js does
+    when the page loads: create the component, give it a view and focus, wait for
+    async startup to finish, then deliver whatever messages and (synthetic) input
+    events were asked for on the command line, and run the event loop.
+
+    usage: <component>_host [-w width] [-h height] [-a name=value]... [-m key=value]... [-e num_events] [-t run_ms] [-k]
+*/
+
+namespace {
+
+void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-a name=value]... [-m key=value]... [-e num_events] [-t run_ms] [-k]\n", name);
+    fprintf(stderr, "  -w, -h   size of the view (default 640 x 480)\n");
+    fprintf(stderr, "  -a       add an attribute to the ones the component's Init is given (like an embed element's)\n");
+    fprintf(stderr, "  -m       add a key/value pair to the message sent to the component after startup\n");
+    fprintf(stderr, "  -e       number of synthetic mouse events to send after startup (default 0)\n");
+    fprintf(stderr, "  -t       milliseconds to run the event loop after the events are sent (default 1000)\n");
+    fprintf(stderr, "  -k       then end with _exit, the way closing the page ends nacl, without running atexit handlers\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 640;
+    int height = 480;
+    int num_events = 0;
+    int run_ms = 1000;
+    bool kill = false;
+    std::map<std::string, mutantspider::Var> msg;
+
+    int c;
+    while ((c = getopt(argc, argv, "w:h:e:t:m:a:k")) != -1)
+    {
+        switch (c)
+        {
+            case 'w':
+                width = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'e':
+                num_events = atoi(optarg);
+                break;
+            case 't':
+                run_ms = atoi(optarg);
+                break;
+            case 'k':
+                kill = true;
+                break;
+            case 'a':
+            case 'm':
+            {
+                const char* eq = strchr(optarg, '=');
+                if (!eq)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                if (c == 'a')
+                    mutantspider::host::add_init_attribute(std::string(optarg, eq - optarg), eq + 1);
+                else
+                    msg[std::string(optarg, eq - optarg)] = mutantspider::Var(eq + 1);
+            }   break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    MS_Init(0);
+    MS_DidChangeView(0, 0, width, height);
+    MS_FocusProc(1);
+
+    if (!mutantspider::host::run_until(mutantspider::host::startup_complete, 30000))
+    {
+        fprintf(stderr, "timed out waiting for async_startup_complete\n");
+        return 1;
+    }
+
+    if (!msg.empty())
+    {
+        mutantspider::host::send_message(mutantspider::Var(std::move(msg)));
+        mutantspider::host::run_once(0);
+    }
+
+    // a mouse down, num_events-2 moves around a circle in the middle of the view, and a mouse up
+    for (int i = 0; i < num_events; i++)
+    {
+        double a = 2 * M_PI * i / num_events;
+        int x = (int)(width / 2 + width / 4 * cos(a));
+        int y = (int)(height / 2 + height / 4 * sin(a));
+        int type = i == 0 ? MS_INPUTEVENT_TYPE_MOUSEDOWN
+                    : i == num_events - 1 ? MS_INPUTEVENT_TYPE_MOUSEUP : MS_INPUTEVENT_TYPE_MOUSEMOVE;
+        MS_MouseProc(type, i * 16000, 0, MS_INPUTEVENT_MOUSEBUTTON_LEFT, x, y, type == MS_INPUTEVENT_TYPE_MOUSEMOVE ? 0 : 1, 0, 0);
+        mutantspider::host::run_once(0);
+    }
+
+    mutantspider::host::run_for(run_ms);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "host run complete: %d events, %llu frames, %d ms\n",
+            num_events, (unsigned long long)mutantspider::host::frame_count(), (int)elapsed);
+    if (kill)
+    {
+        fflush(0);
+        _exit(0);
+    }
+    return 0;
+}
+
+// MUTANTSPIDER_HOST
+#endif
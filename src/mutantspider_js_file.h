@@ -1,6 +1,6 @@
 #pragma once
 
-#if defined(EMSCRIPTEN)
+#if defined(EMSCRIPTEN) || defined(MUTANTSPIDER_HOST)
 
 typedef enum {
 	MS_URLREQUESTPROPERTY_URL = 0,
@@ -202,7 +202,7 @@ public:
 	int32_t Open(const URLRequestInfo& request_info,
 					const CompletionCallback& cc)
 	{
-		return ms_open_http_request(m_js_loader,request_info.m_method.c_str(),request_info.m_url.c_str(),cc.get_proc(),cc.get_user_data());
+		return ms_open_http_request(m_js_loader,request_info.m_method.c_str(),request_info.m_url.c_str(),request_info.m_headers.c_str(),cc.get_proc(),cc.get_user_data());
 	}
 	
 	int32_t FollowRedirect(const CompletionCallback& cc);
@@ -0,0 +1,525 @@
+/*
+ Copyright (c) 2014 Mutantspider authors, see AUTHORS file.
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+/*
+    mutantspider_rezpack -- the build-time tool mutantspider.mk uses to turn one
+    RESOURCES file into C++.  It is compiled with the host compiler and run as:
+
+        mutantspider_rezpack [-c lz4] <symbol> <resource file> <output .cpp>
+
+    It writes <output .cpp>, which defines the rez_file_ent named <symbol>, and
+    next to it a .inc file holding the file's bytes as one string literal.  Host
+    builds pull the bytes straight from the resource file with .incbin and never
+    read the .inc.  pnacl-clang and emcc produce portable code that can't contain
+    module-level assembly, so they #include the .inc instead.  A string literal
+    is a single token to the compiler, which makes it far cheaper to compile than
+    the "0x54, 0x2f, ..." list mutantspider.mk used to generate with od and sed.
+
+    With -c lz4 the file is split into blocks of block_size bytes, and each one
+    is compressed on its own with lz4's block format (see lz4_decode in
+    mutantspider_fs.cpp for the reading side).  The compressed bytes are written
+    to a .lz4 file next to <output .cpp>, and that is what .incbin reads.
+
+    The resource pack (RESOURCE_PACK in the makefile) is written by a second form:
+
+        mutantspider_rezpack -p <pack file> <url> <output .cpp> {[-c lz4] <symbol> <resource file>}...
+
+    which appends the (possibly compressed) bytes of each resource file to <pack file>,
+    and writes their rez_file_ents to <output .cpp>.  Those have no file_data, just
+    where the file is in the pack.  <output .cpp> also defines rez_pack_url as <url>
+    plus a hash of the pack, so a browser never pairs a cached old pack with a new index.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+// bytes per line of the string literal in the .inc file
+const size_t literal_line_len = 4096;
+
+// the uncompressed size of each block of a compressed file
+const size_t block_size = 64 * 1024;
+
+bool read_file(const char* path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    unsigned char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), &buf[0], &buf[n]);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+// escape 's' so it can appear between double quotes in a C string literal or an assembler string
+std::string quote(const std::string& s)
+{
+    std::string ret;
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+            ret += '\\';
+        ret += s[i];
+    }
+    return ret;
+}
+
+/*
+    the string literal encoding of every byte value.  Printable characters stand
+    for themselves, except for the ones that mean something inside a string literal
+    ('"' and '\\') and '?' (which could start a trigraph).  Everything else is a
+    three digit octal escape, which can't run into a digit that follows it.
+*/
+struct literal_table {
+    char    chars[256][5];
+
+    literal_table()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?')
+            {
+                chars[c][0] = (char)c;
+                chars[c][1] = 0;
+            }
+            else
+                snprintf(chars[c], sizeof(chars[c]), "\\%03o", c);
+        }
+    }
+};
+
+uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// lz4's encoding of a length that doesn't fit in its 4 bit field: 255's, then the remainder
+void put_length(size_t len, std::vector<unsigned char>& out)
+{
+    while (len >= 255)
+    {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back((unsigned char)len);
+}
+
+// one lz4 sequence: 'lit_len' literals from 'lit', then (unless match_len is 0) a match
+void put_sequence(const unsigned char* lit, size_t lit_len, size_t offset, size_t match_len, std::vector<unsigned char>& out)
+{
+    size_t ml = match_len ? match_len - 4 : 0;
+    out.push_back((unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15)));
+    if (lit_len >= 15)
+        put_length(lit_len - 15, out);
+    out.insert(out.end(), lit, lit + lit_len);
+    if (match_len)
+    {
+        out.push_back((unsigned char)(offset & 0xff));
+        out.push_back((unsigned char)(offset >> 8));
+        if (ml >= 15)
+            put_length(ml - 15, out);
+    }
+}
+
+/*
+    compress the 'n' bytes at 'src' as one lz4 block, appending it to 'out'.  This is
+    a plain greedy matcher with a hash of every 4 byte sequence.  It follows the format's
+    rules for the end of a block: the last match starts at least 12 bytes before the end,
+    and the last 5 bytes are always literals.
+*/
+void lz4_encode(const unsigned char* src, size_t n, std::vector<unsigned char>& out)
+{
+    const int hash_bits = 16;
+    std::vector<int32_t> table((size_t)1 << hash_bits, -1);
+    auto hash = [&](size_t pos) { return (read32(src + pos) * 2654435761u) >> (32 - hash_bits); };
+
+    size_t anchor = 0;
+    if (n > 12)
+    {
+        size_t match_limit = n - 12;
+        size_t match_end = n - 5;
+        size_t ip = 0;
+        while (ip < match_limit)
+        {
+            auto h = hash(ip);
+            int32_t ref = table[h];
+            table[h] = (int32_t)ip;
+            if (ref < 0 || ip - ref > 65535 || read32(src + ref) != read32(src + ip))
+            {
+                ip++;
+                continue;
+            }
+            size_t len = 4;
+            while (ip + len < match_end && src[ref + len] == src[ip + len])
+                len++;
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+            {
+                ip--;
+                ref--;
+                len++;
+            }
+            put_sequence(src + anchor, ip - anchor, ip - ref, len, out);
+            for (size_t p = ip + 1; p < ip + len && p < match_limit; p++)
+                table[hash(p)] = (int32_t)p;
+            ip += len;
+            anchor = ip;
+        }
+    }
+    put_sequence(src + anchor, n - anchor, 0, 0, out);
+}
+
+/*
+    compress 'data' into blocks, replacing it with the compressed bytes.  'blocks'
+    gets the offset of each block, plus the end.  Blocks that don't get smaller are
+    stored as they are, which the reader recognizes by their size.
+*/
+bool compress(std::vector<unsigned char>& data, std::vector<uint32_t>& blocks)
+{
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> block;
+    for (size_t i = 0; i < data.size(); i += block_size)
+    {
+        size_t raw_sz = data.size() - i < block_size ? data.size() - i : block_size;
+        block.clear();
+        lz4_encode(&data[i], raw_sz, block);
+        blocks.push_back((uint32_t)out.size());
+        if (block.size() < raw_sz)
+            out.insert(out.end(), block.begin(), block.end());
+        else
+            out.insert(out.end(), &data[i], &data[i] + raw_sz);
+        if (out.size() > 0xffffffffu)
+            return false;
+    }
+    blocks.push_back((uint32_t)out.size());
+    data.swap(out);
+    return true;
+}
+
+bool write_file(const char* path, const std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    if (!data.empty())
+        fwrite(&data[0], 1, data.size(), f);
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
+
+bool write_inc(const char* path, const std::string& symbol, const std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    static const literal_table table;
+    std::string line;
+    line.reserve(literal_line_len * 4 + 8);
+
+    fprintf(f, "const unsigned char %s_[] =\n", symbol.c_str());
+    if (data.empty())
+        fputs("\"\"\n", f);
+    for (size_t i = 0; i < data.size(); i += literal_line_len)
+    {
+        size_t end = i + literal_line_len < data.size() ? i + literal_line_len : data.size();
+        line = "\"";
+        for (size_t j = i; j < end; j++)
+            line += table.chars[data[j]];
+        line += "\"\n";
+        fwrite(line.data(), 1, line.size(), f);
+    }
+    fputs(";\n", f);
+
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
+
+/*
+    'bin_path' is the file whose contents are the data (the resource itself, or the .lz4
+    file), and 'blocks' is empty unless the data is compressed
+*/
+bool write_cpp(const char* path, const std::string& symbol, const char* rez_path, const char* bin_path,
+                const std::string& inc_name, size_t size, const std::vector<uint32_t>& blocks)
+{
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+
+    char abs_path[PATH_MAX];
+    if (!realpath(bin_path, abs_path))
+    {
+        fclose(f);
+        return false;
+    }
+    // .incbin's argument is an assembler string inside a C string
+    std::string incbin = quote(quote(abs_path));
+    const char* base = strrchr(rez_path, '/');
+    base = base ? base + 1 : rez_path;
+    const char* sym = symbol.c_str();
+
+    fprintf(f, "// AUTO-GENERATED by mutantspider_rezpack, based on the contents of %s\n", base);
+    fprintf(f, "// DO NOT EDIT\n");
+    fprintf(f, "\n");
+    fprintf(f, "#include <mutantspider.h>\n");
+    fprintf(f, "\n");
+    fprintf(f, "namespace mutantspider {\n");
+    fprintf(f, "#if defined(MUTANTSPIDER_HOST) && defined(__ELF__)\n");
+    fprintf(f, "asm(\".pushsection .rodata\\n.globl %s_\\n.hidden %s_\\n.balign 16\\n%s_:\\n.incbin \\\"%s\\\"\\n.popsection\\n\");\n", sym, sym, sym, incbin.c_str());
+    fprintf(f, "extern \"C\" const unsigned char %s_[];\n", sym);
+    fprintf(f, "#elif defined(MUTANTSPIDER_HOST) && defined(__APPLE__)\n");
+    fprintf(f, "asm(\".const_data\\n.globl _%s_\\n.private_extern _%s_\\n.p2align 4\\n_%s_:\\n.incbin \\\"%s\\\"\\n.text\\n\");\n", sym, sym, sym, incbin.c_str());
+    fprintf(f, "extern \"C\" const unsigned char %s_[];\n", sym);
+    fprintf(f, "#else\n");
+    fprintf(f, "#include \"%s\"\n", quote(inc_name).c_str());
+    fprintf(f, "#endif\n");
+    fprintf(f, "extern const rez_file_ent %s;\n", sym);
+    if (blocks.empty())
+        fprintf(f, "const rez_file_ent %s = { &%s_[0], %lu };\n", sym, sym, (unsigned long)size);
+    else
+    {
+        fprintf(f, "const uint32_t %s_blocks_[] = {", sym);
+        for (size_t i = 0; i < blocks.size(); i++)
+            fprintf(f, "%s%s%u", i ? "," : "", i % 8 ? " " : "\n    ", (unsigned)blocks[i]);
+        fprintf(f, "\n};\n");
+        fprintf(f, "const rez_file_ent %s = { &%s_[0], %lu, &%s_blocks_[0], %lu };\n", sym, sym, (unsigned long)size, sym, (unsigned long)block_size);
+    }
+    fprintf(f, "}\n");
+
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
+
+// FNV-1a, which is plenty to tell one build's pack from another's
+uint64_t hash_data(const std::vector<unsigned char>& data)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        h ^= data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// the -p form, 'argv' starting at the pack file name
+int write_pack(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: mutantspider_rezpack -p <pack file> <url> <output .cpp> {[-c lz4] <symbol> <resource file>}...\n");
+        return 1;
+    }
+    const char* pack_path = argv[0];
+    const char* url = argv[1];
+    const char* cpp_path = argv[2];
+
+    struct packed_file
+    {
+        std::string             symbol;
+        size_t                  size;
+        size_t                  offset;
+        std::vector<uint32_t>   blocks;
+    };
+    std::vector<packed_file> files;
+    std::vector<unsigned char> pack;
+    for (int arg = 3; arg < argc;)
+    {
+        bool lz4 = false;
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+        {
+            if (strcmp(argv[arg + 1], "lz4") != 0)
+            {
+                fprintf(stderr, "mutantspider_rezpack: unknown compression \"%s\", the only supported one is lz4\n", argv[arg + 1]);
+                return 1;
+            }
+            lz4 = true;
+            arg += 2;
+        }
+        if (argc - arg < 2)
+        {
+            fprintf(stderr, "mutantspider_rezpack: -p needs a <symbol> and <resource file> for each file\n");
+            return 1;
+        }
+        const char* rez_path = argv[arg + 1];
+        packed_file file;
+        file.symbol = argv[arg];
+        arg += 2;
+
+        std::vector<unsigned char> data;
+        if (!read_file(rez_path, data))
+        {
+            fprintf(stderr, "mutantspider_rezpack: unable to read %s: %s\n", rez_path, strerror(errno));
+            return 1;
+        }
+        file.size = data.size();
+        file.offset = pack.size();
+        if (lz4 && !compress(data, file.blocks))
+        {
+            fprintf(stderr, "mutantspider_rezpack: %s is too large to compress\n", rez_path);
+            return 1;
+        }
+        pack.insert(pack.end(), data.begin(), data.end());
+        if (pack.size() > 0xffffffffu)
+        {
+            // asm.js builds have a 32 bit size_t
+            fprintf(stderr, "mutantspider_rezpack: %s is too large, a resource pack can't be over 4GB\n", pack_path);
+            return 1;
+        }
+        files.push_back(file);
+    }
+
+    if (!write_file(pack_path, pack))
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", pack_path, strerror(errno));
+        remove(pack_path);
+        return 1;
+    }
+
+    FILE* f = fopen(cpp_path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", cpp_path, strerror(errno));
+        return 1;
+    }
+    fprintf(f, "// AUTO-GENERATED by mutantspider_rezpack, the index of the resource pack %s\n", url);
+    fprintf(f, "// DO NOT EDIT\n");
+    fprintf(f, "\n");
+    fprintf(f, "#include <mutantspider.h>\n");
+    fprintf(f, "\n");
+    fprintf(f, "namespace mutantspider {\n");
+    fprintf(f, "const char* const rez_pack_url = \"%s?v=%016llx\";\n", quote(url).c_str(), (unsigned long long)hash_data(pack));
+    for (auto& file : files)
+    {
+        const char* sym = file.symbol.c_str();
+        fprintf(f, "extern const rez_file_ent %s;\n", sym);
+        if (file.blocks.empty())
+            fprintf(f, "const rez_file_ent %s = { 0, %lu, 0, %lu, %lu };\n", sym, (unsigned long)file.size, (unsigned long)block_size, (unsigned long)file.offset);
+        else
+        {
+            fprintf(f, "const uint32_t %s_blocks_[] = {", sym);
+            for (size_t i = 0; i < file.blocks.size(); i++)
+                fprintf(f, "%s%s%u", i ? "," : "", i % 8 ? " " : "\n    ", (unsigned)file.blocks[i]);
+            fprintf(f, "\n};\n");
+            fprintf(f, "const rez_file_ent %s = { 0, %lu, &%s_blocks_[0], %lu, %lu };\n", sym, (unsigned long)file.size, sym, (unsigned long)block_size, (unsigned long)file.offset);
+        }
+    }
+    fprintf(f, "}\n");
+
+    bool ok = !ferror(f);
+    if ((fclose(f) != 0) || !ok)
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", cpp_path, strerror(errno));
+        remove(cpp_path);
+        return 1;
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-p") == 0)
+        return write_pack(argc - 2, argv + 2);
+
+
+    bool lz4 = false;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
+    {
+        if (strcmp(argv[2], "lz4") != 0)
+        {
+            fprintf(stderr, "mutantspider_rezpack: unknown compression \"%s\", the only supported one is lz4\n", argv[2]);
+            return 1;
+        }
+        lz4 = true;
+        arg = 3;
+    }
+    if (argc - arg != 3)
+    {
+        fprintf(stderr, "usage: %s [-c lz4] <symbol> <resource file> <output .cpp>\n"
+                        "       %s -p <pack file> <url> <output .cpp> {[-c lz4] <symbol> <resource file>}...\n", argv[0], argv[0]);
+        return 1;
+    }
+    std::string symbol = argv[arg];
+    const char* rez_path = argv[arg + 1];
+    std::string cpp_path = argv[arg + 2];
+
+    // foo/bar.txt.cpp -> foo/bar.txt.inc (#included as "bar.txt.inc") and foo/bar.txt.lz4
+    std::string base_path = cpp_path;
+    if (base_path.size() > 4 && base_path.compare(base_path.size() - 4, 4, ".cpp") == 0)
+        base_path.resize(base_path.size() - 4);
+    std::string inc_path = base_path + ".inc";
+    std::string lz4_path = base_path + ".lz4";
+    std::string inc_name = inc_path.substr(inc_path.rfind('/') == std::string::npos ? 0 : inc_path.rfind('/') + 1);
+
+    std::vector<unsigned char> data;
+    if (!read_file(rez_path, data))
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to read %s: %s\n", rez_path, strerror(errno));
+        return 1;
+    }
+    size_t size = data.size();
+
+    std::vector<uint32_t> blocks;
+    if (lz4)
+    {
+        if (!compress(data, blocks))
+        {
+            fprintf(stderr, "mutantspider_rezpack: %s is too large to compress\n", rez_path);
+            return 1;
+        }
+        if (!write_file(lz4_path.c_str(), data))
+        {
+            fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", lz4_path.c_str(), strerror(errno));
+            remove(lz4_path.c_str());
+            return 1;
+        }
+    }
+
+    // write the .inc first, so a .cpp that is newer than its resource always has one
+    if (!write_inc(inc_path.c_str(), symbol, data))
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", inc_path.c_str(), strerror(errno));
+        remove(inc_path.c_str());
+        return 1;
+    }
+    if (!write_cpp(cpp_path.c_str(), symbol, rez_path, lz4 ? lz4_path.c_str() : rez_path, inc_name, size, blocks))
+    {
+        fprintf(stderr, "mutantspider_rezpack: unable to write %s: %s\n", cpp_path.c_str(), strerror(errno));
+        remove(cpp_path.c_str());
+        return 1;
+    }
+    return 0;
+}